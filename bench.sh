@@ -0,0 +1,124 @@
+#!/bin/sh
+# Reproducible timings for version5; run with `make bench` or
+# ./bench.sh [builtins|rc] [N]. Each builtins case runs a command N times
+# in a fresh shell with an empty HOME, both as input lines and inside a
+# loop; the rc cases time ~/.pucitshrc at startup with --startup-stats.
+
+SHELL_BIN=${SHELL_BIN:-./version5}
+N=${2:-2000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_us() {
+    echo $(($(date +%s%N) / 1000))
+}
+
+# Runs the lines in $WORK/lines through a fresh shell; prints microseconds
+run_us() {
+    start=$(now_us)
+    HOME=$WORK "$SHELL_BIN" --norc < "$WORK/lines" > /dev/null 2>&1
+    end=$(now_us)
+    echo $((end - start))
+}
+
+# The fastest of $1 runs of run_us
+best_us() {
+    best=
+    k=0
+    while [ $k -lt "$1" ]; do
+        t=$(run_us)
+        if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+        k=$((k + 1))
+    done
+    echo "$best"
+}
+
+# Prints "name  us/line  us/call" for a command. us/line runs N copies of
+# it as input lines, so it includes reading, the prompt and parsing.
+# us/call times a for loop of N passes that runs the command once per pass
+# and one that runs it 1 + REPEAT times (the third argument, default 1);
+# the difference is N * REPEAT calls with nothing else around them. When
+# REPEAT is above 1, each loop is timed three times and the fastest kept.
+bench_cmd() {
+    name=$1
+    cmd=$2
+    repeat=${3:-1}
+    tries=1
+    [ "$repeat" -gt 1 ] && tries=3
+    i=0
+    while [ $i -lt "$N" ]; do
+        echo "$cmd"
+        i=$((i + 1))
+    done > "$WORK/lines"
+    line=$(run_us)
+    words=$(seq "$N" | tr '\n' ' ')
+    body="$cmd"
+    i=0
+    while [ $i -lt "$repeat" ]; do
+        body="$body; $cmd"
+        i=$((i + 1))
+    done
+    echo "for i in $words; do $cmd; done" > "$WORK/lines"
+    once=$(best_us $tries)
+    echo "for i in $words; do $body; done" > "$WORK/lines"
+    more=$(best_us $tries)
+    awk -v n="$N" -v l="$line" -v c=$((more - once)) -v r="$repeat" -v name="$name" \
+        'BEGIN { printf "  %-28s %9.1f %9.2f\n", name, l / n, c / (n * r) }'
+}
+
+# Builtins run in the shell process; the same commands from /bin fork and
+# exec. Builtins are called 20 times per pass so their cost stands out from
+# the variation in startup time.
+bench_builtins() {
+    echo "builtins ($N lines / passes)      us/line   us/call"
+    bench_cmd "true" "true" 20
+    bench_cmd "/bin/true" "/bin/true"
+    bench_cmd "echo x > /dev/null" "echo x > /dev/null" 20
+    bench_cmd "/bin/echo x > /dev/null" "/bin/echo x > /dev/null"
+    bench_cmd "test -n x" "test -n x" 20
+    bench_cmd "/usr/bin/test -n x" "/usr/bin/test -n x"
+}
+
+# Prints "name  parsed  snapshot": the mean rc time over 20 startups that
+# parse an rc file of N/10 copies of a line, and over 20 that use the
+# snapshot written by the first
+rc_startup() {
+    name=$1
+    line=$2
+    i=0
+    while [ $i -lt $((N / 10)) ]; do
+        echo "$line" | sed "s/@/$i/g"
+        i=$((i + 1))
+    done > "$WORK/.pucitshrc"
+    for mode in parsed snapshot; do
+        i=0
+        while [ $i -lt 20 ]; do
+            [ $mode = parsed ] && rm -f "$WORK/.pucitshrc.snapshot"
+            echo exit | HOME=$WORK "$SHELL_BIN" --startup-stats 2>&1 > /dev/null | grep -a '^startup'
+            i=$((i + 1))
+        done > "$WORK/$mode"
+    done
+    awk -v name="$name" '
+        { ms = $0; sub(/.*rc /, "", ms); sub(/ ms.*/, "", ms) }
+        FILENAME ~ /parsed$/ { p += ms; np++ }
+        FILENAME ~ /snapshot$/ { s += ms; ns++ }
+        END { printf "  %-28s %9.3f ms %9.3f ms\n", name, p / np, s / ns }' "$WORK/parsed" "$WORK/snapshot"
+    rm -f "$WORK/.pucitshrc" "$WORK/.pucitshrc.snapshot"
+}
+
+# Simple lines are stored as words, other lines and functions as their
+# parse trees with the bytecode compiled for them
+bench_rc() {
+    echo "rc file startup ($((N / 10)) lines each)       parsed  from snapshot"
+    rc_startup "assignments" "V@=value@"
+    rc_startup "commands" "cd ."
+    rc_startup "if/for lines" 'if test -n x; then V=@; else for x in a b; do V=$x; done; fi'
+    rc_startup "function definitions" 'f@() { if test -n "$1"; then echo $1; else for x in a b; do V=$x; done; fi; }'
+}
+
+case ${1:-all} in
+builtins) bench_builtins ;;
+rc) bench_rc ;;
+all) bench_builtins; bench_rc ;;
+*) echo "Usage: $0 [builtins|rc|all] [N]" >&2; exit 2 ;;
+esac
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Regression checks for version5; run with `make check` or ./check.sh.
+# Each case feeds its lines to a fresh shell in an empty directory (also
+# its HOME) and compares what they wrote to the file out with the expected
+# text. The shell's own output and prompts are not compared.
+
+SHELL_BIN=${SHELL_BIN:-$(pwd)/version5}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failed=0
+
+# check NAME INPUT EXPECTED
+check() {
+    rm -rf "$WORK/case"
+    mkdir "$WORK/case"
+    printf '%s\n' "$2" | (cd "$WORK/case" && HOME=$WORK/case timeout 10 "$SHELL_BIN" --norc > /dev/null 2>&1)
+    got=$(cat "$WORK/case/out" 2>/dev/null)
+    if [ "$got" = "$3" ]; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        printf '  expected: %s\n  got:      %s\n' "$3" "$got"
+        failed=1
+    fi
+}
+
+# The value of an assignment is not split into fields
+check 'x=$(echo a b)' 'x=$(echo a b); echo "$x" > out' 'a b'
+check 'x=`echo a b` y=$v' 'v="1  2"; x=`echo a b` y=$v; echo "$x|$y" > out' 'a b|1  2'
+check 'unquoted $(...) argument' 'echo $(echo a   b) > out' 'a b'
+
+# wait returns the status of a job that finished before it was called
+check 'wait %1 after the job left' 'sh -c "exit 3" &
+sleep 0.3
+wait %1; echo $? > out' '3'
+check 'wait 1 after the job left' 'sh -c "exit 4" &
+sleep 0.3
+wait 1; echo $? > out' '4'
+check 'wait $! and a running %1' 'sh -c "sleep 0.2; exit 5" &
+wait %1; echo $? > out
+sh -c "exit 6" &
+wait $!; echo $? >> out' '5
+6'
+
+exit $failed
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+
+// Client for the PucitShell session server (version5 --server). It hands
+// its stdin, stdout and stderr to a server session over the socket, so the
+// commands run with the caller's terminal, files and pipes, and exits with
+// the status of the last command, like sh -c.
+
+#define SESSION_MSG 65536    // Largest request a server session accepts
+
+// Function declarations
+const char* default_socket();
+int session_connect(const char *path);
+int send_request(int conn, char type, const char *text, int pass_fds);
+int run_remote(int conn, const char *cmd);
+
+// Default server socket: $PUCITSH_SOCKET, else one per user under /tmp
+const char* default_socket() {
+    static char path[108];
+    const char *env = getenv("PUCITSH_SOCKET");
+    if (env != NULL && *env) return env;
+    snprintf(path, sizeof(path), "/tmp/pucitsh-%d.sock", (int)getuid());
+    return path;
+}
+
+// Connects to the server and opens a session in the current directory
+int session_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char cwd[PATH_MAX];
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "pucitsh-client: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        close(conn);
+        return -1;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) cwd[0] = '\0';
+    if (send_request(conn, 'S', cwd, 1) < 0) {
+        perror("send");
+        close(conn);
+        return -1;
+    }
+    return conn;
+}
+
+// Sends one request; with pass_fds set, fds 0-2 travel along as SCM_RIGHTS
+int send_request(int conn, char type, const char *text, int pass_fds) {
+    size_t len = strlen(text);
+    if (len + 1 >= SESSION_MSG) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    char *buf = malloc(len + 1);
+    buf[0] = type;
+    memcpy(buf + 1, text, len);
+
+    struct iovec iov = { buf, len + 1 };
+    struct msghdr msg = {0};
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (pass_fds) {
+        int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    }
+    ssize_t n = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    free(buf);
+    return n < 0 ? -1 : 0;
+}
+
+// Runs one command line in the session and returns its exit status
+int run_remote(int conn, const char *cmd) {
+    int status;
+    if (send_request(conn, 'C', cmd, 0) < 0) {
+        perror("send");
+        return 2;
+    }
+    ssize_t n = recv(conn, &status, sizeof(status), 0);
+    if (n != sizeof(status)) {
+        if (n < 0) perror("recv");
+        return -1; // Session ended, e.g. by exit
+    }
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = default_socket();
+    const char *cmd = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:c:")) != -1) {
+        switch (opt) {
+        case 's': path = optarg; break;
+        case 'c': cmd = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-s socket] [-c command | script]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    int conn = session_connect(path);
+    if (conn < 0) return 2;
+    if (cmd != NULL) {
+        int status = run_remote(conn, cmd);
+        return status < 0 ? 0 : status;
+    }
+
+    // Without -c, run a script (or stdin) one line at a time in one session
+    FILE *in = stdin;
+    if (optind < argc && (in = fopen(argv[optind], "r")) == NULL) {
+        perror(argv[optind]);
+        return 2;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int status = 0;
+    while ((len = getline(&line, &cap, in)) > 0) {
+        if (line[len - 1] == '\n') line[len - 1] = '\0';
+        int rc = run_remote(conn, line);
+        if (rc < 0) break;
+        status = rc;
+    }
+    free(line);
+    close(conn);
+    return status;
+}
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include "pucitsh_core.h"
+
+// Minimal shell for container entrypoints and init: no prompt, readline,
+// history or jobs, only the shared engine with WITH_REDIRECT and
+// WITH_PIPES. Built static and stripped (see the Makefile), it starts
+// without loading any library.
+//
+//   pucitsh-tiny -c 'cmd | cmd > file'   Run one line
+//   pucitsh-tiny [script]                Run a script, or stdin, line by line
+//
+// Exits with the status of the last command. As PID 1 it reaps orphans
+// while waiting, and passes SIGTERM and SIGINT on to the commands it runs.
+
+// Forwards a termination signal to the rest of our process group
+static void forward_signal(int sig) {
+    signal(sig, SIG_IGN); // Not to ourselves
+    kill(0, sig);
+    signal(sig, forward_signal);
+}
+
+int main(int argc, char *argv[]) {
+    int status = 0;
+    signal(SIGTERM, forward_signal);
+    signal(SIGINT, forward_signal);
+
+    if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+        return run_line(strdup(argv[2]));
+    }
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        fprintf(stderr, "Usage: %s [-c command | script]\n", argv[0]);
+        return 2;
+    }
+
+    FILE *in = stdin;
+    if (argc == 2 && (in = fopen(argv[1], "r")) == NULL) {
+        perror(argv[1]);
+        return 127;
+    }
+    char *cmdline;
+    while ((cmdline = read_cmd(NULL, in)) != NULL) {
+        if (cmdline[0] == '#') { // Comment, e.g. a #! line
+            free(cmdline);
+            continue;
+        }
+        status = run_line(cmdline);
+    }
+    return status;
+}
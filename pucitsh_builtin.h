@@ -0,0 +1,35 @@
+#ifndef PUCITSH_BUILTIN_H
+#define PUCITSH_BUILTIN_H
+
+// Stable C ABI for builtins loaded into PucitShell with `enable -f lib.so name`.
+//
+// A plugin exports one `struct pucitsh_builtin` per command, named
+// `<name>_builtin`, e.g.:
+//
+//     static int hello(int argc, char **argv, int in_fd, int out_fd, int err_fd) {
+//         dprintf(out_fd, "hello from %s\n", argv[0]);
+//         return 0;
+//     }
+//     struct pucitsh_builtin hello_builtin = {
+//         PUCITSH_BUILTIN_ABI, "hello", hello, "hello - Say hello"
+//     };
+//
+// Build it with `gcc -shared -fPIC -o hello.so hello.c`. The symbol is looked up
+// once when the plugin is enabled; afterwards the command dispatches like any
+// other builtin, in the shell process or inside a pipeline stage.
+
+#define PUCITSH_BUILTIN_ABI 1   // Bumped whenever this header changes incompatibly
+
+// Runs the builtin. argv is NULL-terminated with argv[0] the command name.
+// Input, output and errors must go through the given fds (redirections and
+// pipes are already applied to them). Returns the exit status.
+typedef int (*pucitsh_builtin_fn)(int argc, char **argv, int in_fd, int out_fd, int err_fd);
+
+struct pucitsh_builtin {
+    int abi;                    // Must be PUCITSH_BUILTIN_ABI
+    const char *name;           // Command name
+    pucitsh_builtin_fn fn;      // Implementation
+    const char *help;           // One-line help shown by `help`, or NULL
+};
+
+#endif
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef WITH_READLINE
+#include <readline/readline.h>
+#include <readline/history.h>
+#endif
+#include "pucitsh_core.h"
+
+// Engine shared by version1-4 and pucitsh-tiny; the features compiled in
+// are listed in pucitsh_core.h
+
+#ifdef WITH_HISTORY
+static char *history[HIST_SIZE]; // Line N (from 1) is history[(N - 1) % HIST_SIZE]
+static int history_count = 0;    // Lines added so far
+#endif
+
+// Exit status from a wait() status: the exit code, or 128 + signal
+static int exit_status(int status) {
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+#ifdef WITH_JOBS
+// Reports the background processes that have ended since the last prompt
+static void reap_jobs(void) {
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        printf("[Background process %d completed]\n", pid);
+    }
+}
+#endif
+
+char* read_cmd(const char *prompt, FILE *fp) {
+#ifdef WITH_JOBS
+    reap_jobs();
+#endif
+#ifdef WITH_READLINE
+    rl_instream = fp;
+    char *line = readline(prompt != NULL ? prompt : "");
+    if (line != NULL && *line) add_history(line); // For arrow-key recall
+    return line;
+#else
+    if (prompt != NULL) {
+        printf("%s", prompt);
+        fflush(stdout);
+    }
+    int c, pos = 0, size = MAX_LEN;
+    char *cmdline = malloc(size);
+    while ((c = getc(fp)) != EOF) {
+        if (c == '\n') break;
+        if (pos + 1 == size) cmdline = realloc(cmdline, size *= 2); // Keep room for the NUL
+        cmdline[pos++] = c;
+    }
+    if (c == EOF && pos == 0) {
+        free(cmdline);
+        return NULL;
+    }
+    cmdline[pos] = '\0';
+    return cmdline;
+#endif
+}
+
+char** tokenize(char *cmdline) {
+    int argnum = 0, cap = MAXARGS + 1;
+    char **arglist = malloc(cap * sizeof(char *));
+    char *cp = cmdline;
+    while (1) {
+        while (*cp == ' ' || *cp == '\t') cp++;
+        if (*cp == '\0') break;
+        if (argnum + 1 == cap) arglist = realloc(arglist, (cap *= 2) * sizeof(char *));
+        arglist[argnum++] = cp;
+        while (*cp != '\0' && *cp != ' ' && *cp != '\t') cp++;
+        if (*cp != '\0') *cp++ = '\0';
+    }
+    if (argnum == 0) {
+        free(arglist);
+        return NULL;
+    }
+    arglist[argnum] = NULL;
+    return arglist;
+}
+
+#ifdef WITH_REDIRECT
+// Applies "< file" and "> file" in a child about to exec args and removes
+// them from args; the parent never holds the files open
+static int redirect(char **args) {
+    int j = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        int out = strcmp(args[i], ">") == 0;
+        if (!out && strcmp(args[i], "<") != 0) {
+            args[j++] = args[i];
+            continue;
+        }
+        if (args[i + 1] == NULL) {
+            fprintf(stderr, "syntax error: no file after %s\n", args[i]);
+            return -1;
+        }
+        int fd = out ? open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                     : open(args[i + 1], O_RDONLY);
+        if (fd < 0) {
+            perror(args[i + 1]);
+            return -1;
+        }
+        dup2(fd, out ? STDOUT_FILENO : STDIN_FILENO);
+        close(fd);
+        i++;
+    }
+    args[j] = NULL;
+    return 0;
+}
+#endif
+
+// Waits for the processes of a foreground command and returns the status
+// of the last one. Other children that end meanwhile are reaped as well:
+// finished background jobs, or orphans when pucitsh-tiny runs as init.
+static int wait_stages(pid_t *pids, int n) {
+    int left = 0, status, last = pids[n - 1] > 0 ? 0 : 1;
+    for (int i = 0; i < n; i++) left += pids[i] > 0;
+    while (left > 0) {
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        int k = 0;
+        while (k < n && pids[k] != pid) k++;
+        if (k == n) {
+#ifdef WITH_JOBS
+            printf("[Background process %d completed]\n", pid);
+#endif
+            continue;
+        }
+        left--;
+        if (k == n - 1) last = exit_status(status);
+    }
+    return last;
+}
+
+int execute(char **arglist) {
+#ifdef WITH_JOBS
+    // A & ends the command and sends it to the background
+    int background = 0;
+    for (int i = 0; arglist[i] != NULL; i++) {
+        if (strcmp(arglist[i], "&") == 0) {
+            arglist[i] = NULL;
+            background = 1;
+            break;
+        }
+    }
+    if (arglist[0] == NULL) return 0;
+#endif
+
+    // Split the words into pipeline stages at each |
+    int nstages = 1;
+#ifdef WITH_PIPES
+    for (int i = 0; arglist[i] != NULL; i++) nstages += strcmp(arglist[i], "|") == 0;
+#endif
+    char **stages[nstages];
+    stages[0] = arglist;
+#ifdef WITH_PIPES
+    for (int i = 0, k = 1; arglist[i] != NULL; i++) {
+        if (strcmp(arglist[i], "|") == 0) {
+            arglist[i] = NULL;
+            stages[k++] = &arglist[i + 1];
+        }
+    }
+    for (int k = 0; k < nstages; k++) {
+        if (stages[k][0] == NULL) {
+            fprintf(stderr, "syntax error near |\n");
+            return 2;
+        }
+    }
+#endif
+
+    pid_t pids[nstages];
+    int in_fd = STDIN_FILENO;
+    fflush(stdout); // Children must not inherit pending output
+    for (int i = 0; i < nstages; i++) {
+        int fd[2] = { -1, STDOUT_FILENO };
+#ifdef WITH_PIPES
+        // Close-on-exec, so each stage keeps only the ends dup'ed onto 0 and 1
+        if (i < nstages - 1 && pipe2(fd, O_CLOEXEC) < 0) {
+            perror("pipe failed");
+            fd[0] = -1;
+            fd[1] = STDOUT_FILENO;
+        }
+#endif
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            if (in_fd != STDIN_FILENO) dup2(in_fd, STDIN_FILENO);
+            if (fd[1] != STDOUT_FILENO) dup2(fd[1], STDOUT_FILENO);
+#ifdef WITH_REDIRECT
+            if (redirect(stages[i]) < 0) _exit(1);
+            if (stages[i][0] == NULL) _exit(0); // Only redirections, e.g. "> file"
+#endif
+            execvp(stages[i][0], stages[i]);
+            perror(stages[i][0]);
+            _exit(127);
+        }
+        if (pids[i] < 0) perror("fork failed");
+        if (in_fd != STDIN_FILENO) close(in_fd);
+        if (fd[1] != STDOUT_FILENO) close(fd[1]);
+        in_fd = fd[0] >= 0 ? fd[0] : STDIN_FILENO;
+    }
+
+#ifdef WITH_JOBS
+    if (background) {
+        printf("[Background PID %d]\n", pids[nstages - 1]);
+        return 0;
+    }
+#endif
+    return wait_stages(pids, nstages);
+}
+
+#ifdef WITH_HISTORY
+void add_to_history(const char *cmd) {
+    free(history[history_count % HIST_SIZE]);
+    history[history_count++ % HIST_SIZE] = strdup(cmd);
+}
+
+// Returns a copy of line N for !N, or of the Nth most recent for !-N
+char* fetch_from_history(const char *cmd) {
+    int n = cmd[1] == '-' ? history_count + 1 - atoi(cmd + 2) : atoi(cmd + 1);
+    if (n < 1 || n > history_count || n <= history_count - HIST_SIZE) {
+        fprintf(stderr, "No such command in history.\n");
+        return NULL;
+    }
+    return strdup(history[(n - 1) % HIST_SIZE]);
+}
+#endif
+
+int run_line(char *cmdline) {
+    int status = 0;
+#ifdef WITH_HISTORY
+    if (cmdline[0] == '!') {
+        char *newcmd = fetch_from_history(cmdline);
+        free(cmdline);
+        if (newcmd == NULL) return 1;
+        printf("Repeating command: %s\n", newcmd);
+        cmdline = newcmd;
+    }
+    if (cmdline[0] != '\0') add_to_history(cmdline);
+#endif
+    char **arglist = tokenize(cmdline);
+    if (arglist != NULL) {
+        status = execute(arglist);
+        free(arglist);
+    }
+    free(cmdline);
+    return status;
+}
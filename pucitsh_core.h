@@ -0,0 +1,43 @@
+#ifndef PUCITSH_CORE_H
+#define PUCITSH_CORE_H
+
+#include <stdio.h>
+
+// Shared engine of version1-4 and pucitsh-tiny: line input, tokenizing,
+// history recall and command execution. Each feature is chosen when the
+// engine is compiled (see the Makefile); one left out is not compiled at
+// all, so it costs neither code nor a branch when running commands.
+//
+//   WITH_READLINE   Read lines with GNU readline (link with -lreadline)
+//   WITH_HISTORY    Recall the last HIST_SIZE lines with !N and !-1
+//   WITH_PIPES      cmd1 | cmd2 | ...
+//   WITH_JOBS       cmd & runs in the background, reported when it ends
+//   WITH_REDIRECT   < file and > file
+
+#define MAX_LEN 512           // Initial size of the line buffer and prompt
+#define MAXARGS 10            // Initial size of the argument list; it grows
+#define HIST_SIZE 10          // Lines kept for !N and !-1
+
+// Prints the prompt (unless NULL) and reads one line from fp; returns it
+// malloc'd without the newline, or NULL at end of input
+char* read_cmd(const char *prompt, FILE *fp);
+
+// Splits a line in place on spaces and tabs; returns a malloc'd
+// NULL-terminated list pointing into cmdline, or NULL for an empty line.
+// Free the list with free(); the words belong to cmdline.
+char** tokenize(char *cmdline);
+
+// Runs a tokenized command (with |, <, > and a trailing & where compiled
+// in) and returns its exit status, or that of the last pipeline stage
+int execute(char **arglist);
+
+// History recall, expansion of !N and recording, tokenizing and execution
+// of one line, which it frees; returns the exit status
+int run_line(char *cmdline);
+
+#ifdef WITH_HISTORY
+void add_to_history(const char *cmd);
+char* fetch_from_history(const char *cmd);
+#endif
+
+#endif
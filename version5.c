@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,13 +9,71 @@
 #include <limits.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <fnmatch.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <linux/perf_event.h>
 #include <readline/readline.h>
 #include <readline/history.h>
+#include "pucitsh_builtin.h"
 
-#define MAX_LEN 512          // Maximum length of the command line input
 #define MAXARGS 10           // Maximum number of arguments for a command
-#define ARGLEN 30            // Maximum length of each argument
-#define HIST_SIZE 10         // Number of commands to retain in history
+#define MAXJOBS 1024         // Maximum number of background jobs tracked at once
+#define HIST_SIZE 1000       // Number of commands to retain in history
+#define HIST_ARENA_MIN 4096  // Initial size of the history string arena
+#define SUGGEST_TOP 4        // Best-ranked texts kept per prefix-trie node
+#define SUGGEST_HALFLIFE (3 * 24 * 3600.0) // Seconds for a use to lose half its weight
+#define SUGGEST_CWD_BONUS 4.0 // Rank factor for texts last run in this cwd
+#define CHILD_RING 256       // Finished-child slots shared with the signal handler (power of two)
+#define MAX_JOB_RLIMITS 6    // Per-job resource limits a limit prefix can carry
+#define MAX_PROCSUBS 16      // Process substitutions alive for one command line
+#define CAPTURE_CHUNK 65536  // Read size used when capturing command output
+#define MAX_BUILTINS 64      // Builtin table size including loaded plugins
+#define RC_FILE ".pucitshrc" // Startup file in the home directory
+#define RC_SNAPSHOT ".pucitshrc.snapshot" // Parsed form of RC_FILE
+#define FLOW_BREAK 1         // Pending control transfers, see flow
+#define FLOW_CONTINUE 2
+#define FLOW_RETURN 3
+#define FUNC_MAXDEPTH 1000   // Nested function calls before giving up
+#define RC_MAGIC "PUCITRC4"  // Identifies (and versions) the snapshot layout
+#define RC_COMPOUND 0xFFFFFFFFu // Stage count of a line stored as source text
+#define RC_TREE 0xFFFFFFFEu  // Stage count of a parsed tree and its bytecode
+#define RC_NULL 0xFFFFFFFFu  // A missing word list or node in a stored tree
+#define SESSION_MSG 65536    // Largest request a server session accepts
+#define JOB_OUTPUT_MAX 65536 // Default per-job capture ring size
+#define JOB_EXITS 64         // Finished jobs whose status wait can still report
+#define TIMER_QUEUE_MAX 64   // Runs an every -q timer can have waiting
+#define PROFILE_EVENTS 7     // Counters opened on each profiled process
+#define ZDB_FILE ".pucitsh_z" // Directory frecency database in the home directory
+#define ZDB_MAGIC "PUCITZ01" // Identifies (and versions) the database layout
+#define ZDB_PATH 232         // Longest directory path the database records
+#define ZDB_MIN_SLOTS 256    // Initial table size (power of two)
+#define ZDB_MAXAGE 10000.0   // Total score that triggers an aging step
+#define ZDB_AGING 0.9        // Factor every score shrinks by per aging step
+#define ZDB_SWEEP 8          // Entries aged (or dropped) per recorded visit
+
+// How a forked process is grouped (see job_child_setup())
+#define PG_NONE 0            // Stay in the shell's process group
+#define PG_BACKGROUND 1      // Own process group
+#define PG_FOREGROUND 2      // Own process group that also gets the terminal
+#define CGROUP_ROOT "/sys/fs/cgroup"
 
 // ANSI color codes to customize shell prompt appearance
 #define COLOR_RESET   "\033[0m"
@@ -22,58 +81,709 @@
 #define COLOR_GREEN   "\033[32m"
 #define COLOR_CYAN    "\033[36m"
 
+// Scheduling attributes applied to a child between fork and exec
+struct exec_attrs {
+    int set_cpus;               // Whether cpus should be applied
+    cpu_set_t cpus;             // CPU affinity mask
+    int set_nice;               // Whether nice should be applied
+    int nice;                   // Absolute nice level
+    int numa_mode;              // MPOL_* memory policy, or -1 to inherit
+    unsigned long numa_nodes;   // Node mask for numa_mode
+    long long mem_max;          // Job memory.max in bytes, or -1 for none
+    int cpu_pct;                // Job cpu.max quota in percent of a CPU, or 0
+    int nrlimits;               // Number of entries used in rlimits
+    struct {
+        int resource;           // RLIMIT_* constant
+        rlim_t value;           // Soft and hard limit for the job
+    } rlimits[MAX_JOB_RLIMITS];
+    char *cgroup;               // Cgroup directory the child joins, or NULL
+};
+
+// Bounded in-memory copy of a background job's stdout and stderr; once
+// full, the oldest bytes are overwritten (after going to the spill file)
+struct job_output {
+    int fd;                     // Non-blocking read end of the job's pipe, -1 at EOF
+    char *ring;                 // cap bytes of captured output
+    size_t cap;
+    unsigned long long total;   // Bytes received; the ring keeps the last cap
+    int spill_fd;               // File that receives overwritten bytes, or -1
+    char *spill_path;           // Spill file, created on the first overflow
+};
+
+// Header of the directory database, a hash table of fixed-size entries
+// mapped shared by every session. Aging is lazy: an aging step only bumps
+// epoch, and each entry catches up when it is next visited or swept.
+struct zdb_header {
+    char magic[8];              // ZDB_MAGIC
+    unsigned nslots;            // Entries that follow (power of two)
+    unsigned used;              // Entries in use
+    unsigned epoch;             // Aging steps taken so far
+    unsigned sweep;             // Next slot the incremental sweep looks at
+    double total;               // Sum of all scores as of epoch
+};
+
+// One visited directory; linear probing on the path hash
+struct zdb_entry {
+    double score;               // Visits, aged up to the entry's epoch
+    long long last;             // Time of the last visit
+    unsigned epoch;             // Epoch score was last aged to
+    unsigned hash;              // Hash of path, 0 for a free slot
+    char path[ZDB_PATH];
+};
+
+// Counters of a job run under the profile prefix: a set of perf events per
+// process, attached by the shell before the process is let go to exec
+struct profile {
+    int (*fds)[PROFILE_EVENTS]; // Event fds per process, -1 where unavailable
+    struct rusage *usage;       // Filled in by wait4() as each process exits
+    struct timespec start;      // When the job was started
+    int hw_errno;               // Why hardware counters failed, or 0
+};
+
+// What jobs -l and jtop keep per process between refreshes: /proc files
+// opened once and re-read with pread(), and the last reading
+struct proc_sample {
+    int stat_fd;                // /proc/<pid>/stat, -1 if not open, -2 once gone
+    int io_fd;                  // /proc/<pid>/io, -1 if not open, -2 if unreadable
+    unsigned long long ticks;   // utime + stime at the last refresh
+    double when;                // CLOCK_MONOTONIC time of the last refresh, 0 if none
+    char state;                 // State letter (R, S, D, T, Z...), 0 if unknown
+    char comm[16];              // Program name
+    double cpu;                 // Percent of one CPU since the previous refresh
+    double runtime;             // Seconds since the process started
+    long long rss;              // Resident bytes
+    unsigned long long rchar, wchar; // Bytes read and written
+};
+
+// A job is a command or pipeline started with & or stopped with Ctrl-Z; its
+// processes share one process group, so it can be stopped, continued and
+// signalled as a whole
+struct job {
+    pid_t pid;                  // Last process of the job; its status is the job's
+    pid_t pgid;                 // Process group of the job, 0 if it has none
+    pid_t *pids;                // Processes of the job, 0 once reaped
+    int *statuses;              // Exit status of each process once reaped
+    char **cgroups;             // Cgroup created for each process, or NULL
+    int nprocs;                 // Entries in pids and cgroups
+    int live;                   // Processes not yet reaped
+    int stopped;                // Stopped by Ctrl-Z or a signal
+    char *cmd;                  // Command text shown by jobs, fg and bg
+    struct job_output *out;     // Captured output, or NULL
+    int done;                   // Finished but kept until its output is read
+    int status;                 // Exit status once done
+    struct profile *prof;       // Counters when run under profile, or NULL
+    struct proc_sample *samples; // Per process once jobs -l or jtop ran, or NULL
+    int timer;                  // Id of the after/every timer that started it, or 0
+};
+
+// A command scheduled by after or every. Timers wait in a binary min-heap
+// ordered by due time, and one timerfd polled by the main loop is armed
+// for the earliest of them.
+struct timer {
+    int id;                     // Shown as @N by jobs and timers
+    char *cmd;                  // Command line, parsed again for each run
+    long long interval;         // Period in ns for every, 0 for after
+    long long jitter;           // Each run starts up to this many ns late
+    long long nominal;          // Unjittered CLOCK_MONOTONIC ns of the next run
+    long long due;              // nominal plus this run's jitter
+    int queue;                  // Overlap policy: queue runs (1) or skip them (0)
+    int pending;                // Queued runs waiting for the current one
+    unsigned runs;              // Runs started
+    unsigned skipped;           // Ticks that started no run
+    int last_status;            // Exit status of the last run, -1 if none yet
+};
+
+// A command run inside the shell process. "pure" builtins do not change
+// shell state, so $(...) may run them without a fork.
+struct builtin {
+    const char *name;
+    int (*fn)(char **arglist);  // Returns the exit status
+    int pure;
+    const char *help;           // Line shown by help, or NULL
+    pucitsh_builtin_fn ext;     // Entry point of a plugin builtin, or NULL
+    void *handle;               // dlopen() handle of the plugin
+    int disabled;               // Hidden by enable -n
+};
+
+// Header of the rc snapshot: identifies the rc file and shell build it was
+// made from, followed by nlines parsed command lines. Each line is a u32
+// stage count, each stage a u32 word count, and each word a u32 length and
+// its NUL-terminated bytes padded to 4 bytes; a background job's last stage
+// ends in an "&" word. Other lines (lists, && / ||, groups, control commands
+// and function definitions) are stored as RC_TREE and a tree written by
+// snap_tree(). A line that does not parse is stored as RC_COMPOUND followed
+// by its text as a single word.
+struct rc_snapshot {
+    char magic[8];
+    char build_id[72];          // Build ID of the shell that wrote it
+    long long rc_mtime_sec;     // Modification time of the rc file
+    long long rc_mtime_nsec;
+    long long rc_size;          // Size of the rc file
+    unsigned nlines;            // Command lines that follow
+    unsigned size;              // Total snapshot size in bytes
+};
+
+// Node types of a parsed command line
+enum { N_CMD, N_PIPE, N_AND, N_OR, N_SEQ, N_BG, N_SUBSHELL, N_GROUP,
+       N_IF, N_WHILE, N_UNTIL, N_FOR, N_CASE, N_ITEM, N_FUNC };
+
+// A parsed command line: a simple command, or a pipeline, && / || chain,
+// list, background job, ( subshell ) or { group } of other nodes. Control
+// commands keep their parts as kids: N_IF condition/body pairs and an
+// optional else, N_WHILE/N_UNTIL condition and body, N_FOR its body (words
+// are the variable and the list), N_CASE its N_ITEMs (words are the
+// patterns, the kid the body) and N_FUNC its body (words[0] is the name).
+struct node {
+    int type;
+    char **words;               // N_CMD: the words, pointing into the line
+    struct node **kids;         // Pipeline stages, list items or the body
+    int nkids;
+    char **redirs;              // Redirection words after ) or }, or NULL
+    int has_in;                 // N_FOR: an in list was given
+    struct code *code;          // Bytecode of a control command once compiled
+};
+
+// Bytecode instruction. Control commands are compiled once into a flat
+// array of these; simple commands and pipelines stay tree nodes run by
+// OP_EXEC, so their words are never re-parsed.
+struct insn {
+    int op;                     // OP_* opcode
+    int a, b;                   // Jump targets
+    struct node *node;          // Node the instruction works on
+};
+
+struct code {
+    struct insn *insns;
+    int n, cap;
+    int loops;                  // Deepest loop nesting, sizes the VM's loop stack
+};
+
+// An environment string set by var_set(), rewritten in place while the
+// new value fits
+struct var_buf {
+    char *str;                  // "NAME=value" as installed with putenv()
+    size_t name_len;
+    size_t cap;                 // Bytes allocated for str
+};
+
+// A shell function: its definition is parsed and compiled once when it is
+// defined, or loaded already compiled from the rc snapshot
+struct func {
+    char *name;
+    char *src;                  // Storage the words of tree point into
+    struct node *tree;          // Parsed definition
+    struct node *def;           // Its N_FUNC node; words[0] is the name
+    struct code code;           // Compiled body
+    int busy;                   // Calls running
+    int dead;                   // Replaced while busy: freed by the last call
+};
+
+// Where line_incomplete() stopped on a line, so that it can carry on over
+// text appended to it instead of scanning it all again
+struct line_scan {
+    size_t pos;                 // Offset scanned up to
+    char quote;                 // Open quote character, or 0
+    int after_pipe;             // Only blanks since a '|'
+};
+
 // Function declarations
 int execute(char *arglist[], int background);
-int execute_pipeline(char ***cmds, int num_cmds);
+int execute_pipeline(char ***cmds, int num_cmds, int background, struct node **nodes);
+int launch_pipeline(char ***cmds, int num_cmds, int in_fd, int out_fd, pid_t *pids, char **cgroups, int group, struct profile *prof, struct node **nodes);
+char* scan_word(char *p);
+char** split_pipeline(char *cmdline, int *num_cmds);
+int line_incomplete(const char *s, struct line_scan *scan);
+char** expand_args(char **args);
+char* expand_one(char *word);
+void var_set(const char *name, const char *value);
+char* capture_output(const char *cmd, size_t *len);
+long long eval_arith(const char *expr, int *err);
+int is_builtin(char **arglist);
+struct builtin* find_builtin(const char *name);
+int run_builtin(char **arglist);
+int run_command_line(char *cmdline);
+int run_stages(char ***stages, int num_cmds);
+int run_pipeline(char ***stages, int num_cmds, int background, struct node **nodes);
+struct node* parse_line(char *line, int *incomplete);
+void node_free(struct node *n);
+char* node_text(struct node *n);
+int input_incomplete(const char *line, struct line_scan *scan);
+int exec_node(struct node *n, int tail);
+void run_subshell(struct node *n);
+int vm_run(struct code *code);
+struct func* find_function(const char *name);
+int call_function(char **arglist);
+int load_rc(int *from_snapshot);
+int run_server(const char *path);
+void procsub_inherit(char **argv);
+void procsub_finish(int background);
 char** tokenize(char* cmdline);
 int parse_redirects(char **args, int *infile, int *outfile);
 void handle_sigchld(int sig);
 void add_to_history(char *cmd);
 char* fetch_from_history(char *cmd);
+const char* history_text(int slot);
+void history_stats();
+int history_recall_prev(int count, int key);
+int history_recall_next(int count, int key);
+void suggest_add(int id);
+int suggest_lookup(const char *prefix, int plen);
+void suggest_redisplay();
+int suggest_accept(int count, int key);
+int suggest_accept_line(int count, int key);
 void setup_signals();
-void handle_builtins(char **arglist);
+void sigchld_block(sigset_t *old);
+void reap_children();
+void drain_child_events(int redisplay);
+void timers_run();
+void timer_finished(int id, int status);
+char* read_command(const char *prompt);
+char* read_full_command(const char *prompt);
+int handle_builtins(char **arglist);
+int sched_options(char **args, struct exec_attrs *attrs);
+void apply_exec_attrs(const struct exec_attrs *attrs);
+int job_cgroup_create(struct exec_attrs *attrs);
+void job_cgroup_remove(char *cgroup);
+void remove_job(int index);
+int job_add(struct job *job);
+void job_free(struct job *job);
+void proc_sample_close(struct proc_sample *s);
+struct profile* profile_begin(int nprocs);
+void profile_attach(struct profile *prof, int k, pid_t pid);
+void profile_release();
+void profile_child_wait();
+void profile_report(struct job *job);
+void profile_free(struct profile *prof, int nprocs);
+void job_child_setup(pid_t pgid, int group);
+void job_control_off();
+int job_output_fds(struct pollfd *fds, int max);
+void job_output_drain();
+int builtin_ulimit(char **arglist);
+void spread_stage(struct exec_attrs *attrs, int stage);
+
+// Interned history string: each distinct command text is stored once in
+// hist_arena and shared by every history slot that refers to it
+struct hist_str {
+    size_t off;                 // Offset of the text inside hist_arena
+    size_t len;                 // Length of the text without the NUL
+    unsigned hash;              // Cached hash of the text
+    int refs;                   // Number of history slots using this text
+};
+
+// Frecency of an interned text. Every use should add a weight that halves
+// each SUGGEST_HALFLIFE; instead, a new use adds a unit that doubles every
+// half-life, which ranks the same without ever aging the stored scores
+struct hist_rank {
+    double score;               // Sum of the units of its uses (0 if never used)
+    unsigned cwd;               // Hash of the directory it last ran in
+};
+
+// Node of the prefix trie over suggested texts. The edge into a node is
+// `len` bytes of text `text` starting at offset `start`, and top[] lists
+// the best-ranked texts below it, so a lookup only walks the typed prefix
+struct suggest_node {
+    int text, start, len;       // Edge label, stored by reference
+    int child, next;            // First child and next sibling (-1 for none)
+    int top[SUGGEST_TOP];       // Best texts below this node, best first
+};
 
 // Global variables for history and background job management
-char *history[HIST_SIZE];       // Array to store command history
+int history[HIST_SIZE];         // String id for each history slot (-1 if empty)
 int current = 0;                // Current position in history
 int history_count = 0;          // Number of commands in history
-pid_t background_jobs[MAXARGS]; // Array to store background process IDs
+char *hist_arena = NULL;        // Contiguous storage for unique command texts
+size_t arena_used = 0;          // Bytes of the arena in use (live and dead)
+size_t arena_cap = 0;           // Allocated size of the arena
+size_t arena_dead = 0;          // Bytes held by texts no longer referenced
+struct hist_str *hist_strs = NULL; // Table of unique texts indexed by id
+int hist_nstrs = 0;             // Number of ids handed out so far
+int hist_strs_cap = 0;          // Allocated size of hist_strs
+int hist_free_id = -1;          // Head of the list of reusable ids
+int hist_unique = 0;            // Number of live unique texts
+int *hist_index = NULL;         // Open-addressing hash table of ids
+int hist_index_cap = 0;         // Size of hist_index (power of two)
+int hist_index_used = 0;        // Live plus deleted entries in hist_index
+int recall_pos = 0;             // How far back arrow-key recall currently is
+char *recall_saved = NULL;      // Line being typed before recall started
+int autosuggest = 0;            // set -o autosuggest: inline history suggestions
+struct hist_rank *hist_ranks = NULL; // Frecency of each interned text, by id
+int hist_ranks_cap = 0;         // Allocated size of hist_ranks
+struct suggest_node *suggest_nodes = NULL; // Prefix trie; node 0 is the root
+int suggest_nnodes = 0;         // Nodes in use
+int suggest_nodes_cap = 0;      // Allocated size of suggest_nodes
+unsigned suggest_cwd = 0;       // Hash of the directory the line is typed in
+int suggest_id = -1;            // Text whose rest is shown greyed out, or -1
+int suggest_cols = 0;           // Columns of suggestion currently on screen
+int suggest_hide = 0;           // Set once the line is accepted
+int prompt_cols = 0;            // Visible width of active_prompt
+time_t suggest_epoch = 0;       // Time at which a use is worth one unit
+struct job background_jobs[MAXJOBS]; // Background jobs that are still running
 int job_count = 0;              // Count of background jobs
+struct exec_attrs default_attrs = { .numa_mode = -1, .mem_max = -1 }; // Set by sched/limit
+char cgroup_base[PATH_MAX];     // Delegated cgroup holding the job cgroups
+char cgroup_home[PATH_MAX];     // Cgroup the shell was started in
+int cgroup_state = 0;           // 0 = not probed, 1 = usable, -1 = unavailable
+pid_t cgroup_owner = 0;         // Shell that set up the cgroups; forked children inherit its atexit()
+int cgroup_seq = 0;             // Counter used to name job cgroups
+int background_nice = 0;        // Nice level given to & jobs (0 = inherit)
+struct job_exit {
+    pid_t pid;                  // Last process of the job
+    int number;                 // Its job number (%N) when it was removed
+    int status;
+};
+struct job_exit job_exits[JOB_EXITS]; // Recently removed jobs, oldest overwritten
+unsigned job_exit_count = 0;
+pid_t last_background = 0;      // $!: last process of the newest & job
+int profile_next = 0;           // Set by the profile prefix for the next job
+int exec_tail = 0;              // The next external command may replace the shell process
+char **dir_stack = NULL;        // pushd stack, top last
+int dir_depth = 0;              // Directories on dir_stack
+int dir_stack_cap = 0;          // Allocated size of dir_stack
+int zdb_fd = -1;                // Open directory database, or -1
+struct zdb_header *zdb = NULL;  // Its shared mapping
+size_t zdb_size = 0;            // Size of the mapping
+int profile_gate[2] = {-1, -1}; // Held open until a profiled job's counters are attached
+int pipefail = 0;               // set -o pipefail: a failing stage fails the pipeline
+int job_control = 0;            // Interactive: jobs get process groups and the terminal
+pid_t shell_pgid = 0;           // Process group of the shell itself
+int capture_jobs = 0;           // Capture the output of & jobs into rings
+size_t capture_max = JOB_OUTPUT_MAX; // Ring size for each captured job
+char *capture_spill = NULL;     // Directory for overflow spill files, or NULL
+int sched_spread = 0;           // Pin pipeline stages to distinct cores
+int spread_next = 0;            // Rotating start core for the next pipeline
+struct timer **timers = NULL;   // Heap of after/every timers, earliest first
+int timer_count = 0;            // Timers in the heap
+int timer_cap = 0;              // Allocated size of timers
+int timer_next_id = 1;          // Id of the next timer
+int timer_fd = -1;              // timerfd armed for timers[0], created on first use
+
+// A running <(cmd) or >(cmd): the parent keeps its end of the pipe open as
+// /dev/fd/N until the command using it has finished
+struct procsub {
+    int fd;                     // Parent's end of the pipe
+    int npids;                  // Number of pipeline stages started
+    pid_t *pids;                // Stages of the substituted pipeline
+};
+struct procsub procsubs[MAX_PROCSUBS];
+int procsub_count = 0;          // Process substitutions currently open
+int last_status = 0;            // Exit status of the last command ($?)
+int exit_requested = 0;         // Set by the exit builtin
+int flow = 0;                   // FLOW_* set by break, continue or return
+int flow_levels = 0;            // Loops break or continue still has to leave
+int loop_depth = 0;             // Loops running in the current function
+int func_depth = 0;             // Shell function calls running
+char **pos_args = NULL;         // $1... of the running function
+int pos_count = 0;              // $#
+struct func **funcs = NULL;     // Defined shell functions
+int func_count = 0;
+struct var_buf *var_bufs = NULL; // Environment strings owned by var_set()
+int var_buf_count = 0;
+
+// Growable byte buffer used for expanded words and captured output
+struct strbuf {
+    char *s;
+    size_t len;
+    size_t cap;
+};
+
+// Growable NULL-terminated argument list produced by word expansion
+struct argbuf {
+    char **v;
+    int n;
+    int cap;
+};
+static void sb_append(struct strbuf *sb, const char *data, size_t len);
+
+// Finished children travel from handle_sigchld() to the main loop through a
+// single-producer/single-consumer ring; the self-pipe wakes up poll()
+struct child_event {
+    pid_t pid;
+    int status;
+};
+struct child_event child_ring[CHILD_RING];
+unsigned child_head = 0;        // Next slot the signal handler writes
+unsigned child_tail = 0;        // Next slot the main loop reads
+int sigchld_pipe[2] = {-1, -1}; // Self-pipe written by the handler
+const char *active_prompt = ""; // Prompt readline is currently showing
+char *line_result = NULL;       // Line handed back by the readline callback
+int line_done = 0;              // Set once the readline callback fires
+
+// Reaps finished, stopped and continued children into child_ring; only
+// async-signal-safe calls
+void reap_children() {
+    pid_t pid;
+    int status;
+    unsigned head = __atomic_load_n(&child_head, __ATOMIC_RELAXED);
+    // Stop reaping when the ring is full; drain_child_events() resumes it
+    while (head - __atomic_load_n(&child_tail, __ATOMIC_ACQUIRE) < CHILD_RING &&
+           (pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+        child_ring[head % CHILD_RING].pid = pid;
+        child_ring[head % CHILD_RING].status = status;
+        head++;
+        __atomic_store_n(&child_head, head, __ATOMIC_RELEASE);
+    }
+}
 
-// Signal handler to clean up completed background processes
+// Signal handler: record finished children and wake up the main loop
 void handle_sigchld(int sig) {
     int saved_errno = errno; // Save errno as it may be modified during handling
-    pid_t pid;
-    // Loop to reap all finished child processes
-    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
-        printf("\n[Background process %d completed]\n", pid);
-        fflush(stdout);
-        // Remove the completed job from the list of background jobs
-        for (int i = 0; i < job_count; i++) {
-            if (background_jobs[i] == pid) {
-                for (int j = i; j < job_count - 1; j++) {
-                    background_jobs[j] = background_jobs[j + 1];
-                }
-                job_count--;
-                break;
+    (void)sig;
+    reap_children();
+    if (sigchld_pipe[1] >= 0) {
+        char c = 0;
+        ssize_t n = write(sigchld_pipe[1], &c, 1); // Pipe full means a wakeup is already pending
+        (void)n;
+    }
+    errno = saved_errno; // Restore errno to its original state
+}
+
+// Blocks SIGCHLD so a foreground wait cannot race the handler for its child
+void sigchld_block(sigset_t *old) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+
+// Exit status of a wait() status word
+static int exit_status(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Status of a job whose processes have all been reaped: its last stage's,
+// or with pipefail that of the rightmost stage that failed
+static int job_final_status(struct job *job) {
+    int status = job->statuses[job->nprocs - 1];
+    for (int i = job->nprocs - 1; pipefail && status == 0 && i >= 0; i--) status = job->statuses[i];
+    return status;
+}
+
+// Consumes the child ring, updates the job list and prints every completion
+// in a single write; with redisplay set the line being typed is preserved
+void drain_child_events(int redisplay) {
+    char buf[4096];
+    size_t len = 0;
+    char c[64];
+    sigset_t old;
+
+    while (read(sigchld_pipe[0], c, sizeof(c)) > 0) ; // Clear pending wakeups
+
+    sigchld_block(&old);
+    unsigned head = __atomic_load_n(&child_head, __ATOMIC_ACQUIRE);
+    unsigned tail = child_tail;
+    int was_full = head - tail >= CHILD_RING;
+    for (; tail != head; tail++) {
+        pid_t pid = child_ring[tail % CHILD_RING].pid;
+        int status = child_ring[tail % CHILD_RING].status;
+        // Find the job the process belongs to
+        int i, k = 0;
+        for (i = 0; i < job_count; i++) {
+            struct job *job = &background_jobs[i];
+            for (k = 0; k < job->nprocs && job->pids[k] != pid; k++) ;
+            if (k < job->nprocs) break;
+        }
+        if (i == job_count) continue; // Not a tracked job
+        struct job *job = &background_jobs[i];
+
+        if (WIFSTOPPED(status)) {
+            if (!job->stopped && len < sizeof(buf) - 80) {
+                len += snprintf(buf + len, sizeof(buf) - len, "[%d] Stopped  %.60s\n", i + 1, job->cmd);
+            }
+            job->stopped = 1;
+            continue;
+        }
+        if (WIFCONTINUED(status)) {
+            job->stopped = 0;
+            continue;
+        }
+        job->pids[k] = 0;
+        job->statuses[k] = exit_status(status);
+        if (--job->live > 0) continue; // Other stages are still running
+        job->status = job_final_status(job);
+        if (job->timer) timer_finished(job->timer, job->status);
+
+        if (job->out != NULL) {
+            // Keep the job around until its output has been read
+            job->done = 1;
+            job->stopped = 0;
+            if (len < sizeof(buf) - 80) {
+                len += snprintf(buf + len, sizeof(buf) - len,
+                                "[Background process %d completed, see output %%%d]\n",
+                                job->pgid > 0 ? job->pgid : job->pid, i + 1);
             }
+            continue;
         }
+        if (!job->timer && len < sizeof(buf) - 64) { // Timer runs end quietly
+            len += snprintf(buf + len, sizeof(buf) - len,
+                            "[Background process %d completed]\n", job->pgid > 0 ? job->pgid : job->pid);
+        }
+        remove_job(i);
     }
-    errno = saved_errno; // Restore errno to its original state
+    __atomic_store_n(&child_tail, tail, __ATOMIC_RELEASE);
+    if (was_full) reap_children(); // Pick up children left while the ring was full
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    if (len == 0) return;
+    if (redisplay) {
+        // Clear the input line, print above it, then restore prompt and text
+        char *saved_line = rl_copy_text(0, rl_end);
+        int saved_point = rl_point;
+        rl_set_prompt("");
+        rl_replace_line("", 0);
+        rl_redisplay();
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        (void)n;
+        rl_set_prompt(active_prompt);
+        rl_replace_line(saved_line, 0);
+        rl_point = saved_point;
+        (*rl_redisplay_function)();
+        free(saved_line);
+    } else {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        (void)n;
+    }
+}
+
+// FNV-1a hash over a command text
+static unsigned hist_hash(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Rebuilds the hash index with the given capacity, dropping deleted markers
+static void hist_index_rebuild(int cap) {
+    free(hist_index);
+    hist_index = malloc(cap * sizeof(int));
+    for (int i = 0; i < cap; i++) hist_index[i] = -1;
+    hist_index_cap = cap;
+    hist_index_used = 0;
+    for (int id = 0; id < hist_nstrs; id++) {
+        if (hist_strs[id].refs == 0) continue;
+        int i = hist_strs[id].hash & (cap - 1);
+        while (hist_index[i] != -1) i = (i + 1) & (cap - 1);
+        hist_index[i] = id;
+        hist_index_used++;
+    }
+}
+
+// Moves every live text to the front of the arena once dead space dominates
+static void hist_compact() {
+    char *arena = malloc(arena_cap);
+    size_t used = 0;
+    for (int id = 0; id < hist_nstrs; id++) {
+        struct hist_str *hs = &hist_strs[id];
+        if (hs->refs == 0) continue;
+        memcpy(arena + used, hist_arena + hs->off, hs->len + 1);
+        hs->off = used;
+        used += hs->len + 1;
+    }
+    free(hist_arena);
+    hist_arena = arena;
+    arena_used = used;
+    arena_dead = 0;
+}
+
+// Returns the id of an interned copy of cmd, adding a reference to it
+static int hist_intern(const char *cmd) {
+    size_t len = strlen(cmd);
+    unsigned h = hist_hash(cmd, len);
+
+    if ((hist_index_used + 1) * 4 >= hist_index_cap * 3) {
+        int cap = hist_index_cap ? hist_index_cap : 64;
+        while ((hist_unique + 1) * 2 >= cap) cap *= 2;
+        hist_index_rebuild(cap);
+    }
+
+    // Look for an existing copy of the same text
+    int i = h & (hist_index_cap - 1), tomb = -1;
+    while (hist_index[i] != -1) {
+        int id = hist_index[i];
+        if (id == -2) {
+            if (tomb < 0) tomb = i;
+        } else if (hist_strs[id].hash == h && hist_strs[id].len == len &&
+                   memcmp(hist_arena + hist_strs[id].off, cmd, len) == 0) {
+            hist_strs[id].refs++;
+            return id;
+        }
+        i = (i + 1) & (hist_index_cap - 1);
+    }
+
+    // Append the text to the arena, growing it geometrically
+    if (arena_used + len + 1 > arena_cap) {
+        if (arena_dead > arena_used / 2) hist_compact();
+        while (arena_used + len + 1 > arena_cap) {
+            arena_cap = arena_cap ? arena_cap * 2 : HIST_ARENA_MIN;
+        }
+        hist_arena = realloc(hist_arena, arena_cap);
+    }
+
+    int id;
+    if (hist_free_id >= 0) { // Reuse an id released by hist_release()
+        id = hist_free_id;
+        hist_free_id = (int)hist_strs[id].off;
+    } else {
+        if (hist_nstrs == hist_strs_cap) {
+            hist_strs_cap = hist_strs_cap ? hist_strs_cap * 2 : 64;
+            hist_strs = realloc(hist_strs, hist_strs_cap * sizeof(struct hist_str));
+        }
+        id = hist_nstrs++;
+    }
+    memcpy(hist_arena + arena_used, cmd, len + 1);
+    hist_strs[id].off = arena_used;
+    hist_strs[id].len = len;
+    hist_strs[id].hash = h;
+    hist_strs[id].refs = 1;
+    arena_used += len + 1;
+    hist_unique++;
+
+    if (tomb >= 0) {
+        i = tomb;
+    } else {
+        hist_index_used++;
+    }
+    hist_index[i] = id;
+    return id;
+}
+
+// Drops one reference to an interned text, freeing it with the last one
+static void hist_release(int id) {
+    struct hist_str *hs = &hist_strs[id];
+    if (--hs->refs > 0) return;
+
+    int i = hs->hash & (hist_index_cap - 1);
+    while (hist_index[i] != id) i = (i + 1) & (hist_index_cap - 1);
+    hist_index[i] = -2; // Leave a deleted marker so probing still works
+
+    arena_dead += hs->len + 1;
+    hist_unique--;
+    hs->off = (size_t)hist_free_id; // Chain the id onto the free list
+    hist_free_id = id;
 }
 
 // Adds a command to the history buffer, maintaining a circular buffer
 void add_to_history(char *cmd) {
-    if (history[current] != NULL) {
-        free(history[current]); // Free memory if it already holds a command
+    int id = hist_intern(cmd); // Intern first so a repeated command is shared
+    if (history[current] >= 0) {
+        hist_release(history[current]); // Drop the command being overwritten
     }
-    history[current] = strdup(cmd); // Duplicate the command for storage
+    history[current] = id;
+    if (autosuggest) suggest_add(id);
     current = (current + 1) % HIST_SIZE; // Move to the next slot (circular)
     if (history_count < HIST_SIZE) {
         history_count++;
     }
 }
 
+// Returns the text stored in a history slot, or NULL if the slot is empty
+const char* history_text(int slot) {
+    if (history[slot] < 0) return NULL;
+    return hist_arena + hist_strs[history[slot]].off;
+}
+
 // Fetches a command from history, supporting !N and !-N notation
 char* fetch_from_history(char *cmd) {
     int index; // Calculated index in the history buffer
@@ -97,297 +807,6634 @@ char* fetch_from_history(char *cmd) {
         index = (current - history_count + n - 1 + HIST_SIZE) % HIST_SIZE;
     }
 
-    if (history[index] == NULL) {
+    if (history_text(index) == NULL) {
         fprintf(stderr, "No command at that position in history.\n");
         return NULL;
     }
 
-    return strdup(history[index]); // Return a copy of the command
+    return strdup(history_text(index)); // Return a copy of the command
 }
 
-// Sets up signal handling for SIGCHLD to handle background processes
-void setup_signals() {
-    struct sigaction sa;
-    sa.sa_handler = handle_sigchld;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART; // Restart system calls if interrupted by SIGCHLD
-    sigaction(SIGCHLD, &sa, NULL);
+// Prints how much memory the history uses in total and per entry
+void history_stats() {
+    size_t bytes = sizeof(history) + arena_cap +
+                   hist_strs_cap * sizeof(struct hist_str) +
+                   hist_index_cap * sizeof(int);
+    printf("entries: %d, unique: %d\n", history_count, hist_unique);
+    printf("arena: %zu bytes used, %zu dead, %zu allocated\n",
+           arena_used - arena_dead, arena_dead, arena_cap);
+    printf("total: %zu bytes", bytes);
+    if (history_count > 0) {
+        printf(" (%.1f bytes per entry)", (double)bytes / history_count);
+    }
+    printf("\n");
+    if (suggest_nnodes > 0) {
+        printf("suggestions: %d trie nodes, %zu bytes\n", suggest_nnodes,
+               suggest_nodes_cap * sizeof(struct suggest_node) +
+               hist_ranks_cap * sizeof(struct hist_rank));
+    }
 }
 
-// Executes a command, either in the foreground or background
-int execute(char *arglist[], int background) {
-    int infile = STDIN_FILENO, outfile = STDOUT_FILENO;
-    // Handle any input/output redirection
-    if (parse_redirects(arglist, &infile, &outfile) < 0) return 1;
-
-    pid_t pid = fork();
-    if (pid == 0) { // Child process
-        // Set up input redirection if specified
-        if (infile != STDIN_FILENO) {
-            dup2(infile, STDIN_FILENO);
-            close(infile);
-        }
-        // Set up output redirection if specified
-        if (outfile != STDOUT_FILENO) {
-            dup2(outfile, STDOUT_FILENO);
-            close(outfile);
-        }
-        execvp(arglist[0], arglist); // Execute the command
-        perror("execvp failed"); // Error if execvp returns
-        exit(1);
-    } else if (pid > 0) { // Parent process
-        if (!background) {
-            waitpid(pid, NULL, 0); // Wait for foreground process
-        } else {
-            background_jobs[job_count++] = pid; // Track background process
-            printf("[Background PID %d]\n", pid);
-        }
+// Shows the history entry `recall_pos` commands back on the readline line
+static void history_recall_show() {
+    const char *text;
+    if (recall_pos == 0) {
+        text = recall_saved ? recall_saved : "";
     } else {
-        perror("fork failed");
-        return 1;
+        text = history_text((current - recall_pos + HIST_SIZE) % HIST_SIZE);
+    }
+    rl_replace_line(text, 0);
+    rl_point = rl_end;
+}
+
+// Readline binding for the up arrow: recall the previous command straight
+// from the interned history instead of readline's own copy of it
+int history_recall_prev(int count, int key) {
+    (void)key;
+    if (recall_pos + count > history_count) return 0;
+    if (recall_pos == 0) {
+        free(recall_saved);
+        recall_saved = strdup(rl_line_buffer); // Keep what was being typed
     }
+    recall_pos += count;
+    history_recall_show();
     return 0;
 }
 
-// Executes a pipeline of commands (e.g., cmd1 | cmd2 | cmd3)
-int execute_pipeline(char ***cmds, int num_cmds) {
-    int i, in_fd = STDIN_FILENO, fd[2];
-    pid_t pid;
+// Readline binding for the down arrow: move back towards the typed line
+int history_recall_next(int count, int key) {
+    (void)key;
+    if (recall_pos == 0) return 0;
+    recall_pos = recall_pos > count ? recall_pos - count : 0;
+    history_recall_show();
+    return 0;
+}
 
-    // Loop through each command in the pipeline
-    for (i = 0; i < num_cmds; i++) {
-        if (pipe(fd) == -1) {
-            perror("pipe failed");
-            return 1;
-        }
+// Text of an interned id; edges of the suggestion trie point into these
+static const char* hist_str_text(int id) {
+    return hist_arena + hist_strs[id].off;
+}
 
-        if ((pid = fork()) == 0) { // Child process
-            dup2(in_fd, STDIN_FILENO); // Input from previous command or stdin
-            if (i < num_cmds - 1) {
-                dup2(fd[1], STDOUT_FILENO); // Output to the pipe
-            }
-            close(fd[0]); // Close read end of the pipe
+// Orders text id into a node's top list by its current rank
+static void suggest_top_update(struct suggest_node *node, int id) {
+    int i = 0, *top = node->top;
+    while (i < SUGGEST_TOP - 1 && top[i] != id && top[i] != -1) i++;
+    // i is now id's old slot, the first free one, or the last one (dropped)
+    for (; i > 0 && hist_ranks[top[i - 1]].score < hist_ranks[id].score; i--) {
+        top[i] = top[i - 1];
+    }
+    if (i < SUGGEST_TOP - 1 || top[i] == -1 || top[i] == id ||
+        hist_ranks[top[i]].score < hist_ranks[id].score) {
+        top[i] = id;
+    }
+}
 
-            // Execute the command
-            if (cmds[i][0] != NULL) {
-                execvp(cmds[i][0], cmds[i]);
-                perror("execvp failed");
-            }
-            exit(1); // Exit on execvp failure
-        } else if (pid < 0) { // Fork failure
-            perror("fork failed");
-            return 1;
-        }
+// Appends a trie node and returns its index
+static int suggest_node_new(int text, int start, int len) {
+    if (suggest_nnodes == suggest_nodes_cap) {
+        suggest_nodes_cap = suggest_nodes_cap ? suggest_nodes_cap * 2 : 256;
+        suggest_nodes = realloc(suggest_nodes, suggest_nodes_cap * sizeof(struct suggest_node));
+    }
+    struct suggest_node *n = &suggest_nodes[suggest_nnodes];
+    *n = (struct suggest_node){ text, start, len, -1, -1, {0} };
+    for (int i = 0; i < SUGGEST_TOP; i++) n->top[i] = -1;
+    return suggest_nnodes++;
+}
 
-        close(fd[1]); // Close write end of the pipe
-        in_fd = fd[0]; // Set input for the next command
+// Finds the child of node whose edge starts with byte c, or -1
+static int suggest_child(int node, char c) {
+    int k = suggest_nodes[node].child;
+    while (k >= 0) {
+        struct suggest_node *n = &suggest_nodes[k];
+        if (hist_str_text(n->text)[n->start] == c) break;
+        k = n->next;
     }
+    return k;
+}
 
-    // Wait for all commands in the pipeline to finish
-    for (i = 0; i < num_cmds; i++) wait(NULL);
-    return 0;
+// Weight of a use made now: 2^(age in half-lives), interpolated linearly
+// between powers of two, which keeps the ranking order without libm
+static double suggest_unit() {
+    time_t now = time(NULL);
+    if (suggest_epoch == 0) suggest_epoch = now;
+    double age = (now - suggest_epoch) / SUGGEST_HALFLIFE;
+    while (age >= 32) { // Rebase before the units get huge; order is kept
+        for (int i = 0; i < hist_ranks_cap; i++) hist_ranks[i].score /= 4294967296.0;
+        suggest_epoch += 32 * SUGGEST_HALFLIFE;
+        age -= 32;
+    }
+    int whole = (int)age;
+    return (double)(1u << whole) * (1 + (age - whole));
 }
 
-// Tokenizes a command line into arguments, returning an array of arguments
-char** tokenize(char* cmdline) {
-    char** arglist = malloc((MAXARGS + 1) * sizeof(char*));
-    for (int j = 0; j < MAXARGS + 1; j++) {
-        arglist[j] = malloc(ARGLEN);
-        bzero(arglist[j], ARGLEN); // Initialize memory to zero
+// Records one more use of text id and files it under each of its prefixes;
+// costs one step per trie node on its path, whatever the history size
+void suggest_add(int id) {
+    if (id >= hist_ranks_cap) {
+        int cap = hist_ranks_cap ? hist_ranks_cap : 64;
+        while (cap <= id) cap *= 2;
+        hist_ranks = realloc(hist_ranks, cap * sizeof(struct hist_rank));
+        memset(hist_ranks + hist_ranks_cap, 0, (cap - hist_ranks_cap) * sizeof(struct hist_rank));
+        hist_ranks_cap = cap;
     }
+    struct hist_rank *r = &hist_ranks[id];
+    if (r->score == 0) hist_strs[id].refs++; // The trie points into the text, so keep it alive
+    r->score += suggest_unit();
+    r->cwd = suggest_cwd;
 
-    if (cmdline[0] == '\0') return NULL;
+    if (suggest_nnodes == 0) suggest_node_new(id, 0, 0);
+    const char *s = hist_str_text(id);
+    int len = hist_strs[id].len, pos = 0, node = 0;
+    suggest_top_update(&suggest_nodes[0], id);
+    while (pos < len) {
+        int c = suggest_child(node, s[pos]);
+        if (c < 0) { // Nothing shares this prefix yet: hang the rest as a leaf
+            int leaf = suggest_node_new(id, pos, len - pos);
+            suggest_nodes[leaf].next = suggest_nodes[node].child;
+            suggest_nodes[node].child = leaf;
+            suggest_top_update(&suggest_nodes[leaf], id);
+            return;
+        }
+        struct suggest_node *e = &suggest_nodes[c];
+        const char *edge = hist_str_text(e->text) + e->start;
+        int k = 1;
+        while (k < e->len && pos + k < len && edge[k] == s[pos + k]) k++;
+        if (k < e->len) { // Split the edge where the texts part ways
+            int mid = suggest_node_new(e->text, e->start, k);
+            e = &suggest_nodes[c]; // The array may have moved
+            memcpy(suggest_nodes[mid].top, e->top, sizeof(e->top));
+            suggest_nodes[mid].child = c;
+            suggest_nodes[mid].next = e->next;
+            e->start += k;
+            e->len -= k;
+            e->next = -1;
+            int *link = &suggest_nodes[node].child;
+            while (*link != c) link = &suggest_nodes[*link].next;
+            *link = mid;
+            c = mid;
+        }
+        pos += k;
+        node = c;
+        suggest_top_update(&suggest_nodes[node], id);
+    }
+}
 
-    int argnum = 0;
-    char* cp = cmdline;
-    char* start;
-    int len;
+// Returns the best-ranked text that extends the typed prefix, or -1. Walks
+// the prefix down the trie, then weighs that node's few candidates, so the
+// cost depends on the prefix length and not on the history size.
+int suggest_lookup(const char *prefix, int plen) {
+    int node = 0, pos = 0;
+    if (suggest_nnodes == 0) return -1;
+    while (pos < plen) {
+        int c = suggest_child(node, prefix[pos]);
+        if (c < 0) return -1;
+        struct suggest_node *e = &suggest_nodes[c];
+        int k = e->len < plen - pos ? e->len : plen - pos;
+        if (memcmp(hist_str_text(e->text) + e->start, prefix + pos, k) != 0) return -1;
+        pos += k;
+        node = c;
+    }
+    int best = -1;
+    double best_score = 0;
+    for (int i = 0; i < SUGGEST_TOP; i++) {
+        int id = suggest_nodes[node].top[i];
+        if (id < 0) break;
+        if ((int)hist_strs[id].len == plen) continue; // Nothing left to suggest
+        double score = hist_ranks[id].score *
+                       (hist_ranks[id].cwd == suggest_cwd ? SUGGEST_CWD_BONUS : 1);
+        if (best < 0 || score > best_score) {
+            best = id;
+            best_score = score;
+        }
+    }
+    return best;
+}
 
-    // Split the command line into tokens
-    while (*cp != '\0') {
-        while (*cp == ' ' || *cp == '\t') cp++; // Skip whitespace
+// Length of the suggested rest of the line; it stops at a newline so only
+// the current line is completed
+static int suggest_rest_len() {
+    if (suggest_id < 0) return 0;
+    return strcspn(hist_str_text(suggest_id) + rl_end, "\n");
+}
 
-        start = cp;
-        len = 0;
-        while (*cp != '\0' && !(*cp == ' ' || *cp == '\t')) {
-            cp++;
-            len++;
+// Readline redisplay hook: draws the line, then the rest of the best
+// history match greyed out after the cursor when it is at the end
+void suggest_redisplay() {
+    rl_redisplay();
+    if (!autosuggest) return;
+
+    suggest_id = -1;
+    if (!suggest_hide && recall_pos == 0 && rl_end > 0 && rl_point == rl_end) {
+        suggest_id = suggest_lookup(rl_line_buffer, rl_end);
+    }
+    int n = suggest_rest_len(), rows, cols;
+    rl_get_screen_size(&rows, &cols);
+    int room = cols > 0 ? cols - 1 - (prompt_cols + rl_end) % cols : n;
+    if (n > room) n = room > 0 ? room : 0; // Never wrap onto the next row
+    if (n == 0 && suggest_cols == 0) return;
+
+    if (rl_point == rl_end) {
+        fputs("\033[K", rl_outstream); // Erase the previous suggestion
+        if (n > 0) {
+            fprintf(rl_outstream, "\033[90m%.*s\033[0m\033[%dD", n,
+                    hist_str_text(suggest_id) + rl_end, n);
         }
+    } else { // Erase what is left beyond the end of the line
+        fprintf(rl_outstream, "\0337\033[%dC\033[K\0338", rl_end - rl_point);
+    }
+    fflush(rl_outstream);
+    suggest_cols = n;
+}
+
+// Readline binding for the right arrow: take the suggestion, or move right
+int suggest_accept(int count, int key) {
+    int n = suggest_rest_len();
+    if (!autosuggest || n == 0 || rl_point != rl_end) return rl_forward_char(count, key);
+    char *rest = strndup(hist_str_text(suggest_id) + rl_end, n);
+    rl_insert_text(rest);
+    free(rest);
+    return 0;
+}
 
-        if (len >= ARGLEN) len = ARGLEN - 1;
+// Readline binding for Enter: clear the suggestion before the line is run
+int suggest_accept_line(int count, int key) {
+    suggest_hide = 1;
+    if (autosuggest && suggest_cols > 0) suggest_redisplay();
+    return rl_newline(count, key);
+}
 
-        strncpy(arglist[argnum], start, len); // Copy token to arglist
-        arglist[argnum++][len] = '\0'; // Null-terminate the token
+// Sets up signal handling for SIGCHLD to handle background processes
+void setup_signals() {
+    struct sigaction sa;
+    if (pipe(sigchld_pipe) == 0) {
+        // Non-blocking so neither the handler nor the drain can ever stall
+        for (int i = 0; i < 2; i++) {
+            fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+            fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+    } else {
+        perror("pipe failed");
     }
-    arglist[argnum] = NULL; // Null-terminate the argument list
-    return arglist;
+    sa.sa_handler = handle_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART; // Restart system calls if interrupted by SIGCHLD
+    sigaction(SIGCHLD, &sa, NULL);
 }
 
-// Parses input/output redirection symbols and sets file descriptors
-int parse_redirects(char **args, int *infile, int *outfile) {
-    for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "<") == 0) { // Input redirection
-            *infile = open(args[i + 1], O_RDONLY);
-            if (*infile < 0) {
-                perror("Failed to open input file");
-                return -1;
-            }
-            args[i] = NULL;
-        } else if (strcmp(args[i], ">") == 0) { // Output redirection
-            *outfile = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (*outfile < 0) {
-                perror("Failed to open output file");
-                return -1;
-            }
-            args[i] = NULL;
+// Parses a CPU list such as "0-3,6" into a mask
+static int parse_cpu_list(const char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p) return -1;
         }
+        if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) return -1;
+        for (long c = lo; c <= hi; c++) CPU_SET(c, cpus);
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        p = end;
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+// Parses a NUMA policy such as "bind:0-1", "interleave:0,1" or "preferred:1"
+static int parse_numa_policy(const char *spec, struct exec_attrs *attrs) {
+    const char *nodes = strchr(spec, ':');
+    size_t len = nodes ? (size_t)(nodes - spec) : strlen(spec);
+    if (strncmp(spec, "default", len) == 0 && len == 7) {
+        attrs->numa_mode = MPOL_DEFAULT;
+        attrs->numa_nodes = 0;
+        return 0;
+    }
+    if (nodes == NULL) return -1;
+    if (len == 4 && strncmp(spec, "bind", 4) == 0) attrs->numa_mode = MPOL_BIND;
+    else if (len == 10 && strncmp(spec, "interleave", 10) == 0) attrs->numa_mode = MPOL_INTERLEAVE;
+    else if (len == 9 && strncmp(spec, "preferred", 9) == 0) attrs->numa_mode = MPOL_PREFERRED;
+    else return -1;
+
+    cpu_set_t set; // Node lists use the same syntax as CPU lists
+    if (parse_cpu_list(nodes + 1, &set) < 0) return -1;
+    attrs->numa_nodes = 0;
+    for (unsigned n = 0; n < sizeof(unsigned long) * 8; n++) {
+        if (CPU_ISSET(n, &set)) attrs->numa_nodes |= 1UL << n;
     }
+    return attrs->numa_nodes ? 0 : -1;
+}
+
+// Parses a size such as "512M", "2G" or "max" into bytes (-1 for max)
+static long long parse_size(const char *val) {
+    if (strcmp(val, "max") == 0 || strcmp(val, "unlimited") == 0) return -1;
+    char *end;
+    long long n = strtoll(val, &end, 10);
+    if (end == val || n < 0) return -2;
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+    }
+    return *end == '\0' ? n : -2;
+}
+
+// Maps a ulimit/limit option letter to its RLIMIT_* resource
+static int rlimit_resource(char opt) {
+    switch (opt) {
+    case 'c': return RLIMIT_CORE;
+    case 'd': return RLIMIT_DATA;
+    case 'f': return RLIMIT_FSIZE;
+    case 'n': return RLIMIT_NOFILE;
+    case 's': return RLIMIT_STACK;
+    case 't': return RLIMIT_CPU;
+    case 'u': return RLIMIT_NPROC;
+    case 'v': return RLIMIT_AS;
+    }
+    return -1;
+}
+
+// Parses one "limit" option: -m memory.max, -p cpu.max percent, or an
+// rlimit letter as used by ulimit
+static int limit_option(char opt, const char *val, struct exec_attrs *attrs) {
+    if (opt == 'm') {
+        attrs->mem_max = parse_size(val);
+        return attrs->mem_max == -2 ? -1 : 0;
+    }
+    if (opt == 'p') {
+        attrs->cpu_pct = atoi(val);
+        return attrs->cpu_pct > 0 ? 0 : -1;
+    }
+    int res = rlimit_resource(opt);
+    if (res < 0 || attrs->nrlimits == MAX_JOB_RLIMITS) return -1;
+    long long n = opt == 't' || opt == 'n' || opt == 'u' ? atoll(val) : parse_size(val);
+    if (n == -2) return -1;
+    attrs->rlimits[attrs->nrlimits].resource = res;
+    attrs->rlimits[attrs->nrlimits].value = n < 0 ? RLIM_INFINITY : (rlim_t)n;
+    attrs->nrlimits++;
     return 0;
 }
 
-// Handles built-in commands like cd, jobs, kill, and exit
-void handle_builtins(char **arglist) {
-    if (strcmp(arglist[0], "cd") == 0) { // Change directory
-        if (arglist[1] == NULL || chdir(arglist[1]) != 0) {
-            perror("cd failed");
-        }
-    } else if (strcmp(arglist[0], "jobs") == 0) { // List background jobs
-        for (int i = 0; i < job_count; i++) {
-            if (kill(background_jobs[i], 0) == 0) { // Check if job is active
-                printf("[%d] %d\n", i + 1, background_jobs[i]);
-            } else { // Remove terminated job from list
-                for (int j = i; j < job_count - 1; j++) {
-                    background_jobs[j] = background_jobs[j + 1];
+// Parses chained "sched [-c cpus] [-n nice] [-m policy] [-b nice] [-s on|off]"
+// and "limit [-m mem] [-p cpu%] [-v|-n|-t|... value]" prefixes starting from
+// the current defaults; returns the index of the first word of the command
+// that follows, or -1 on error. Commands without a prefix return 0.
+int sched_options(char **args, struct exec_attrs *attrs) {
+    *attrs = default_attrs;
+    attrs->cgroup = NULL;
+
+    int i = 0, shell_wide = 0;
+    while (args[i] != NULL && (strcmp(args[i], "sched") == 0 || strcmp(args[i], "limit") == 0)) {
+        const char *name = args[i++];
+        while (args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0' && args[i][2] == '\0') {
+            char opt = args[i][1];
+            char *val = args[i + 1];
+            if (val == NULL) {
+                fprintf(stderr, "%s: option -%c needs a value\n", name, opt);
+                return -1;
+            }
+            if (name[0] == 'l') {
+                if (limit_option(opt, val, attrs) < 0) {
+                    fprintf(stderr, "limit: invalid option -%c %s\n", opt, val);
+                    return -1;
+                }
+            } else if (opt == 'c') {
+                if (parse_cpu_list(val, &attrs->cpus) < 0) {
+                    fprintf(stderr, "sched: invalid CPU list: %s\n", val);
+                    return -1;
                 }
-                job_count--;
-                i--;
-            }
-        }
-    } else if (strcmp(arglist[0], "kill") == 0) { // Kill a background job
-        if (arglist[1]) {
-            int job_index = atoi(arglist[1]) - 1;
-            if (job_index >= 0 && job_index < job_count) {
-                kill(background_jobs[job_index], SIGKILL);
-                printf("Killed job [%d] %d\n", job_index + 1, background_jobs[job_index]);
-                for (int j = job_index; j < job_count - 1; j++) {
-                    background_jobs[j] = background_jobs[j + 1];
+                attrs->set_cpus = 1;
+            } else if (opt == 'n') {
+                attrs->nice = atoi(val);
+                attrs->set_nice = 1;
+            } else if (opt == 'm') {
+                if (parse_numa_policy(val, attrs) < 0) {
+                    fprintf(stderr, "sched: invalid NUMA policy: %s\n", val);
+                    return -1;
                 }
-                job_count--;
+            } else if (opt == 'b' || opt == 's') {
+                shell_wide = opt;
+            } else {
+                fprintf(stderr, "sched: unknown option -%c\n", opt);
+                return -1;
             }
-        } else {
-            printf("Usage: kill [job#]\n");
+            i += 2;
         }
-    } else if (strcmp(arglist[0], "help") == 0) { // Display help message
-        printf("Available commands:\n");
-        printf("  cd [directory]  - Change directory\n");
-        printf("  jobs            - List background jobs\n");
-        printf("  kill [job#]     - Kill a background job\n");
-        printf("  exit            - Exit the shell\n");
-        printf("  ![number]       - Execute a command from history\n");
     }
+    // Shell-wide settings only make sense without a command
+    if (shell_wide && args[i] != NULL) {
+        fprintf(stderr, "sched: -%c cannot be used with a command\n", shell_wide);
+        return -1;
+    }
+    return i;
 }
 
-// Main function to initialize shell and handle command input
-int main() {
-    setup_signals(); // Set up signal handling for background processes
-    memset(history, 0, sizeof(history)); // Initialize history buffer
-
-    char *cmdline;
-    char **arglist;
-    char prompt[MAX_LEN];
-    char hostname[HOST_NAME_MAX];
-    char cwd[PATH_MAX];
-    char *username = getenv("USER");
-    if (username == NULL) username = "unknown";
+// Moves the shell back to its original cgroup and removes the ones it made
+static void cgroup_leave() {
+    if (getpid() != cgroup_owner) return; // A forked child exiting, e.g. after a failed exec
+    char path[PATH_MAX + 32], pid[32];
+    snprintf(pid, sizeof(pid), "%d", getpid());
+    snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup_home);
+    int fd = open(path, O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, pid, strlen(pid)) < 0) perror("cgroup restore failed");
+        close(fd);
+    }
+    snprintf(path, sizeof(path), "%s/shell", cgroup_base);
+    rmdir(path);
+    rmdir(cgroup_base);
+}
 
-    gethostname(hostname, HOST_NAME_MAX); // Get hostname for prompt
+// Finds the cgroup v2 directory this shell lives in and makes it able to
+// hold per-job cgroups; returns -1 when delegation is not available
+static int cgroup_setup() {
+    if (cgroup_state != 0) return cgroup_state > 0 ? 0 : -1;
+    cgroup_state = -1;
+    cgroup_owner = getpid();
 
-    // Main command loop
-    while (1) {
-        if (getcwd(cwd, sizeof(cwd)) != NULL) { // Get current directory
-            snprintf(prompt, sizeof(prompt),
-                     COLOR_RED "PucitShell " COLOR_RESET
-                     "(" COLOR_GREEN "%s" COLOR_RESET
-                     "@" COLOR_GREEN "%s" COLOR_RESET
-                     ")-[" COLOR_CYAN "%s" COLOR_RESET "] : ",
-                     username, hostname, cwd); // Set prompt
-        } else {
-            perror("getcwd() error");
-            return 1;
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL) return -1;
+    char line[PATH_MAX], *rel = NULL;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "0::", 3) == 0) { // Unified hierarchy entry
+            rel = line + 3;
+            rel[strcspn(rel, "\n")] = '\0';
+            break;
         }
+    }
+    fclose(fp);
+    if (rel == NULL) return -1;
+    // Hybrid setups mount the unified hierarchy below the v1 controllers
+    const char *root = access(CGROUP_ROOT "/cgroup.controllers", F_OK) == 0
+                       ? CGROUP_ROOT : CGROUP_ROOT "/unified";
+    // A path that does not fit cannot be used: leave cgroups off
+    int n = snprintf(cgroup_home, sizeof(cgroup_home), "%s%s",
+                     root, strcmp(rel, "/") == 0 ? "" : rel);
+    if (n < 0 || (size_t)n >= sizeof(cgroup_home)) return -1;
+    n = snprintf(cgroup_base, sizeof(cgroup_base), "%s/pucitsh-%d", cgroup_home, getpid());
+    if (n < 0 || (size_t)n >= sizeof(cgroup_base)) return -1;
 
-        cmdline = readline(prompt); // Read command input
-        if (cmdline == NULL) break; // Exit if EOF
+    // Controllers can only be enabled for children of a cgroup without
+    // processes, so the shell moves itself into a leaf first
+    char path[PATH_MAX + 32], pid[32];
+    snprintf(path, sizeof(path), "%s/shell", cgroup_base);
+    if (mkdir(cgroup_base, 0755) < 0 || mkdir(path, 0755) < 0) {
+        rmdir(cgroup_base);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/shell/cgroup.procs", cgroup_base);
+    snprintf(pid, sizeof(pid), "%d", getpid());
+    int fd = open(path, O_WRONLY);
+    int ok = fd >= 0 && write(fd, pid, strlen(pid)) > 0;
+    if (fd >= 0) close(fd);
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", cgroup_base);
+    fd = open(path, O_WRONLY);
+    ok = ok && fd >= 0 && write(fd, "+memory +cpu", 12) > 0;
+    if (fd >= 0) close(fd);
+    if (!ok) {
+        cgroup_leave();
+        return -1;
+    }
+    cgroup_state = 1;
+    atexit(cgroup_leave);
+    return 0;
+}
 
-        if (strlen(cmdline) > 0) {
-            // Handle history commands like !N and !-N
-            if (cmdline[0] == '!') {
-                char *newcmd = fetch_from_history(cmdline);
-                if (newcmd) {
-                    printf("Repeating command: %s\n", newcmd);
-                    free(cmdline);
-                    cmdline = newcmd; // Replace with actual command
-                    add_history(cmdline);
+// Writes a value into a cgroup control file
+static int cgroup_write(const char *dir, const char *file, const char *val) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) return -1;
+    int ok = write(fd, val, strlen(val)) == (ssize_t)strlen(val);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Creates a cgroup carrying memory.max/cpu.max for a job about to be forked.
+// Without cgroup delegation memory.max falls back to RLIMIT_AS in the child.
+int job_cgroup_create(struct exec_attrs *attrs) {
+    if (attrs->mem_max < 0 && attrs->cpu_pct == 0) return 0;
+    if (cgroup_setup() < 0) {
+        static int warned = 0;
+        if (!warned) {
+            fprintf(stderr, "limit: cgroup v2 delegation unavailable, using rlimits\n");
+            warned = 1;
+        }
+        if (attrs->mem_max >= 0 && attrs->nrlimits < MAX_JOB_RLIMITS) {
+            attrs->rlimits[attrs->nrlimits].resource = RLIMIT_AS;
+            attrs->rlimits[attrs->nrlimits].value = attrs->mem_max;
+            attrs->nrlimits++;
+        }
+        return 0;
+    }
+
+    char dir[PATH_MAX + 32], val[64];
+    snprintf(dir, sizeof(dir), "%s/job-%d", cgroup_base, ++cgroup_seq);
+    if (mkdir(dir, 0755) < 0) {
+        perror("limit: mkdir cgroup failed");
+        return -1;
+    }
+    if (attrs->mem_max >= 0) {
+        snprintf(val, sizeof(val), "%lld", attrs->mem_max);
+        if (cgroup_write(dir, "memory.max", val) < 0) perror("limit: memory.max");
+    }
+    if (attrs->cpu_pct > 0) {
+        snprintf(val, sizeof(val), "%d 100000", attrs->cpu_pct * 1000);
+        if (cgroup_write(dir, "cpu.max", val) < 0) perror("limit: cpu.max");
+    }
+    attrs->cgroup = strdup(dir);
+    return 0;
+}
+
+// Removes a job cgroup once its processes are gone; busy ones are retried
+// on later calls
+void job_cgroup_remove(char *cgroup) {
+    static char *stale[MAXARGS];
+    static int nstale = 0;
+    for (int i = 0; i < nstale; i++) {
+        if (rmdir(stale[i]) == 0 || errno == ENOENT) {
+            free(stale[i]);
+            stale[i--] = stale[--nstale];
+        }
+    }
+    if (cgroup == NULL) return;
+    if (rmdir(cgroup) == 0 || errno == ENOENT || nstale == MAXARGS) {
+        free(cgroup);
+    } else {
+        stale[nstale++] = cgroup;
+    }
+}
+
+// Drops a finished job from the background list, releasing its cgroup;
+// its status stays in job_exits for wait
+void remove_job(int index) {
+    struct job *job = &background_jobs[index];
+    job_exits[job_exit_count++ % JOB_EXITS] = (struct job_exit){ job->pid, index + 1, job->status };
+    job_free(job);
+    for (int j = index; j < job_count - 1; j++) {
+        background_jobs[j] = background_jobs[j + 1];
+    }
+    job_count--;
+}
+
+// Releases what a job owns: its cgroups, captured output and process list
+void job_free(struct job *job) {
+    for (int i = 0; i < job->nprocs; i++) job_cgroup_remove(job->cgroups[i]);
+    struct job_output *out = job->out;
+    if (out != NULL) {
+        if (out->fd >= 0) close(out->fd);
+        if (out->spill_fd >= 0) close(out->spill_fd);
+        free(out->spill_path);
+        free(out->ring);
+        free(out);
+    }
+    free(job->pids);
+    free(job->statuses);
+    free(job->cgroups);
+    free(job->cmd);
+    profile_free(job->prof, job->nprocs);
+    for (int i = 0; job->samples != NULL && i < job->nprocs; i++) proc_sample_close(&job->samples[i]);
+    free(job->samples);
+}
+
+// Moves a job (with malloc'd pids, cgroups and cmd) into the background
+// table; returns its index, or -1 after freeing it when the table is full
+int job_add(struct job *job) {
+    if (job_count == MAXJOBS) {
+        // Make room by dropping the oldest finished job
+        for (int i = 0; i < job_count; i++) {
+            if (background_jobs[i].done) {
+                remove_job(i);
+                break;
+            }
+        }
+    }
+    if (job_count == MAXJOBS) {
+        fprintf(stderr, "Too many jobs; %d is no longer tracked\n", job->pid);
+        job_free(job);
+        return -1;
+    }
+    background_jobs[job_count] = *job;
+    return job_count++;
+}
+
+// Returns "cmd1 args | cmd2 args" for a job listing
+static char* job_text(char ***cmds, int num_cmds) {
+    struct strbuf sb = {0};
+    for (int i = 0; i < num_cmds; i++) {
+        if (i > 0) sb_append(&sb, " | ", 3);
+        for (int j = 0; cmds[i][j] != NULL; j++) {
+            if (j > 0) sb_append(&sb, " ", 1);
+            sb_append(&sb, cmds[i][j], strlen(cmds[i][j]));
+        }
+    }
+    if (sb.s == NULL) sb_append(&sb, "", 0);
+    return sb.s;
+}
+
+// Takes the terminal and makes the shell the leader of its own process
+// group when it runs interactively, so jobs can be given the terminal and
+// Ctrl-C / Ctrl-Z reach only the foreground job
+void setup_job_control() {
+    if (!isatty(STDIN_FILENO)) return;
+    // Wait until we are in the foreground if started in the background
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) kill(-shell_pgid, SIGTTIN);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    if (getpid() != shell_pgid && setpgid(0, 0) < 0) {
+        perror("setpgid");
+    }
+    shell_pgid = getpid();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    job_control = 1;
+}
+
+// Gives up job control in a forked copy of the shell (subshells, server
+// sessions): its children stay in its group and get default signals
+void job_control_off() {
+    if (!job_control) return;
+    job_control = 0;
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+}
+
+// Runs in a freshly forked job process: joins process group pgid (0 makes
+// it the leader of a new one), takes the terminal for a foreground job and
+// restores the signals the interactive shell ignores
+void job_child_setup(pid_t pgid, int group) {
+    if (group != PG_NONE) {
+        setpgid(0, pgid);
+        if (group == PG_FOREGROUND && job_control) {
+            tcsetpgrp(STDIN_FILENO, pgid ? pgid : getpid()); // SIGTTOU is still ignored here
+        }
+    }
+    job_control_off();
+}
+
+// Counters opened by profile; the software ones stand in for rusage
+static const struct {
+    unsigned type;
+    unsigned long long config;
+} profile_events[PROFILE_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+enum { EV_CYCLES, EV_INSTRUCTIONS, EV_CACHE_MISSES, EV_BRANCH_MISSES, EV_CSW, EV_FAULTS, EV_TASK_CLOCK };
+
+// Sets up counters for the next job if it runs under profile. The gate
+// pipe it opens keeps every forked process from exec'ing until
+// profile_release(), so nothing runs before its counters are attached.
+struct profile* profile_begin(int nprocs) {
+    if (!profile_next) return NULL;
+    profile_next = 0;
+    struct profile *prof = calloc(1, sizeof(*prof));
+    prof->fds = malloc(nprocs * sizeof(*prof->fds));
+    memset(prof->fds, -1, nprocs * sizeof(*prof->fds));
+    prof->usage = calloc(nprocs, sizeof(struct rusage));
+    if (pipe2(profile_gate, O_CLOEXEC) < 0) {
+        perror("pipe failed"); // Counting then starts a little late
+        profile_gate[0] = profile_gate[1] = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &prof->start);
+    return prof;
+}
+
+// Opens the counters of process k on pid. They are inherited, so the
+// children it forks are counted with it.
+void profile_attach(struct profile *prof, int k, pid_t pid) {
+    for (int e = 0; e < PROFILE_EVENTS; e++) {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = profile_events[e].type;
+        attr.config = profile_events[e].config;
+        attr.inherit = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+            attr.exclude_kernel = 1; // perf_event_paranoid may still allow user-space counts
+            fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+        if (fd < 0 && attr.type == PERF_TYPE_HARDWARE && prof->hw_errno == 0) prof->hw_errno = errno;
+        prof->fds[k][e] = fd;
+    }
+}
+
+// Lets the processes of a profiled job go on to exec
+void profile_release() {
+    for (int i = 0; i < 2; i++) {
+        if (profile_gate[i] >= 0) close(profile_gate[i]);
+        profile_gate[i] = -1;
+    }
+}
+
+// In a forked child: waits until the shell has attached the counters
+void profile_child_wait() {
+    if (profile_gate[0] < 0) return;
+    char c;
+    close(profile_gate[1]);
+    while (read(profile_gate[0], &c, 1) < 0 && errno == EINTR) {}
+    close(profile_gate[0]);
+}
+
+// Reads a counter, scaled up if it was multiplexed; -1 if it never ran
+static long long profile_read(int fd) {
+    unsigned long long v[3]; // value, time enabled, time running
+    if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v) || v[2] == 0) return -1;
+    if (v[2] < v[1]) return (long long)((double)v[0] * v[1] / v[2]);
+    return (long long)v[0];
+}
+
+// Prints one row of the profile table; hardware columns show "-" when the
+// counters were unavailable and software ones fall back to rusage
+static void profile_row(const char *label, const long long *c) {
+    fprintf(stderr, "%-6s", label);
+    for (int e = EV_CYCLES; e <= EV_BRANCH_MISSES; e++) {
+        if (c[e] < 0) fprintf(stderr, " %14s", "-");
+        else fprintf(stderr, " %14lld", c[e]);
+    }
+    if (c[EV_CYCLES] > 0 && c[EV_INSTRUCTIONS] >= 0) {
+        fprintf(stderr, " %6.2f", (double)c[EV_INSTRUCTIONS] / c[EV_CYCLES]);
+    } else {
+        fprintf(stderr, " %6s", "-");
+    }
+    fprintf(stderr, " %10lld %10lld %10.1f\n", c[EV_CSW], c[EV_FAULTS], c[EV_TASK_CLOCK] / 1e6);
+}
+
+// Prints the counters of a finished profiled job on stderr: one row per
+// pipeline stage, then the totals
+void profile_report(struct job *job) {
+    struct profile *prof = job->prof;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - prof->start.tv_sec) + (now.tv_nsec - prof->start.tv_nsec) / 1e9;
+
+    fprintf(stderr, "profile: %s\n%-6s %14s %14s %14s %14s %6s %10s %10s %10s\n", job->cmd,
+            "stage", "cycles", "instructions", "cache-misses", "branch-misses",
+            "IPC", "ctx-sw", "faults", "cpu-ms");
+    long long total[PROFILE_EVENTS] = {0};
+    for (int k = 0; k < job->nprocs; k++) {
+        long long c[PROFILE_EVENTS];
+        const struct rusage *ru = &prof->usage[k];
+        for (int e = 0; e < PROFILE_EVENTS; e++) c[e] = profile_read(prof->fds[k][e]);
+        // Software counters unavailable: take the same figures from wait4()
+        if (c[EV_CSW] < 0) c[EV_CSW] = ru->ru_nvcsw + ru->ru_nivcsw;
+        if (c[EV_FAULTS] < 0) c[EV_FAULTS] = ru->ru_minflt + ru->ru_majflt;
+        if (c[EV_TASK_CLOCK] < 0) {
+            c[EV_TASK_CLOCK] = (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000LL +
+                               (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000LL;
+        }
+        for (int e = 0; e < PROFILE_EVENTS; e++) {
+            if (total[e] >= 0) total[e] = c[e] < 0 ? -1 : total[e] + c[e];
+        }
+        char label[16];
+        snprintf(label, sizeof(label), "%d", k + 1);
+        profile_row(label, c);
+    }
+    if (job->nprocs > 1) profile_row("total", total);
+    fprintf(stderr, "elapsed: %.3f s\n", elapsed);
+    if (prof->hw_errno) {
+        fprintf(stderr, "profile: hardware counters unavailable (%s)\n", strerror(prof->hw_errno));
+    }
+}
+
+// Closes a job's counters
+void profile_free(struct profile *prof, int nprocs) {
+    if (prof == NULL) return;
+    for (int k = 0; k < nprocs; k++) {
+        for (int e = 0; e < PROFILE_EVENTS; e++) {
+            if (prof->fds[k][e] >= 0) close(prof->fds[k][e]);
+        }
+    }
+    free(prof->fds);
+    free(prof->usage);
+    free(prof);
+}
+
+// Waits for the processes of a job in the foreground, giving it the
+// terminal; returns 1 if it was stopped instead of finishing. The caller
+// keeps SIGCHLD blocked so the handler cannot reap them first.
+static int wait_job(struct job *job) {
+    int stopped = 0;
+    if (job_control && job->pgid > 0) tcsetpgrp(STDIN_FILENO, job->pgid);
+    for (int i = 0; i < job->nprocs && !stopped; i++) {
+        int status;
+        if (job->pids[i] == 0) continue;
+        struct rusage *ru = job->prof ? &job->prof->usage[i] : NULL;
+        if (wait4(job->pids[i], &status, WUNTRACED, ru) < 0) {
+            status = 0;
+        } else if (WIFSTOPPED(status)) {
+            stopped = 1;
+            break;
+        }
+        job->statuses[i] = exit_status(status);
+        job->pids[i] = 0;
+        job->live--;
+    }
+    if (job_control) tcsetpgrp(STDIN_FILENO, shell_pgid);
+    job->stopped = stopped;
+    if (!stopped) job->status = job_final_status(job);
+    return stopped;
+}
+
+// Waits for a job in the foreground; a stopped job goes to the background
+// table (when not already there) and a finished one sets last_status
+static void foreground_job(struct job *job, int in_table) {
+    if (wait_job(job)) {
+        int index = in_table ? (int)(job - background_jobs) : job_add(job);
+        if (index >= 0) printf("\n[%d] Stopped  %s\n", index + 1, background_jobs[index].cmd);
+        last_status = 148; // 128 + SIGTSTP
+        return;
+    }
+    last_status = job->status;
+    if (job_control && last_status == 128 + SIGINT) printf("\n"); // Keep the prompt off the ^C line
+
+    // PIPESTATUS lists the status of every stage, e.g. "0 1 0"
+    char *list = malloc(job->nprocs * 12 + 1), *p = list;
+    for (int i = 0; i < job->nprocs; i++) p += sprintf(p, i ? " %d" : "%d", job->statuses[i]);
+    var_set("PIPESTATUS", list);
+    free(list);
+    if (job->prof) profile_report(job);
+
+    if (in_table) {
+        if (job->out != NULL) job->done = 1; // Captured output stays readable
+        else remove_job(job - background_jobs);
+    } else {
+        job_free(job);
+    }
+}
+
+// Creates the capture ring for a job started by this shell; pipe_fd is the
+// read end of the pipe its stdout and stderr were connected to
+static struct job_output* job_output_create(int pipe_fd, pid_t pid) {
+    struct job_output *out = calloc(1, sizeof(*out));
+    out->fd = pipe_fd;
+    out->cap = capture_max;
+    out->ring = malloc(out->cap);
+    out->spill_fd = -1;
+    fcntl(pipe_fd, F_SETFL, O_NONBLOCK);
+    if (capture_spill != NULL) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/pucitsh-%d-job%d.out", capture_spill, getpid(), pid);
+        out->spill_path = strdup(path);
+    }
+    return out;
+}
+
+// Appends captured bytes to a ring, spilling the bytes they overwrite
+static void job_output_put(struct job_output *out, const char *data, size_t n) {
+    while (n > 0) {
+        size_t pos = out->total % out->cap;
+        size_t k = out->cap - pos < n ? out->cap - pos : n;
+        if (out->total >= out->cap && out->spill_path != NULL) {
+            if (out->spill_fd < 0) {
+                out->spill_fd = open(out->spill_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                if (out->spill_fd < 0) {
+                    perror(out->spill_path);
+                    free(out->spill_path);
+                    out->spill_path = NULL; // Drop overwritten bytes instead
+                }
+            }
+            if (out->spill_fd >= 0) {
+                ssize_t w = write(out->spill_fd, out->ring + pos, k);
+                (void)w;
+            }
+        }
+        memcpy(out->ring + pos, data, k);
+        out->total += k;
+        data += k;
+        n -= k;
+    }
+}
+
+// Reads everything a job has written so far without blocking, echoing it
+// to echo_fd unless that is -1
+static void job_output_read(struct job_output *out, int echo_fd) {
+    char buf[4096];
+    ssize_t n;
+    while (out->fd >= 0) {
+        n = read(out->fd, buf, sizeof(buf));
+        if (n > 0) {
+            job_output_put(out, buf, n);
+            if (echo_fd >= 0) {
+                ssize_t w = write(echo_fd, buf, n);
+                (void)w;
+            }
+        } else if (n == 0 || errno != EINTR) {
+            if (n == 0) { // Every writer is gone
+                close(out->fd);
+                out->fd = -1;
+            }
+            break;
+        }
+    }
+}
+
+// Adds the pipes of capturing jobs to a poll set; returns how many
+int job_output_fds(struct pollfd *fds, int max) {
+    int n = 0;
+    for (int i = 0; i < job_count && n < max; i++) {
+        if (background_jobs[i].out != NULL && background_jobs[i].out->fd >= 0) {
+            fds[n].fd = background_jobs[i].out->fd;
+            fds[n].events = POLLIN;
+            fds[n].revents = 0;
+            n++;
+        }
+    }
+    return n;
+}
+
+// Pulls pending output of every capturing job into its ring
+void job_output_drain() {
+    for (int i = 0; i < job_count; i++) {
+        if (background_jobs[i].out != NULL) job_output_read(background_jobs[i].out, -1);
+    }
+}
+
+// Writes the ring's bytes from offset skip (within the retained data) on
+static void job_output_write(struct job_output *out, size_t skip) {
+    size_t len = out->total < out->cap ? out->total : out->cap;
+    size_t start = out->total < out->cap ? 0 : out->total % out->cap;
+    fflush(stdout);
+    for (size_t done = skip; done < len; ) {
+        size_t pos = (start + done) % out->cap;
+        size_t k = out->cap - pos < len - done ? out->cap - pos : len - done;
+        ssize_t w = write(STDOUT_FILENO, out->ring + pos, k);
+        if (w <= 0) break;
+        done += w;
+    }
+}
+
+// Offset within the retained data where its last lines lines begin
+static size_t job_output_tail(struct job_output *out, long lines) {
+    size_t len = out->total < out->cap ? out->total : out->cap;
+    size_t start = out->total < out->cap ? 0 : out->total % out->cap;
+    size_t i = len;
+    if (i > 0 && out->ring[(start + i - 1) % out->cap] == '\n') i--; // Final newline
+    while (i > 0) {
+        if (out->ring[(start + i - 1) % out->cap] == '\n' && --lines <= 0) break;
+        i--;
+    }
+    return i;
+}
+
+// Reads a process's memory and CPU usage from its cgroup, or from /proc
+static int process_usage(pid_t pid, const char *cgroup, long long *mem, long long *cpu_usec) {
+    char path[PATH_MAX + 64], buf[512];
+    FILE *fp;
+    if (cgroup != NULL) {
+        snprintf(path, sizeof(path), "%s/memory.current", cgroup);
+        if ((fp = fopen(path, "r")) == NULL) return -1;
+        int ok = fscanf(fp, "%lld", mem) == 1;
+        fclose(fp);
+        snprintf(path, sizeof(path), "%s/cpu.stat", cgroup);
+        if (!ok || (fp = fopen(path, "r")) == NULL) return -1;
+        ok = fscanf(fp, "usage_usec %lld", cpu_usec) == 1;
+        fclose(fp);
+        return ok ? 0 : -1;
+    }
+
+    // Field 14/15 of /proc/<pid>/stat are utime/stime, 24 is RSS in pages
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((fp = fopen(path, "r")) == NULL) return -1;
+    char *p = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    if (p == NULL || (p = strrchr(buf, ')')) == NULL) return -1;
+    unsigned long utime, stime;
+    long rss;
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+               "%*d %*d %*d %*d %*d %*d %*u %*u %ld", &utime, &stime, &rss) != 3) {
+        return -1;
+    }
+    *mem = rss * sysconf(_SC_PAGESIZE);
+    *cpu_usec = (utime + stime) * 1000000LL / sysconf(_SC_CLK_TCK);
+    return 0;
+}
+
+// Sums memory and CPU usage over the processes of a job still running
+static int job_usage(struct job *job, long long *mem, long long *cpu_usec) {
+    int found = 0;
+    *mem = *cpu_usec = 0;
+    for (int i = 0; i < job->nprocs; i++) {
+        long long m, c;
+        if (job->pids[i] != 0 && process_usage(job->pids[i], job->cgroups[i], &m, &c) == 0) {
+            *mem += m;
+            *cpu_usec += c;
+            found = 1;
+        }
+    }
+    return found ? 0 : -1;
+}
+
+// Descriptors proc_sample entries may keep open; past this share of the
+// fd limit, /proc files are opened again on every refresh
+static int proc_sample_budget(void) {
+    static int budget = -1;
+    if (budget < 0) {
+        struct rlimit rl;
+        budget = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+                 ? (int)(rl.rlim_cur / 2) : 512;
+    }
+    return budget;
+}
+static int proc_sample_fds = 0; // Descriptors held by proc_sample entries
+
+// Closes the /proc files of a process sample
+void proc_sample_close(struct proc_sample *s) {
+    if (s->stat_fd >= 0) { close(s->stat_fd); proc_sample_fds--; }
+    if (s->io_fd >= 0) { close(s->io_fd); proc_sample_fds--; }
+    s->stat_fd = s->io_fd = -2;
+}
+
+// Reads /proc/<pid>/<name> from the start through *fd, opening it on first
+// use; returns the length read into buf (NUL-terminated) or -1
+static ssize_t proc_sample_pread(int *fd, pid_t pid, const char *name, char *buf, size_t size) {
+    int once = -1;
+    if (*fd == -2) return -1;
+    if (*fd == -1) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, name);
+        int f = open(path, O_RDONLY | O_CLOEXEC);
+        if (f < 0) {
+            if (errno != EMFILE && errno != ENFILE) *fd = -2;
+            return -1;
+        }
+        if (proc_sample_fds < proc_sample_budget()) {
+            *fd = f;
+            proc_sample_fds++;
+        } else {
+            once = f;
+        }
+    }
+    ssize_t n = pread(once >= 0 ? once : *fd, buf, size - 1, 0);
+    if (once >= 0) close(once);
+    if (n < 0) return -1; // ESRCH once the process has been reaped
+    buf[n] = '\0';
+    return n;
+}
+
+// Refreshes the sample of one process; now is CLOCK_MONOTONIC and uptime
+// CLOCK_BOOTTIME seconds. Returns -1 once the process is gone.
+static int proc_sample_read(struct proc_sample *s, pid_t pid, double now, double uptime) {
+    static long hz = 0, page;
+    char buf[512];
+    if (hz == 0) {
+        hz = sysconf(_SC_CLK_TCK);
+        page = sysconf(_SC_PAGESIZE);
+    }
+    s->state = 0;
+    if (proc_sample_pread(&s->stat_fd, pid, "stat", buf, sizeof(buf)) <= 0) {
+        proc_sample_close(s);
+        return -1;
+    }
+    // The program name is in parentheses and may itself contain them
+    char *open_paren = strchr(buf, '('), *close_paren = strrchr(buf, ')');
+    unsigned long utime, stime;
+    unsigned long long start;
+    long rss;
+    char state;
+    if (open_paren == NULL || close_paren == NULL ||
+        sscanf(close_paren + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+               "%*d %*d %*d %*d %*d %*d %llu %*u %ld", &state, &utime, &stime, &start, &rss) != 5) {
+        return -1;
+    }
+    snprintf(s->comm, sizeof(s->comm), "%.*s", (int)(close_paren - open_paren - 1), open_paren + 1);
+
+    unsigned long long ticks = utime + stime;
+    s->state = state;
+    s->rss = rss * page;
+    s->runtime = uptime - (double)start / hz;
+    if (s->when == 0) { // First look: the average over its lifetime
+        s->cpu = s->runtime > 0 ? ticks * 100.0 / hz / s->runtime : 0;
+    } else if (now - s->when >= 0.1) { // Since the previous refresh
+        s->cpu = (ticks - s->ticks) * 100.0 / hz / (now - s->when);
+    } else { // Too soon for whole clock ticks to tell; keep the last figure
+        ticks = s->ticks;
+        now = s->when;
+    }
+    s->ticks = ticks;
+    s->when = now;
+    s->rchar = s->wchar = 0;
+    if (proc_sample_pread(&s->io_fd, pid, "io", buf, sizeof(buf)) > 0) {
+        sscanf(buf, "rchar: %llu wchar: %llu", &s->rchar, &s->wchar);
+    }
+    return 0;
+}
+
+// Formats a byte count for jobs -l: 812, 4.0K, 12M, 1.3G
+static void format_bytes(char *buf, size_t size, unsigned long long n) {
+    static const char units[] = "KMGT";
+    if (n < 1024) {
+        snprintf(buf, size, "%llu", n);
+        return;
+    }
+    double v = n / 1024.0;
+    int u = 0;
+    while (v >= 1024 && u < 3) {
+        v /= 1024;
+        u++;
+    }
+    snprintf(buf, size, v < 10 ? "%.1f%c" : "%.0f%c", v, units[u]);
+}
+
+// Word for a /proc state letter
+static const char* proc_state_name(char state) {
+    switch (state) {
+    case 'R': return "run";
+    case 'S': return "sleep";
+    case 'D': return "disk";
+    case 'T': case 't': return "stop";
+    case 'Z': return "zomb";
+    case 'I': return "idle";
+    }
+    return "?";
+}
+
+// Appends one jobs -l row, cut to width columns when width > 0; pid is 0
+// once reaped and s NULL for a process with nothing to show
+static void jobs_row(struct strbuf *sb, int width, const char *label, pid_t pid,
+                     const char *state, const struct proc_sample *s, const char *cmd) {
+    char line[1024], id[16] = "-", rss[16] = "-", rd[16] = "-", wr[16] = "-", cpu[16] = "-", t[32] = "-";
+    if (pid > 0) snprintf(id, sizeof(id), "%d", (int)pid);
+    if (s != NULL) {
+        long secs = s->runtime > 0 ? (long)s->runtime : 0;
+        format_bytes(rss, sizeof(rss), s->rss);
+        format_bytes(rd, sizeof(rd), s->rchar);
+        format_bytes(wr, sizeof(wr), s->wchar);
+        snprintf(cpu, sizeof(cpu), "%.1f", s->cpu);
+        if (secs >= 3600) snprintf(t, sizeof(t), "%ld:%02ld:%02ld", secs / 3600, secs / 60 % 60, secs % 60);
+        else snprintf(t, sizeof(t), "%ld:%02ld", secs / 60, secs % 60);
+    }
+    int n = snprintf(line, sizeof(line), "%-6s %7s %-5s %6s %6s %6s %6s %8s  %s",
+                     label, id, state, cpu, rss, rd, wr, t, cmd);
+    if (n >= (int)sizeof(line)) n = sizeof(line) - 1;
+    if (width > 0 && n > width) n = width;
+    sb_append(sb, line, n);
+    sb_append(sb, "\n", 1);
+}
+
+// Appends the jobs -l table: a row per job with its processes summed, and
+// for pipelines a row per stage under it. Each process is read through
+// its persistent /proc descriptors. Returns the number of rows.
+static int jobs_table(struct strbuf *sb, int width) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double now = ts.tv_sec + ts.tv_nsec / 1e9;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    double uptime = ts.tv_sec + ts.tv_nsec / 1e9;
+    char header[256];
+    int n = snprintf(header, sizeof(header), "%-6s %7s %-5s %6s %6s %6s %6s %8s  %s",
+                     "JOB", "PID", "STATE", "CPU%", "RSS", "READ", "WRITE", "TIME", "COMMAND");
+    sb_append(sb, header, width > 0 && n > width ? width : n);
+    sb_append(sb, "\n", 1);
+    int rows = 1;
+
+    for (int i = 0; i < job_count; i++) {
+        struct job *job = &background_jobs[i];
+        char label[16];
+        snprintf(label, sizeof(label), "[%d]", i + 1);
+        pid_t id = job->pgid > 0 ? job->pgid : job->pid;
+        if (job->samples == NULL) {
+            job->samples = calloc(job->nprocs, sizeof(struct proc_sample));
+            for (int k = 0; k < job->nprocs; k++) job->samples[k].stat_fd = job->samples[k].io_fd = -1;
+        }
+
+        // Sum the stages; the job runs if any stage does
+        struct proc_sample total = {0};
+        char state = 0;
+        for (int k = 0; k < job->nprocs; k++) {
+            struct proc_sample *s = &job->samples[k];
+            if (job->pids[k] == 0) {
+                proc_sample_close(s);
+                s->state = 0;
+                continue;
+            }
+            if (proc_sample_read(s, job->pids[k], now, uptime) < 0) continue;
+            total.cpu += s->cpu;
+            total.rss += s->rss;
+            total.rchar += s->rchar;
+            total.wchar += s->wchar;
+            if (s->runtime > total.runtime) total.runtime = s->runtime;
+            if (state == 0 || s->state == 'R' || (s->state == 'D' && state != 'R')) state = s->state;
+        }
+        const char *name = job->done || state == 0 ? "done" : job->stopped ? "stop" : proc_state_name(state);
+        jobs_row(sb, width, label, id, name, state ? &total : NULL, job->cmd);
+        rows++;
+        if (job->nprocs < 2) continue;
+        for (int k = 0; k < job->nprocs; k++) {
+            struct proc_sample *s = &job->samples[k];
+            jobs_row(sb, width, "", job->pids[k], s->state ? proc_state_name(s->state) : "done",
+                     s->state ? s : NULL, s->comm);
+            rows++;
+        }
+    }
+    return rows;
+}
+
+// ulimit builtin: shows or sets the shell's own resource limits, which
+// every command it starts inherits
+int builtin_ulimit(char **args) {
+    int hard = 0, soft = 1, all = 0, i = 1;
+    char opt = 'f';
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        for (char *c = args[i] + 1; *c; c++) {
+            if (*c == 'H') { hard = 1; soft = 0; }
+            else if (*c == 'S') { soft = 1; hard = 0; }
+            else if (*c == 'a') all = 1;
+            else if (rlimit_resource(*c) >= 0) opt = *c;
+            else {
+                fprintf(stderr, "ulimit: unknown option -%c\n", *c);
+                return 1;
+            }
+        }
+    }
+
+    static const char letters[] = "cdfnstuv";
+    static const char *names[] = { "core file size", "data seg size", "file size",
+        "open files", "stack size", "cpu time", "max user processes", "virtual memory" };
+    struct rlimit rl;
+    if (all || args[i] == NULL) {
+        for (int k = 0; letters[k]; k++) {
+            if (!all && letters[k] != opt) continue;
+            getrlimit(rlimit_resource(letters[k]), &rl);
+            rlim_t v = hard ? rl.rlim_max : rl.rlim_cur;
+            if (all) printf("%-20s (-%c) ", names[k], letters[k]);
+            if (v == RLIM_INFINITY) printf("unlimited\n");
+            else printf("%llu\n", (unsigned long long)v);
+        }
+        return 0;
+    }
+
+    long long n = opt == 't' || opt == 'n' || opt == 'u' ? atoll(args[i]) : parse_size(args[i]);
+    if (strcmp(args[i], "unlimited") == 0) n = -1;
+    if (n == -2) {
+        fprintf(stderr, "ulimit: invalid value: %s\n", args[i]);
+        return 1;
+    }
+    int res = rlimit_resource(opt);
+    getrlimit(res, &rl);
+    rlim_t v = n < 0 ? RLIM_INFINITY : (rlim_t)n;
+    if (soft) rl.rlim_cur = v;
+    if (hard) rl.rlim_max = v;
+    if (setrlimit(res, &rl) < 0) {
+        perror("ulimit");
+        return 1;
+    }
+    return 0;
+}
+
+// Applies scheduling attributes in a freshly forked child before exec
+void apply_exec_attrs(const struct exec_attrs *attrs) {
+    if (attrs->set_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &attrs->cpus) < 0) {
+        perror("sched_setaffinity failed");
+    }
+    if (attrs->set_nice && setpriority(PRIO_PROCESS, 0, attrs->nice) < 0) {
+        perror("setpriority failed");
+    }
+    if (attrs->numa_mode >= 0 &&
+        syscall(SYS_set_mempolicy, attrs->numa_mode,
+                attrs->numa_mode == MPOL_DEFAULT ? NULL : &attrs->numa_nodes,
+                sizeof(unsigned long) * 8) < 0) {
+        perror("set_mempolicy failed");
+    }
+    for (int i = 0; i < attrs->nrlimits; i++) {
+        struct rlimit rl = { attrs->rlimits[i].value, attrs->rlimits[i].value };
+        if (setrlimit(attrs->rlimits[i].resource, &rl) < 0) perror("setrlimit failed");
+    }
+    // Writing "0" to cgroup.procs moves the writing process itself
+    if (attrs->cgroup != NULL && cgroup_write(attrs->cgroup, "cgroup.procs", "0") < 0) {
+        perror("cgroup placement failed");
+    }
+}
+
+// In spread mode, pins a pipeline stage without an explicit CPU list to its
+// own core so producer and consumer do not thrash each other's caches
+void spread_stage(struct exec_attrs *attrs, int stage) {
+    if (!sched_spread || attrs->set_cpus) return;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return;
+    int ncpu = CPU_COUNT(&allowed);
+    if (ncpu < 2) return;
+
+    int want = (spread_next + stage) % ncpu, seen = 0;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, &allowed)) continue;
+        if (seen++ == want) {
+            CPU_ZERO(&attrs->cpus);
+            CPU_SET(c, &attrs->cpus);
+            attrs->set_cpus = 1;
+            return;
+        }
+    }
+}
+
+// Prints a CPU mask in list form
+static void print_cpu_list(const cpu_set_t *cpus) {
+    const char *sep = "";
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, cpus)) continue;
+        int hi = c;
+        while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, cpus)) hi++;
+        if (hi > c) printf("%s%d-%d", sep, c, hi);
+        else printf("%s%d", sep, c);
+        sep = ",";
+        c = hi;
+    }
+}
+
+// Readline callback: stores the finished line for read_command()
+static void line_handler(char *line) {
+    line_result = line;
+    line_done = 1;
+    rl_callback_handler_remove();
+}
+
+// Reads one command line with readline while also waiting on the SIGCHLD
+// self-pipe, so job notifications appear without corrupting the input
+char* read_command(const char *prompt) {
+    drain_child_events(0); // Batch everything that finished since the last prompt
+    active_prompt = prompt;
+    line_result = NULL;
+    line_done = 0;
+    if (autosuggest) {
+        char cwd[PATH_MAX];
+        suggest_cwd = getcwd(cwd, sizeof(cwd)) ? hist_hash(cwd, strlen(cwd)) : 0;
+        prompt_cols = 0;
+        for (const char *p = prompt; *p; p++) { // Colour codes take no columns
+            if (*p == '\033') {
+                while (p[1] != '\0' && !isalpha((unsigned char)p[1])) p++;
+                if (p[1] != '\0') p++;
+            } else if (((unsigned char)*p & 0xC0) != 0x80) {
+                prompt_cols++;
+            }
+        }
+        suggest_hide = 0;
+        suggest_cols = 0;
+    }
+    rl_callback_handler_install(prompt, line_handler);
+
+    while (!line_done) {
+        struct pollfd fds[3 + MAXJOBS] = {
+            { fileno(rl_instream), POLLIN, 0 },
+            { sigchld_pipe[0], POLLIN, 0 },
+            { timer_fd, POLLIN, 0 }, // Ignored by poll() until a timer exists
+        };
+        int nfds = 3 + job_output_fds(fds + 3, MAXJOBS); // Captured job output
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            rl_callback_handler_remove();
+            break;
+        }
+        if (nfds > 3) job_output_drain();
+        if (fds[1].revents & POLLIN) drain_child_events(1);
+        // A finished run may let a queued one start
+        if ((fds[1].revents | fds[2].revents) & POLLIN) timers_run();
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) rl_callback_read_char();
+    }
+    return line_result;
+}
+
+// Reads a whole command, prompting with "> " while it continues: a
+// trailing backslash joins the next line directly, an open quote keeps
+// the newline, and a trailing '|' takes the next line as the next stage.
+// The lines are joined in a buffer that doubles as it fills, and each is
+// scanned once, so a long run of them stays linear.
+char* read_full_command(const char *prompt) {
+    char *cmdline = read_command(prompt);
+    if (cmdline == NULL) return NULL;
+    struct strbuf sb = { cmdline, strlen(cmdline), strlen(cmdline) + 1 };
+    struct line_scan scan = {0};
+    int kind;
+    while ((kind = input_incomplete(sb.s, &scan)) != 0) {
+        char *more = read_command("> ");
+        if (more == NULL) break; // EOF runs what was typed so far
+        if (kind == 1) sb.s[--sb.len] = '\0';
+        else sb_append(&sb, kind == 3 ? " " : "\n", 1);
+        sb_append(&sb, more, strlen(more));
+        free(more);
+    }
+    return sb.s;
+}
+
+// Executes a command, either in the foreground or background
+int execute(char *arglist[], int background) {
+    int infile = STDIN_FILENO, outfile = STDOUT_FILENO;
+    struct exec_attrs attrs;
+    // Strip optional "sched ..." / "limit ..." prefixes off the command
+    int first = sched_options(arglist, &attrs);
+    if (first < 0) return 1;
+    arglist += first;
+    if (arglist[0] == NULL) return 0;
+    if (background && !attrs.set_nice && background_nice != 0) {
+        attrs.nice = background_nice;
+        attrs.set_nice = 1;
+    }
+    // Handle any input/output redirection
+    if (parse_redirects(arglist, &infile, &outfile) < 0) return 1;
+    if (job_cgroup_create(&attrs) < 0) {
+        if (infile != STDIN_FILENO) close(infile);
+        if (outfile != STDOUT_FILENO) close(outfile);
+        return 1;
+    }
+
+    // A captured & job writes into a pipe the shell drains into its ring
+    int capture[2] = {-1, -1};
+    if (background && capture_jobs && pipe2(capture, O_CLOEXEC) < 0) {
+        perror("pipe failed");
+    }
+
+    // Every job leads its own process group; a foreground one only under
+    // job control, so Ctrl-C in a script still stops the script
+    int group = background ? PG_BACKGROUND : job_control ? PG_FOREGROUND : PG_NONE;
+    struct profile *prof = profile_begin(1);
+    sigset_t old;
+    fflush(stdout); // Builtin output still buffered must not be inherited
+    sigchld_block(&old); // Keep the handler off this child until it is tracked
+    // The last command of a subshell takes over its process instead of forking
+    pid_t pid = exec_tail && !background && !job_control && prof == NULL ? 0 : fork();
+    if (pid == 0) { // Child process
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        job_child_setup(0, group);
+        if (capture[1] >= 0) {
+            dup2(capture[1], STDOUT_FILENO);
+            dup2(capture[1], STDERR_FILENO);
+        }
+        // Set up input redirection if specified
+        if (infile != STDIN_FILENO) {
+            dup2(infile, STDIN_FILENO);
+            close(infile);
+        }
+        // Set up output redirection if specified
+        if (outfile != STDOUT_FILENO) {
+            dup2(outfile, STDOUT_FILENO);
+            close(outfile);
+        }
+        apply_exec_attrs(&attrs);
+        procsub_inherit(arglist);
+        profile_child_wait();
+        execvp(arglist[0], arglist); // Execute the command
+        perror("execvp failed"); // Error if execvp returns
+        exit(1);
+    } else if (pid > 0) { // Parent process
+        if (group != PG_NONE) setpgid(pid, pid); // Also here, so it holds whichever side runs first
+        if (infile != STDIN_FILENO) close(infile);
+        if (outfile != STDOUT_FILENO) close(outfile);
+        if (capture[1] >= 0) close(capture[1]);
+        if (prof) {
+            profile_attach(prof, 0, pid);
+            profile_release();
+        }
+
+        struct job job = {0};
+        job.pid = pid;
+        job.pgid = group != PG_NONE ? pid : 0;
+        job.pids = malloc(sizeof(pid_t));
+        job.pids[0] = pid;
+        job.statuses = calloc(1, sizeof(int));
+        job.cgroups = malloc(sizeof(char *));
+        job.cgroups[0] = attrs.cgroup; // The job now owns its cgroup
+        job.nprocs = job.live = 1;
+        job.cmd = job_text(&arglist, 1);
+        job.prof = prof;
+        if (!background) {
+            foreground_job(&job, 0);
+        } else {
+            if (capture[0] >= 0) job.out = job_output_create(capture[0], pid);
+            last_background = pid;
+            job_add(&job);
+            printf("[Background PID %d]\n", pid);
+        }
+    } else {
+        perror("fork failed");
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        if (infile != STDIN_FILENO) close(infile);
+        if (outfile != STDOUT_FILENO) close(outfile);
+        job_cgroup_remove(attrs.cgroup);
+        profile_release();
+        profile_free(prof, 1);
+        if (capture[0] >= 0) {
+            close(capture[0]);
+            close(capture[1]);
+        }
+        return 1;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+// Starts the stages of a pipeline reading from in_fd and writing the last
+// stage to out_fd, without waiting; returns how many stages were started.
+// With group other than PG_NONE all stages join one process group led by
+// the first. A stage with an entry in nodes runs that group or subshell in
+// a copy of the shell. The caller must have SIGCHLD blocked and reaps pids
+// itself.
+int launch_pipeline(char ***cmds, int num_cmds, int in_fd, int out_fd, pid_t *pids, char **cgroups, int group, struct profile *prof, struct node **nodes) {
+    int i, fd[2], first_in = in_fd;
+    pid_t pid;
+    int started = 0;
+
+    // Loop through each command in the pipeline
+    for (i = 0; i < num_cmds; i++) {
+        struct exec_attrs attrs;
+        struct node *node = nodes != NULL ? nodes[i] : NULL;
+        int first = sched_options(cmds[i], &attrs); // Per-stage sched prefix
+        if (first < 0) break;
+        char **argv = cmds[i] + first;
+        spread_stage(&attrs, i);
+        if (job_cgroup_create(&attrs) < 0) break;
+
+        // The pipe to the next stage is made just before this stage is
+        // forked; the last stage needs none. The previous read end and the
+        // new pair are all open only until that fork, since the stage needs
+        // two of them and the next stage the third.
+        fd[0] = fd[1] = -1;
+        if (i < num_cmds - 1 && pipe2(fd, O_CLOEXEC) == -1) {
+            perror("pipe failed");
+            job_cgroup_remove(attrs.cgroup);
+            break;
+        }
+
+        fflush(stdout);
+        if ((pid = fork()) == 0) { // Child process
+            sigset_t none;
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+            job_child_setup(started ? pids[0] : 0, group);
+            dup2(in_fd, STDIN_FILENO); // Input from previous command or stdin
+            if (i < num_cmds - 1) {
+                dup2(fd[1], STDOUT_FILENO); // Output to the pipe
+            } else if (out_fd != STDOUT_FILENO) {
+                dup2(out_fd, STDOUT_FILENO); // Output of the whole pipeline
+            }
+            // Builtin stages never exec, so drop the originals explicitly
+            int extra[4] = { in_fd, out_fd, fd[0], fd[1] };
+            for (int k = 0; k < 4; k++) {
+                if (extra[k] > STDERR_FILENO) close(extra[k]);
+            }
+
+            // Execute the command
+            apply_exec_attrs(&attrs);
+            procsub_inherit(argv);
+            profile_child_wait();
+            if (node) run_subshell(node);
+            if (argv[0] != NULL && find_function(argv[0]) != NULL) {
+                int status = call_function(argv);
+                fflush(stdout);
+                _exit(status);
+            }
+            if (argv[0] != NULL && find_builtin(argv[0]) != NULL) {
+                int status = handle_builtins(argv); // Builtin stage: no exec needed
+                fflush(stdout);
+                _exit(status);
+            }
+            if (argv[0] != NULL) {
+                execvp(argv[0], argv);
+                perror("execvp failed");
+            }
+            exit(1); // Exit on execvp failure
+        } else if (pid < 0) { // Fork failure
+            perror("fork failed");
+            if (fd[0] >= 0) {
+                close(fd[0]);
+                close(fd[1]);
+            }
+            job_cgroup_remove(attrs.cgroup);
+            break;
+        }
+
+        // The child has its two ends now: close them before anything else,
+        // keeping only the read end for the next stage
+        if (fd[1] >= 0) close(fd[1]);
+        if (in_fd != first_in) close(in_fd);
+        in_fd = fd[0] >= 0 ? fd[0] : first_in;
+
+        if (group != PG_NONE) setpgid(pid, started ? pids[0] : pid);
+        if (prof) profile_attach(prof, started, pid);
+        if (cgroups) cgroups[started] = attrs.cgroup;
+        else job_cgroup_remove(attrs.cgroup);
+        pids[started++] = pid;
+    }
+    if (in_fd != first_in) close(in_fd);
+    if (prof) profile_release(); // Every stage is counted: let them all run
+
+    spread_next += num_cmds; // Next pipeline starts on the following cores
+    return started;
+}
+
+// Executes a pipeline of commands (e.g., cmd1 | cmd2 | cmd3)
+int execute_pipeline(char ***cmds, int num_cmds, int background, struct node **nodes) {
+    struct job job = {0};
+    sigset_t old;
+
+    job.pids = malloc(num_cmds * sizeof(pid_t));
+    job.statuses = calloc(num_cmds, sizeof(int));
+    job.cgroups = malloc(num_cmds * sizeof(char *));
+    sigchld_block(&old); // Stages are waited for below, not by the handler
+    int group = background ? PG_BACKGROUND : job_control ? PG_FOREGROUND : PG_NONE;
+    job.prof = profile_begin(num_cmds);
+    int started = launch_pipeline(cmds, num_cmds, STDIN_FILENO, STDOUT_FILENO, job.pids, job.cgroups, group, job.prof, nodes);
+    job.nprocs = job.live = started;
+    if (started == 0) {
+        job_free(&job);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        last_status = 1;
+        return 1;
+    }
+    // The pipeline's status is that of its last stage
+    job.pid = job.pids[started - 1];
+    job.pgid = group != PG_NONE ? job.pids[0] : 0;
+    job.cmd = job_text(cmds, num_cmds);
+
+    if (background) {
+        last_background = job.pid;
+        int index = job_add(&job);
+        if (index >= 0) printf("[%d] %d\n", index + 1, job.pgid);
+        last_status = 0;
+    } else {
+        // Wait for the commands of this pipeline only, leaving background
+        // jobs to the SIGCHLD handler
+        foreground_job(&job, 0);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return started == num_cmds ? 0 : 1;
+}
+
+// Returns a pointer just past the closing quote of the quoted text at p
+static char* skip_quoted(char *p) {
+    char q = *p++;
+    while (*p != '\0' && *p != q) {
+        if (q == '"' && *p == '\\' && p[1] != '\0') p++;
+        p++;
+    }
+    return *p == q ? p + 1 : p;
+}
+
+// Returns a pointer just past the end of the word starting at p. Quotes,
+// backslash escapes and parenthesised substitutions such as <(a | b) are
+// kept inside a single word.
+char* scan_word(char *p) {
+    int depth = 0;
+    while (*p != '\0') {
+        if (depth == 0 && (*p == ' ' || *p == '\t')) break;
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            p = skip_quoted(p);
+        } else {
+            if (*p == '(') depth++;
+            else if (*p == ')' && depth > 0) depth--;
+            p++;
+        }
+    }
+    return p;
+}
+
+// Tells whether a command line continues on the next one: 1 if it ends in
+// an unescaped backslash, 2 inside an unclosed quote, 3 after a trailing
+// '|'; 0 if it is complete. One pass, so long lines stay linear. With scan
+// set, it starts where the last call on the same line stopped; after a 1,
+// that is the backslash, which the caller removes before appending.
+int line_incomplete(const char *s, struct line_scan *scan) {
+    struct line_scan st = {0};
+    if (scan != NULL) st = *scan;
+    const char *p = s + st.pos;
+    int kind = 0;
+    for (; *p != '\0'; p++) {
+        if (st.quote != 0) {
+            if (*p == st.quote) st.quote = 0;
+            else if (st.quote == '"' && *p == '\\' && p[1] != '\0') p++;
+        } else if (*p == '\\') {
+            if (p[1] == '\0') {
+                kind = 1;
+                break;
+            }
+            p++;
+            st.after_pipe = 0;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            st.quote = *p;
+            st.after_pipe = 0;
+        } else if (*p == '|') {
+            st.after_pipe = 1;
+        } else if (*p != ' ' && *p != '\t') {
+            st.after_pipe = 0;
+        }
+    }
+    if (kind == 0) kind = st.quote != 0 ? 2 : st.after_pipe ? 3 : 0;
+    st.pos = p - s;
+    if (scan != NULL) *scan = st;
+    return kind;
+}
+
+// Splits a command line on top-level '|' into trimmed stage strings,
+// leaving pipes inside quotes and substitutions alone; returns a malloc'd
+// array of any length, with the count in *num_cmds
+char** split_pipeline(char *cmdline, int *num_cmds) {
+    int n = 0, cap = 4;
+    char **pipe_cmds = malloc(cap * sizeof(char *));
+    char *start = cmdline, *cp = cmdline;
+    int depth = 0;
+    for (;;) {
+        if (*cp == '\0' || (*cp == '|' && depth == 0)) {
+            int last = *cp == '\0';
+            *cp = '\0';
+            while (*start == ' ' || *start == '\t') start++;
+            char *end = start + strlen(start);
+            while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+            *end = '\0';
+            if (n == cap) pipe_cmds = realloc(pipe_cmds, (cap *= 2) * sizeof(char *));
+            pipe_cmds[n++] = start;
+            if (last) break;
+            start = ++cp;
+        } else if (*cp == '\\' && cp[1] != '\0') {
+            cp += 2;
+        } else if (*cp == '\'' || *cp == '"' || *cp == '`') {
+            cp = skip_quoted(cp);
+        } else {
+            if (*cp == '(') depth++;
+            else if (*cp == ')' && depth > 0) depth--;
+            cp++;
+        }
+    }
+    *num_cmds = n;
+    return pipe_cmds;
+}
+
+// Frees a NULL-terminated argument list
+static void free_args(char **args) {
+    for (int j = 0; args[j] != NULL; j++) free(args[j]);
+    free(args);
+}
+
+// Runs the pipeline inside <(...) or >(...) connected to a new pipe and
+// rewrites the word to /dev/fd/N naming the parent's end of that pipe
+static char* start_procsub(const char *word) {
+    int output = word[0] == '>'; // >(cmd) reads what the command writes
+    size_t len = strlen(word);
+    char *result = NULL;
+    if (procsub_count == MAX_PROCSUBS) {
+        fprintf(stderr, "Too many process substitutions\n");
+        return NULL;
+    }
+
+    char *inner = strndup(word + 2, len - 3);
+    int num_cmds, ok = 1;
+    char **pipe_cmds = split_pipeline(inner, &num_cmds);
+    char ***cmds = malloc(num_cmds * sizeof(char **));
+    for (int i = 0; i < num_cmds; i++) {
+        char **raw = tokenize(pipe_cmds[i]);
+        cmds[i] = expand_args(raw);
+        free(raw);
+        if (cmds[i] == NULL) {
+            num_cmds = i;
+            ok = 0;
+            break;
+        }
+        if (cmds[i][0] == NULL) ok = 0;
+    }
+
+    int fd[2];
+    struct procsub *ps = &procsubs[procsub_count];
+    if (ok && pipe2(fd, O_CLOEXEC) == 0) {
+        sigset_t old;
+        sigchld_block(&old);
+        ps->pids = malloc(num_cmds * sizeof(pid_t));
+        if (output) {
+            ps->npids = launch_pipeline(cmds, num_cmds, fd[0], STDOUT_FILENO, ps->pids, NULL, PG_NONE, NULL, NULL);
+        } else {
+            ps->npids = launch_pipeline(cmds, num_cmds, STDIN_FILENO, fd[1], ps->pids, NULL, PG_NONE, NULL, NULL);
+        }
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        close(output ? fd[0] : fd[1]); // The pipeline owns the other end now
+        ps->fd = output ? fd[1] : fd[0];
+        procsub_count++;
+
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/fd/%d", ps->fd);
+        result = strdup(path);
+    } else if (ok) {
+        perror("pipe failed");
+    }
+
+    for (int i = 0; i < num_cmds; i++) free_args(cmds[i]);
+    free(cmds);
+    free(pipe_cmds);
+    free(inner);
+    return result;
+}
+
+// Appends len bytes to a growable buffer, doubling its capacity as needed
+static void sb_append(struct strbuf *sb, const char *data, size_t len) {
+    if (sb->len + len + 1 > sb->cap) {
+        size_t cap = sb->cap ? sb->cap : 64;
+        while (sb->len + len + 1 > cap) cap *= 2;
+        sb->s = realloc(sb->s, cap);
+        sb->cap = cap;
+    }
+    memcpy(sb->s + sb->len, data, len);
+    sb->len += len;
+    sb->s[sb->len] = '\0';
+}
+
+// Appends a word to a growable argument list, keeping it NULL-terminated
+static void ab_push(struct argbuf *ab, char *word) {
+    if (ab->n + 2 > ab->cap) {
+        ab->cap = ab->cap ? ab->cap * 2 : MAXARGS + 1;
+        ab->v = realloc(ab->v, ab->cap * sizeof(char*));
+    }
+    ab->v[ab->n++] = word;
+    ab->v[ab->n] = NULL;
+}
+
+// Returns the ')' matching an already consumed '(' before p, skipping
+// quotes and nested parentheses, or NULL if it is missing
+static char* find_close(char *p) {
+    int depth = 1;
+    while (*p != '\0') {
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+            continue;
+        }
+        if (*p == '\'' || *p == '"' || *p == '`') {
+            p = skip_quoted(p);
+            continue;
+        }
+        if (*p == '(') depth++;
+        else if (*p == ')' && --depth == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+// Arithmetic evaluator state for $((...))
+static const char *arith_p;
+static int arith_err;
+
+static long long arith_binary(int minprec);
+
+// Parses a number, variable, parenthesised expression or unary operator
+static long long arith_primary() {
+    while (isspace((unsigned char)*arith_p)) arith_p++;
+    if (*arith_p == '(') {
+        arith_p++;
+        long long v = arith_binary(1);
+        while (isspace((unsigned char)*arith_p)) arith_p++;
+        if (*arith_p++ != ')') arith_err = 1;
+        return v;
+    }
+    if (*arith_p == '-') { arith_p++; return -arith_primary(); }
+    if (*arith_p == '+') { arith_p++; return arith_primary(); }
+    if (*arith_p == '!') { arith_p++; return !arith_primary(); }
+    if (isdigit((unsigned char)*arith_p)) {
+        char *end;
+        long long v = strtoll(arith_p, &end, 0);
+        arith_p = end;
+        return v;
+    }
+    if (*arith_p == '$') arith_p++;
+    if (isalpha((unsigned char)*arith_p) || *arith_p == '_') {
+        char name[256];
+        size_t n = 0;
+        while ((isalnum((unsigned char)*arith_p) || *arith_p == '_') && n < sizeof(name) - 1) {
+            name[n++] = *arith_p++;
+        }
+        name[n] = '\0';
+        const char *val = getenv(name); // Unset variables count as 0
+        return val ? atoll(val) : 0;
+    }
+    arith_err = 1;
+    return 0;
+}
+
+// Returns the precedence of the binary operator at arith_p and its length
+static int arith_op(int *len) {
+    static const struct { const char *op; int prec; } ops[] = {
+        {"||", 1}, {"&&", 2}, {"==", 3}, {"!=", 3}, {"<=", 4}, {">=", 4},
+        {"<", 4}, {">", 4}, {"+", 5}, {"-", 5}, {"*", 6}, {"/", 6}, {"%", 6},
+    };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        size_t n = strlen(ops[i].op);
+        if (strncmp(arith_p, ops[i].op, n) == 0) {
+            *len = n;
+            return ops[i].prec;
+        }
+    }
+    return 0;
+}
+
+// Precedence-climbing parser for binary operators
+static long long arith_binary(int minprec) {
+    long long lhs = arith_primary();
+    for (;;) {
+        while (isspace((unsigned char)*arith_p)) arith_p++;
+        int len, prec = arith_op(&len);
+        if (prec == 0 || prec < minprec) return lhs;
+        const char *op = arith_p;
+        arith_p += len;
+        long long rhs = arith_binary(prec + 1);
+        switch (op[0]) {
+        case '|': lhs = lhs || rhs; break;
+        case '&': lhs = lhs && rhs; break;
+        case '=': lhs = lhs == rhs; break;
+        case '!': lhs = lhs != rhs; break;
+        case '<': lhs = len == 2 ? lhs <= rhs : lhs < rhs; break;
+        case '>': lhs = len == 2 ? lhs >= rhs : lhs > rhs; break;
+        case '+': lhs += rhs; break;
+        case '-': lhs -= rhs; break;
+        case '*': lhs *= rhs; break;
+        case '/':
+        case '%':
+            if (rhs == 0) {
+                arith_err = 1;
+                return 0;
+            }
+            lhs = op[0] == '/' ? lhs / rhs : lhs % rhs;
+            break;
+        }
+    }
+}
+
+// Evaluates an integer expression as used by $((...)); sets *err on failure
+long long eval_arith(const char *expr, int *err) {
+    arith_p = expr;
+    arith_err = 0;
+    long long v = arith_binary(1);
+    while (isspace((unsigned char)*arith_p)) arith_p++;
+    *err = arith_err || *arith_p != '\0';
+    return v;
+}
+
+// Runs cmd and returns everything it wrote to stdout with trailing newlines
+// removed. Builtins run in-process with stdout pointed at a memfd; anything
+// else runs in a forked copy of the shell feeding a pipe that is read in
+// large chunks into a growable buffer.
+char* capture_output(const char *cmd, size_t *len) {
+    struct strbuf out = {0};
+    char *line = strdup(cmd);
+    struct node *tree = parse_line(line, NULL);
+    if (tree == NULL) {
+        free(line);
+        last_status = 2;
+        *len = 0;
+        return strdup("");
+    }
+    char **words = tree->nkids == 1 && tree->kids[0]->type == N_CMD ? tree->kids[0]->words : NULL;
+    // Builtins that change shell state still need a separate process
+    struct builtin *b = words != NULL && words[0] != NULL ? find_builtin(words[0]) : NULL;
+    int in_process = b != NULL && b->pure && find_function(words[0]) == NULL;
+
+    fflush(stdout);
+    if (in_process) {
+        int mfd = memfd_create("pucitsh-capture", MFD_CLOEXEC);
+        int saved = dup(STDOUT_FILENO);
+        if (mfd >= 0 && saved >= 0) {
+            dup2(mfd, STDOUT_FILENO);
+            char **args = expand_args(words);
+            if (args != NULL) {
+                last_status = run_builtin(args);
+                free_args(args);
+            }
+            fflush(stdout);
+            dup2(saved, STDOUT_FILENO);
+            off_t size = lseek(mfd, 0, SEEK_END);
+            out.s = malloc(size + 1);
+            out.cap = size + 1;
+            out.len = pread(mfd, out.s, size, 0) == size ? size : 0;
+            out.s[out.len] = '\0';
+        } else {
+            perror("memfd_create failed");
+        }
+        if (mfd >= 0) close(mfd);
+        if (saved >= 0) close(saved);
+    } else {
+        int fd[2];
+        sigset_t old;
+        if (pipe2(fd, O_CLOEXEC) < 0) {
+            perror("pipe failed");
+        } else {
+            fflush(stdout);
+            sigchld_block(&old);
+            pid_t pid = fork();
+            if (pid == 0) { // Child: a copy of this shell runs the command
+                sigprocmask(SIG_SETMASK, &old, NULL);
+                job_control_off();
+                dup2(fd[1], STDOUT_FILENO);
+                close(fd[1]);
+                exec_node(tree, 1); // Its last command may exec in place of this copy
+                fflush(stdout);
+                _exit(last_status);
+            }
+            close(fd[1]);
+            if (pid > 0) {
+                ssize_t n;
+                for (;;) {
+                    if (out.cap - out.len < CAPTURE_CHUNK + 1) {
+                        out.cap = out.cap ? out.cap * 2 : CAPTURE_CHUNK + 1;
+                        while (out.cap - out.len < CAPTURE_CHUNK + 1) out.cap *= 2;
+                        out.s = realloc(out.s, out.cap);
+                    }
+                    n = read(fd[0], out.s + out.len, CAPTURE_CHUNK);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) break;
+                    out.len += n;
+                }
+                int status;
+                waitpid(pid, &status, 0);
+                last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            } else {
+                perror("fork failed");
+            }
+            close(fd[0]);
+            sigprocmask(SIG_SETMASK, &old, NULL);
+        }
+    }
+    node_free(tree);
+    free(line);
+
+    if (out.s == NULL) sb_append(&out, "", 0);
+    while (out.len > 0 && out.s[out.len - 1] == '\n') out.len--;
+    out.s[out.len] = '\0';
+    *len = out.len;
+    return out.s;
+}
+
+// Sets an exported variable. setenv() allocates a new string for every
+// value and keeps all of them, which a loop assigning a counter pays for
+// on every iteration; here each variable keeps one buffer in environ that
+// is overwritten in place, or swapped with putenv() when it grows.
+void var_set(const char *name, const char *value) {
+    size_t nlen = strlen(name), vlen = strlen(value);
+    struct var_buf *vb = NULL;
+    for (int i = 0; i < var_buf_count; i++) {
+        if (var_bufs[i].name_len == nlen && strncmp(var_bufs[i].str, name, nlen) == 0) {
+            vb = &var_bufs[i];
+            break;
+        }
+    }
+    // Someone else's setenv() or unsetenv() may have dropped our string
+    int live = vb != NULL && getenv(name) == vb->str + nlen + 1;
+    if (live && nlen + vlen + 2 <= vb->cap) {
+        memcpy(vb->str + nlen + 1, value, vlen + 1);
+        return;
+    }
+    if (vb == NULL) {
+        var_bufs = realloc(var_bufs, (var_buf_count + 1) * sizeof(struct var_buf));
+        vb = &var_bufs[var_buf_count++];
+        vb->str = NULL;
+        vb->name_len = nlen;
+    }
+    size_t cap = nlen + vlen + 2 < 32 ? 32 : (nlen + vlen + 2) * 2;
+    char *str = malloc(cap);
+    memcpy(str, name, nlen);
+    str[nlen] = '=';
+    memcpy(str + nlen + 1, value, vlen + 1);
+    putenv(str);
+    free(vb->str); // No longer in environ either way
+    vb->str = str;
+    vb->cap = cap;
+}
+
+// Adds expanded text to the current field; unquoted text is split on
+// whitespace into separate fields
+static void add_expansion(struct argbuf *ab, struct strbuf *field, int *have,
+                          const char *text, size_t len, int quoted) {
+    if (quoted) {
+        sb_append(field, text, len);
+        *have = 1;
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == ' ' || text[i] == '\t' || text[i] == '\n') {
+            if (*have) {
+                ab_push(ab, field->s ? strdup(field->s) : strdup(""));
+                field->len = 0;
+                if (field->s) field->s[0] = '\0';
+                *have = 0;
+            }
+        } else {
+            sb_append(field, text + i, 1);
+            *have = 1;
+        }
+    }
+}
+
+// Returns whether a word starts with NAME=, i.e. is a variable assignment
+static int is_assignment(const char *w) {
+    if (!isalpha((unsigned char)w[0]) && w[0] != '_') return 0;
+    while (isalnum((unsigned char)*w) || *w == '_') w++;
+    return *w == '=';
+}
+
+// Expands one word: quote removal, $VAR/${VAR}/$?/$$, $1.../$#/$@/$*,
+// $((...)), and $(...)/`...` command substitution; may produce zero or
+// more fields. The value of an assignment (assign set) is never split, as
+// if it were double-quoted.
+static int expand_word(char *w, struct argbuf *ab, int assign) {
+    struct strbuf field = {0};
+    int have = 0, dq = 0;
+    char *p = w;
+
+    while (*p != '\0') {
+        if (!dq && *p == '\'') {
+            char *e = skip_quoted(p);
+            sb_append(&field, p + 1, e - p - (e[-1] == '\'' && e - p > 1 ? 2 : 1));
+            have = 1;
+            p = e;
+        } else if (*p == '"') {
+            dq = !dq;
+            have = 1;
+            p++;
+        } else if (*p == '\\' && p[1] != '\0') {
+            if (dq && !strchr("\\\"$`", p[1])) sb_append(&field, p, 1);
+            sb_append(&field, p + 1, 1);
+            have = 1;
+            p += 2;
+        } else if (p[0] == '$' && p[1] == '(' && p[2] == '(') {
+            // Arithmetic expansion runs in-process
+            char *e = find_close(p + 3);
+            if (e == NULL || e[1] != ')') {
+                fprintf(stderr, "Unterminated $((\n");
+                free(field.s);
+                return -1;
+            }
+            char *expr = strndup(p + 3, e - p - 3), num[32];
+            int err;
+            if (strpbrk(expr, "$`") != NULL) { // $1, $(...) and the like come first
+                char *expanded = expand_one(expr);
+                free(expr);
+                expr = expanded;
+            }
+            long long v = eval_arith(expr, &err);
+            free(expr);
+            if (err) {
+                fprintf(stderr, "Invalid arithmetic expression\n");
+                free(field.s);
+                return -1;
+            }
+            snprintf(num, sizeof(num), "%lld", v);
+            add_expansion(ab, &field, &have, num, strlen(num), dq || assign);
+            p = e + 2;
+        } else if ((p[0] == '$' && p[1] == '(') || p[0] == '`') {
+            char *e = p[0] == '`' ? strchr(p + 1, '`') : find_close(p + 2);
+            if (e == NULL) {
+                fprintf(stderr, "Unterminated command substitution\n");
+                free(field.s);
+                return -1;
+            }
+            char *start = p + (p[0] == '`' ? 1 : 2);
+            char *inner = strndup(start, e - start);
+            size_t len;
+            char *text = capture_output(inner, &len);
+            add_expansion(ab, &field, &have, text, len, dq || assign);
+            free(text);
+            free(inner);
+            p = e + 1;
+        } else if (p[0] == '$' && (p[1] == '?' || p[1] == '$' || p[1] == '!')) {
+            char num[32];
+            snprintf(num, sizeof(num), "%d", p[1] == '?' ? last_status :
+                     p[1] == '!' ? (int)last_background : (int)getpid());
+            add_expansion(ab, &field, &have, num, strlen(num), dq || assign);
+            p += 2;
+        } else if (p[0] == '$' && p[1] >= '1' && p[1] <= '9') {
+            if (p[1] - '0' <= pos_count) {
+                const char *val = pos_args[p[1] - '1'];
+                add_expansion(ab, &field, &have, val, strlen(val), dq || assign);
+            }
+            p += 2;
+        } else if (p[0] == '$' && p[1] == '#') {
+            char num[16];
+            snprintf(num, sizeof(num), "%d", pos_count);
+            add_expansion(ab, &field, &have, num, strlen(num), dq || assign);
+            p += 2;
+        } else if (p[0] == '$' && (p[1] == '@' || p[1] == '*')) {
+            // "$@" keeps each argument a field of its own
+            for (int i = 0; i < pos_count; i++) {
+                if (i > 0 && dq && p[1] == '@') {
+                    ab_push(ab, field.s ? strdup(field.s) : strdup(""));
+                    field.len = 0;
+                    if (field.s) field.s[0] = '\0';
+                } else if (i > 0) {
+                    add_expansion(ab, &field, &have, " ", 1, dq || assign);
+                }
+                add_expansion(ab, &field, &have, pos_args[i], strlen(pos_args[i]), dq || assign);
+            }
+            p += 2;
+        } else if (p[0] == '$' && (p[1] == '{' || isalpha((unsigned char)p[1]) || p[1] == '_')) {
+            // Variable expansion reads the environment, no fork involved
+            char name[256];
+            size_t n = 0;
+            int braced = p[1] == '{';
+            p += braced ? 2 : 1;
+            while ((isalnum((unsigned char)*p) || *p == '_') && n < sizeof(name) - 1) name[n++] = *p++;
+            name[n] = '\0';
+            if (braced && *p == '}') p++;
+            const char *val = getenv(name);
+            if (isdigit((unsigned char)name[0])) { // ${10}
+                int k = atoi(name);
+                val = k >= 1 && k <= pos_count ? pos_args[k - 1] : NULL;
+            }
+            if (val) add_expansion(ab, &field, &have, val, strlen(val), dq || assign);
+        } else {
+            sb_append(&field, p, 1);
+            have = 1;
+            p++;
+        }
+    }
+    if (have) ab_push(ab, field.s ? field.s : strdup(""));
+    else free(field.s);
+    return 0;
+}
+
+// Expands the words of a command in the parent before it runs: starts
+// process substitutions, performs variable, arithmetic and command
+// substitution, and removes quoting. Returns a newly allocated list and
+// leaves args untouched, or returns NULL on error.
+char** expand_args(char **args) {
+    struct argbuf ab = {0};
+    ab_push(&ab, NULL);
+    ab.n = 0;
+    int assigning = 1; // Still in the NAME=value words before the command
+    for (int i = 0; args[i] != NULL; i++) {
+        char *w = args[i];
+        size_t len = strlen(w);
+        assigning = assigning && is_assignment(w);
+        if ((w[0] == '<' || w[0] == '>') && w[1] == '(' && len > 3 && w[len - 1] == ')' &&
+            scan_word(w + 1) == w + len) {
+            char *path = start_procsub(w);
+            if (path == NULL) goto fail;
+            ab_push(&ab, path);
+        } else if (strpbrk(w, "$`'\"\\") == NULL) {
+            ab_push(&ab, strdup(w)); // Nothing to expand or unquote
+        } else if (expand_word(w, &ab, assigning) < 0) {
+            goto fail;
+        }
+    }
+    return ab.v;
+
+fail:
+    free_args(ab.v);
+    return NULL;
+}
+
+// In a child about to exec argv, lets the /dev/fd/N paths of the process
+// substitutions it names survive the exec and closes the others, so that
+// in tee >(a) >(b) the pipeline of >(b) does not hold >(a)'s pipe open
+void procsub_inherit(char **argv) {
+    for (int i = 0; i < procsub_count; i++) {
+        char path[32];
+        int named = 0;
+        snprintf(path, sizeof(path), "/dev/fd/%d", procsubs[i].fd);
+        for (int j = 0; argv[j] != NULL && !named; j++) named = strcmp(argv[j], path) == 0;
+        if (named) {
+            fcntl(procsubs[i].fd, F_SETFD, 0);
+        } else {
+            close(procsubs[i].fd);
+        }
+    }
+}
+
+// Closes the parent's pipe ends once the command line has run and reaps
+// the substituted pipelines; background ones are left to the SIGCHLD handler
+void procsub_finish(int background) {
+    for (int i = 0; i < procsub_count; i++) {
+        close(procsubs[i].fd); // Gives writers EPIPE and readers EOF
+        for (int j = 0; background == 0 && j < procsubs[i].npids; j++) {
+            waitpid(procsubs[i].pids[j], NULL, 0);
+        }
+        free(procsubs[i].pids);
+    }
+    procsub_count = 0;
+}
+
+// Splits a command line into words in place: each word is NUL-terminated
+// inside cmdline and the returned array points into it, so the only
+// allocation is the array itself (release it with free(), not free_args())
+char** tokenize(char* cmdline) {
+    int argnum = 0, cap = 8;
+    char** arglist = malloc(cap * sizeof(char*));
+    char* cp = cmdline;
+
+    // Keep quoted text and substitutions together within a word
+    while (*cp != '\0') {
+        while (*cp == ' ' || *cp == '\t') cp++; // Skip whitespace
+        if (*cp == '\0') break;
+
+        char* start = cp;
+        cp = scan_word(cp);
+        if (*cp != '\0') *cp++ = '\0';
+        if (argnum + 1 == cap) arglist = realloc(arglist, (cap *= 2) * sizeof(char*));
+        arglist[argnum++] = start;
+    }
+    arglist[argnum] = NULL; // Null-terminate the argument list
+    return arglist;
+}
+
+// Parses input/output redirection symbols (<, > and >> to append) and sets
+// file descriptors. The redirections are removed from args and their words
+// (malloc'd, as from expand_args()) freed, so free_args() still reaches
+// every word left. The files are opened close-on-exec (dup2() onto 0 or 1
+// clears that), a file replaced by a later redirection is closed, and on
+// failure none stay open.
+int parse_redirects(char **args, int *infile, int *outfile) {
+    int in = *infile, out = *outfile, j = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        int append = strcmp(args[i], ">>") == 0, output = append || strcmp(args[i], ">") == 0;
+        if (!output && strcmp(args[i], "<") != 0) {
+            args[j++] = args[i];
+            continue;
+        }
+        int fd = args[i + 1] == NULL ? -1 :
+                 output ? open(args[i + 1], O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC) | O_CLOEXEC, 0644)
+                        : open(args[i + 1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (args[i + 1] == NULL) fprintf(stderr, "syntax error: no file after %s\n", args[i]);
+            else perror(output ? "Failed to open output file" : "Failed to open input file");
+            if (in != *infile) close(in);
+            if (out != *outfile) close(out);
+            while (args[i] != NULL) args[j++] = args[i++]; // Still the caller's to free
+            args[j] = NULL;
+            return -1;
+        }
+        int *slot = output ? &out : &in;
+        if (*slot != (output ? *outfile : *infile)) close(*slot);
+        *slot = fd;
+        free(args[i]);
+        free(args[++i]);
+    }
+    args[j] = NULL;
+    *infile = in;
+    *outfile = out;
+    return 0;
+}
+
+// Entries of the directory database, right after its header
+static struct zdb_entry* zdb_entries() {
+    return (struct zdb_entry *)(zdb + 1);
+}
+
+// Maps the directory database, creating it on first use and remapping it
+// when another session has grown the file; returns -1 if unavailable
+static int zdb_map() {
+    struct stat st;
+    if (zdb_fd < 0) {
+        const char *home = getenv("HOME");
+        char path[PATH_MAX];
+        if (home == NULL) return -1;
+        snprintf(path, sizeof(path), "%s/" ZDB_FILE, home);
+        if ((zdb_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) return -1;
+    }
+    if (fstat(zdb_fd, &st) < 0) return -1;
+    if (zdb != NULL && (size_t)st.st_size == zdb_size) return 0;
+    if (zdb != NULL) munmap(zdb, zdb_size);
+    zdb = NULL;
+
+    size_t size = st.st_size;
+    if (size < sizeof(struct zdb_header)) { // New file: lay out an empty table
+        flock(zdb_fd, LOCK_EX);
+        if (fstat(zdb_fd, &st) == 0 && (size = st.st_size) < sizeof(struct zdb_header)) {
+            struct zdb_header hdr = { ZDB_MAGIC, ZDB_MIN_SLOTS, 0, 0, 0, 0 };
+            size = sizeof(hdr) + ZDB_MIN_SLOTS * sizeof(struct zdb_entry);
+            if (ftruncate(zdb_fd, size) < 0 || pwrite(zdb_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+                size = 0;
+            }
+        }
+        flock(zdb_fd, LOCK_UN);
+        if (size == 0) return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, zdb_fd, 0);
+    if (map == MAP_FAILED) return -1;
+    zdb = map;
+    zdb_size = size;
+    if (memcmp(zdb->magic, ZDB_MAGIC, 8) != 0 ||
+        size != sizeof(struct zdb_header) + zdb->nslots * sizeof(struct zdb_entry)) {
+        munmap(zdb, zdb_size);
+        zdb = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Score of an entry aged to the current epoch
+static double zdb_aged(const struct zdb_entry *e) {
+    double score = e->score;
+    unsigned steps = zdb->epoch - e->epoch;
+    if (steps > 200) return 0;
+    while (steps-- > 0) score *= ZDB_AGING;
+    return score;
+}
+
+// Finds path in the table: its slot, or -1 - the free slot it would take
+static int zdb_find(const char *path, unsigned hash) {
+    struct zdb_entry *ent = zdb_entries();
+    unsigned mask = zdb->nslots - 1;
+    for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+        if (ent[i].hash == 0) return -1 - (int)i;
+        if (ent[i].hash == hash && strcmp(ent[i].path, path) == 0) return i;
+    }
+}
+
+// Empties a slot, moving later entries of its probe chain back into it
+static void zdb_remove(unsigned i) {
+    struct zdb_entry *ent = zdb_entries();
+    unsigned mask = zdb->nslots - 1, j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (ent[j].hash == 0) break;
+        unsigned home = ent[j].hash & mask;
+        // ent[j] may fill the hole unless its home lies cyclically in (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            ent[i] = ent[j];
+            i = j;
+        }
+    }
+    ent[i].hash = 0;
+    zdb->used--;
+}
+
+// Doubles the table in place; the caller holds the lock
+static int zdb_grow() {
+    unsigned old_slots = zdb->nslots;
+    size_t bytes = old_slots * sizeof(struct zdb_entry);
+    struct zdb_entry *old = malloc(bytes);
+    memcpy(old, zdb_entries(), bytes);
+    struct zdb_header hdr = *zdb;
+    size_t size = sizeof(hdr) + 2 * bytes;
+    if (ftruncate(zdb_fd, size) < 0) {
+        free(old);
+        return -1;
+    }
+    munmap(zdb, zdb_size);
+    zdb = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, zdb_fd, 0);
+    if (zdb == MAP_FAILED) {
+        zdb = NULL;
+        free(old);
+        return -1;
+    }
+    zdb_size = size;
+    *zdb = hdr;
+    zdb->nslots = 2 * old_slots;
+    memset(zdb_entries(), 0, 2 * bytes);
+    for (unsigned i = 0; i < old_slots; i++) {
+        if (old[i].hash != 0) zdb_entries()[-1 - zdb_find(old[i].path, old[i].hash)] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// Records a visit to a directory. Aging never rewrites the file: when the
+// scores add up to ZDB_MAXAGE the epoch moves on, and a few entries per
+// visit are brought up to date, dropping those that have faded out.
+static void zdb_visit(const char *path) {
+    if (strlen(path) >= ZDB_PATH || zdb_map() < 0) return;
+    flock(zdb_fd, LOCK_EX);
+    if (zdb_map() < 0) { // Another session may have grown it meanwhile
+        flock(zdb_fd, LOCK_UN);
+        return;
+    }
+    if ((zdb->used + 1) * 4 > zdb->nslots * 3 && zdb_grow() < 0) {
+        flock(zdb_fd, LOCK_UN);
+        return;
+    }
+    unsigned hash = hist_hash(path, strlen(path));
+    if (hash == 0) hash = 1;
+    int slot = zdb_find(path, hash);
+    struct zdb_entry *e;
+    if (slot < 0) {
+        e = &zdb_entries()[-1 - slot];
+        memset(e, 0, sizeof(*e));
+        e->hash = hash;
+        strcpy(e->path, path);
+        e->epoch = zdb->epoch;
+        zdb->used++;
+    } else {
+        e = &zdb_entries()[slot];
+    }
+    e->score = zdb_aged(e) + 1;
+    e->epoch = zdb->epoch;
+    e->last = time(NULL);
+    zdb->total += 1;
+    if (zdb->total > ZDB_MAXAGE) {
+        zdb->epoch++;
+        zdb->total *= ZDB_AGING;
+    }
+
+    for (int k = 0; k < ZDB_SWEEP; k++) {
+        unsigned i = zdb->sweep++ & (zdb->nslots - 1);
+        struct zdb_entry *x = &zdb_entries()[i];
+        if (x->hash == 0 || x->epoch == zdb->epoch) continue;
+        double score = zdb_aged(x);
+        if (score < 1) {
+            zdb->total -= score;
+            zdb_remove(i);
+        } else {
+            x->score = score;
+            x->epoch = zdb->epoch;
+        }
+    }
+    flock(zdb_fd, LOCK_UN);
+}
+
+// Like strstr(), but ignores case when the needle has no capitals
+static const char* z_strstr(const char *hay, const char *needle) {
+    for (const char *p = needle; *p; p++) {
+        if (isupper((unsigned char)*p)) return strstr(hay, needle);
+    }
+    return strcasestr(hay, needle);
+}
+
+// Ranks a database entry against the z fragments: 0 if they do not all
+// appear in order, otherwise its frecency (doubled when the last fragment
+// is in the final path component)
+static double z_rank(const struct zdb_entry *e, char **frags, time_t now) {
+    const char *p = e->path, *hit = NULL;
+    for (int i = 0; frags[i] != NULL; i++) {
+        if ((hit = z_strstr(p, frags[i])) == NULL) return 0;
+        p = hit + strlen(frags[i]);
+    }
+    double rank = zdb_aged(e);
+    long long age = now - e->last;
+    if (age < 3600) rank *= 4;
+    else if (age < 86400) rank *= 2;
+    else if (age > 7 * 86400) rank /= 2;
+    if (hit != NULL && hit > strrchr(e->path, '/')) rank *= 2;
+    return rank;
+}
+
+// Changes to path, keeping PWD and OLDPWD and recording the visit
+static int change_dir(const char *path) {
+    char old[PATH_MAX], cwd[PATH_MAX];
+    int have_old = getcwd(old, sizeof(old)) != NULL;
+    if (chdir(path) != 0) {
+        fprintf(stderr, "cd failed: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (have_old) setenv("OLDPWD", old, 1);
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        setenv("PWD", cwd, 1);
+        zdb_visit(cwd);
+    }
+    return 0;
+}
+
+// Changes directory: cd [dir | -], home by default, "-" for the previous one
+static int builtin_cd(char **arglist) {
+    const char *dir = arglist[1] ? arglist[1] : getenv("HOME");
+    if (arglist[1] != NULL && strcmp(arglist[1], "-") == 0) {
+        if ((dir = getenv("OLDPWD")) == NULL) {
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return 1;
+        }
+        char *target = strdup(dir);
+        int rc = change_dir(target);
+        if (rc == 0) printf("%s\n", target);
+        free(target);
+        return rc;
+    }
+    if (dir == NULL) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    }
+    return change_dir(dir);
+}
+
+// Prints the current directory followed by the pushd stack, top first
+static int builtin_dirs(char **arglist) {
+    char cwd[PATH_MAX];
+    int verbose = 0;
+    for (int i = 1; arglist[i] != NULL; i++) {
+        if (strcmp(arglist[i], "-c") == 0) {
+            while (dir_depth > 0) free(dir_stack[--dir_depth]);
+            return 0;
+        } else if (strcmp(arglist[i], "-v") == 0) {
+            verbose = 1;
+        } else {
+            fprintf(stderr, "Usage: dirs [-c] [-v]\n");
+            return 2;
+        }
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) strcpy(cwd, ".");
+    for (int i = 0; i <= dir_depth; i++) {
+        const char *d = i == 0 ? cwd : dir_stack[dir_depth - i];
+        if (verbose) printf("%2d  %s\n", i, d);
+        else printf(i ? " %s" : "%s", d);
+    }
+    if (!verbose) printf("\n");
+    return 0;
+}
+
+// pushd dir: save the current directory and change to dir; without an
+// argument, swap the current directory with the top of the stack
+static int builtin_pushd(char **arglist) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("pushd");
+        return 1;
+    }
+    if (arglist[1] == NULL) {
+        if (dir_depth == 0) {
+            fprintf(stderr, "pushd: no other directory\n");
+            return 1;
+        }
+        char *top = dir_stack[dir_depth - 1];
+        if (change_dir(top) != 0) return 1;
+        dir_stack[dir_depth - 1] = strdup(cwd);
+        free(top);
+    } else {
+        if (change_dir(arglist[1]) != 0) return 1;
+        if (dir_depth == dir_stack_cap) {
+            dir_stack_cap = dir_stack_cap ? dir_stack_cap * 2 : 8;
+            dir_stack = realloc(dir_stack, dir_stack_cap * sizeof(char *));
+        }
+        dir_stack[dir_depth++] = strdup(cwd);
+    }
+    char *dirs[] = { "dirs", NULL };
+    return builtin_dirs(dirs);
+}
+
+// popd: return to the directory on top of the pushd stack
+static int builtin_popd(char **arglist) {
+    (void)arglist;
+    if (dir_depth == 0) {
+        fprintf(stderr, "popd: directory stack empty\n");
+        return 1;
+    }
+    if (change_dir(dir_stack[dir_depth - 1]) != 0) return 1;
+    free(dir_stack[--dir_depth]);
+    char *dirs[] = { "dirs", NULL };
+    return builtin_dirs(dirs);
+}
+
+// Orders ranked z candidates, best first
+static int z_compare(const void *a, const void *b) {
+    double x = ((const double *)a)[0], y = ((const double *)b)[0];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// z fragment...: jumps to the best frecency match; z -l [fragment...]
+// lists the matches with their ranks
+static int builtin_z(char **arglist) {
+    int list = arglist[1] != NULL && strcmp(arglist[1], "-l") == 0;
+    char **frags = arglist + 1 + list, cwd[PATH_MAX];
+    if (!list && frags[0] == NULL) list = 1;
+    if (zdb_map() < 0) {
+        fprintf(stderr, "z: no directory database\n");
+        return 1;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) cwd[0] = '\0';
+    time_t now = time(NULL);
+
+    if (list) {
+        double (*ranked)[2] = malloc((zdb->used + 1) * sizeof(*ranked));
+        int n = 0;
+        for (unsigned i = 0; i < zdb->nslots && n <= (int)zdb->used; i++) {
+            struct zdb_entry *e = &zdb_entries()[i];
+            double rank = e->hash ? z_rank(e, frags, now) : 0;
+            if (rank > 0) {
+                ranked[n][0] = rank;
+                ranked[n++][1] = i;
+            }
+        }
+        qsort(ranked, n, sizeof(*ranked), z_compare);
+        for (int k = n - 1; k >= 0; k--) { // Best last, next to the prompt
+            printf("%10.1f  %s\n", ranked[k][0], zdb_entries()[(int)ranked[k][1]].path);
+        }
+        free(ranked);
+        return n > 0 ? 0 : 1;
+    }
+
+    for (;;) {
+        int best = -1;
+        double best_rank = 0;
+        for (unsigned i = 0; i < zdb->nslots; i++) {
+            struct zdb_entry *e = &zdb_entries()[i];
+            if (e->hash == 0 || strcmp(e->path, cwd) == 0) continue;
+            double rank = z_rank(e, frags, now);
+            if (rank > best_rank) {
+                best = i;
+                best_rank = rank;
+            }
+        }
+        if (best < 0) {
+            fprintf(stderr, "z: no match\n");
+            return 1;
+        }
+        char target[ZDB_PATH];
+        struct stat st;
+        strcpy(target, zdb_entries()[best].path);
+        if (stat(target, &st) == 0 && S_ISDIR(st.st_mode)) return change_dir(target);
+        // Gone since it was recorded: forget it and try the next best
+        flock(zdb_fd, LOCK_EX);
+        if (zdb_map() == 0) {
+            int slot = zdb_find(target, zdb_entries()[best].hash);
+            if (slot >= 0) zdb_remove(slot);
+        }
+        flock(zdb_fd, LOCK_UN);
+        if (zdb == NULL) return 1;
+    }
+}
+
+// Signal names accepted by kill, with or without the SIG prefix
+static const struct {
+    const char *name;
+    int sig;
+} signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+    { "TERM", SIGTERM }, { "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+    { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN }, { "TTOU", SIGTTOU }, { "WINCH", SIGWINCH },
+    { NULL, 0 },
+};
+
+// Converts "TERM", "SIGTERM" or "15" to a signal number, or -1
+static int signal_number(const char *name) {
+    if (isdigit((unsigned char)name[0])) {
+        int sig = atoi(name);
+        return sig > 0 && sig < NSIG ? sig : -1;
+    }
+    if (strncasecmp(name, "SIG", 3) == 0) name += 3;
+    for (int i = 0; signal_names[i].name; i++) {
+        if (strcasecmp(signal_names[i].name, name) == 0) return signal_names[i].sig;
+    }
+    return -1;
+}
+
+// Resolves "%N" or "N" (default: the newest job) to a job index, or -1
+static int job_spec(const char *spec, const char *who) {
+    int index = job_count - 1;
+    if (spec != NULL) index = atoi(spec[0] == '%' ? spec + 1 : spec) - 1;
+    if (index < 0 || index >= job_count) {
+        fprintf(stderr, "%s: %s: no such job\n", who, spec ? spec : "current");
+        return -1;
+    }
+    return index;
+}
+
+// Sends a signal to every process of a job, with one killpg() when it has
+// its own process group
+static int job_signal(struct job *job, int sig) {
+    int rc = 0;
+    if (job->pgid > 0) {
+        rc = killpg(job->pgid, sig);
+    } else {
+        for (int i = 0; i < job->nprocs; i++) {
+            if (job->pids[i] != 0 && kill(job->pids[i], sig) < 0) rc = -1;
+        }
+    }
+    // A stopped job cannot act on a terminating signal until continued
+    if (rc == 0 && job->stopped && sig != SIGKILL && sig != SIGSTOP && sig != SIGCONT) {
+        job_signal(job, SIGCONT);
+    }
+    return rc;
+}
+
+// Current CLOCK_MONOTONIC time in nanoseconds
+static long long timer_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Parses a duration such as 500ms, 5s, 1.5m, 2h or 10 (seconds) into ns
+static int parse_duration(const char *s, long long *ns) {
+    char *end;
+    double v = strtod(s, &end);
+    double unit = strcmp(end, "ms") == 0 ? 1e6 : strcmp(end, "m") == 0 ? 60e9 :
+                  strcmp(end, "h") == 0 ? 3600e9 : (*end == '\0' || strcmp(end, "s") == 0) ? 1e9 : 0;
+    if (end == s || unit == 0 || !(v >= 0) || v * unit > 1e18) return -1;
+    *ns = (long long)(v * unit);
+    return 0;
+}
+
+// Formats ns as a short duration: 250ms, 5s, 1.5m, 2h
+static void format_duration(char *buf, size_t size, long long ns) {
+    if (ns < 1000000000LL) snprintf(buf, size, "%lldms", ns / 1000000);
+    else if (ns < 60000000000LL) snprintf(buf, size, "%.3gs", ns / 1e9);
+    else if (ns < 3600000000000LL) snprintf(buf, size, "%.3gm", ns / 60e9);
+    else snprintf(buf, size, "%.3gh", ns / 3600e9);
+}
+
+// Random delay in [0, jitter) for the next run of a timer
+static long long timer_jitter(struct timer *t) {
+    return t->jitter > 0 ? (long long)(drand48() * t->jitter) : 0;
+}
+
+static void timer_swap(int a, int b) {
+    struct timer *t = timers[a];
+    timers[a] = timers[b];
+    timers[b] = t;
+}
+
+// Restores the heap order around entry i after its due time changed
+static void timer_sift(int i) {
+    while (i > 0 && timers[i]->due < timers[(i - 1) / 2]->due) {
+        timer_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        int least = i, l = 2 * i + 1, r = l + 1;
+        if (l < timer_count && timers[l]->due < timers[least]->due) least = l;
+        if (r < timer_count && timers[r]->due < timers[least]->due) least = r;
+        if (least == i) break;
+        timer_swap(i, least);
+        i = least;
+    }
+}
+
+// Takes entry i out of the heap without freeing it
+static struct timer* timer_remove(int i) {
+    struct timer *t = timers[i];
+    timers[i] = timers[--timer_count];
+    if (i < timer_count) timer_sift(i);
+    return t;
+}
+
+static void timer_free(struct timer *t) {
+    free(t->cmd);
+    free(t);
+}
+
+// Arms the timerfd for the earliest timer, or disarms it when none is left
+static void timer_arm() {
+    struct itimerspec its = {0};
+    if (timer_count > 0) {
+        its.it_value.tv_sec = timers[0]->due / 1000000000LL;
+        its.it_value.tv_nsec = timers[0]->due % 1000000000LL;
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) perror("timerfd_settime");
+}
+
+// Returns the index of timer @id in the heap, or -1
+static int timer_find(int id) {
+    for (int i = 0; i < timer_count; i++) {
+        if (timers[i]->id == id) return i;
+    }
+    return -1;
+}
+
+// Whether a run started by the timer is still in the job table and alive
+static int timer_running(struct timer *t) {
+    for (int i = 0; i < job_count; i++) {
+        if (background_jobs[i].timer == t->id && background_jobs[i].live > 0) return 1;
+    }
+    return 0;
+}
+
+// Starts one run of a timer's command as a background job, in a forked
+// copy of the shell like fork_node(), without announcing it
+static void timer_launch(struct timer *t) {
+    char *line = strdup(t->cmd);
+    struct node *tree = parse_line(line, NULL);
+    if (tree == NULL) {
+        free(line);
+        t->last_status = 2;
+        return;
+    }
+    sigset_t old;
+    fflush(stdout);
+    sigchld_block(&old);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        job_child_setup(0, PG_BACKGROUND);
+        exec_node(tree, 1);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (pid < 0) {
+        perror("fork failed");
+    } else {
+        setpgid(pid, pid);
+        struct job job = {0};
+        job.pid = job.pgid = pid;
+        job.pids = malloc(sizeof(pid_t));
+        job.pids[0] = pid;
+        job.statuses = calloc(1, sizeof(int));
+        job.cgroups = calloc(1, sizeof(char *));
+        job.nprocs = job.live = 1;
+        job.cmd = strdup(t->cmd);
+        job.timer = t->id;
+        job_add(&job);
+        t->runs++;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    node_free(tree);
+    free(line);
+}
+
+// Called by drain_child_events() when a run of timer @id has ended
+void timer_finished(int id, int status) {
+    int i = timer_find(id);
+    if (i >= 0) timers[i]->last_status = status;
+}
+
+// Runs from the main poll loop when the timerfd fires or a job ends:
+// starts queued runs whose previous run is over, then every timer that
+// is due, and re-arms the timerfd for the next one. Ticks an every timer
+// missed entirely (the shell was busy with a foreground job) count as
+// skipped; a tick that finds the previous run still going is skipped, or
+// with -q queued.
+void timers_run() {
+    if (timer_fd < 0) return;
+    unsigned long long expirations;
+    ssize_t n = read(timer_fd, &expirations, sizeof(expirations)); // Clears the wakeup
+    (void)n;
+
+    for (int i = 0; i < timer_count; i++) {
+        struct timer *t = timers[i];
+        if (t->pending > 0 && !timer_running(t)) {
+            t->pending--;
+            timer_launch(t);
+        }
+    }
+    long long now = timer_now();
+    while (timer_count > 0 && timers[0]->due <= now) {
+        struct timer *t = timers[0];
+        if (t->interval == 0) { // after: runs once
+            timer_launch(timer_remove(0));
+            timer_free(t);
+            continue;
+        }
+        long long missed = (now - t->nominal) / t->interval;
+        t->skipped += missed;
+        t->nominal += (missed + 1) * t->interval;
+        t->due = t->nominal + timer_jitter(t);
+        if (!timer_running(t)) {
+            timer_launch(t);
+        } else if (t->queue && t->pending < TIMER_QUEUE_MAX) {
+            t->pending++;
+        } else {
+            t->skipped++;
+        }
+        timer_sift(0);
+    }
+    timer_arm();
+}
+
+// Describes when a timer runs: "every 5s ±1s, next in 2.5s" or "once in 2.5s"
+static void timer_schedule_text(struct timer *t, char *buf, size_t size) {
+    char period[32], jitter[32] = "", next[32];
+    format_duration(period, sizeof(period), t->interval);
+    if (t->jitter > 0) {
+        strcpy(jitter, " ±");
+        format_duration(jitter + strlen(jitter), sizeof(jitter) - strlen(jitter), t->jitter);
+    }
+    long long left = t->due - timer_now();
+    format_duration(next, sizeof(next), left > 0 ? left : 0);
+    if (t->interval > 0) snprintf(buf, size, "every %s%s, next in %s", period, jitter, next);
+    else snprintf(buf, size, "once%s in %s", jitter, next);
+}
+
+// after [-j jitter] delay command... / every [-j jitter] [-q] interval
+// command...: schedules the command, given as words that are joined and
+// parsed again at each run, like eval (quote it to keep |, ; or $VAR for
+// run time). Each run is a background job; -j delays each run by a random
+// amount up to jitter, and -q queues a tick that finds the previous run
+// still going instead of skipping it.
+static int timer_schedule(char **arglist, int every) {
+    long long jitter = 0, delay;
+    int queue = 0, i = 1;
+    for (; arglist[i] != NULL && arglist[i][0] == '-' && arglist[i][1] != '\0'; i++) {
+        if (strcmp(arglist[i], "-j") == 0 && arglist[i + 1] != NULL &&
+            parse_duration(arglist[i + 1], &jitter) == 0) {
+            i++;
+        } else if (every && strcmp(arglist[i], "-q") == 0) {
+            queue = 1;
+        } else {
+            break;
+        }
+    }
+    if (arglist[i] == NULL || arglist[i][0] == '-' || parse_duration(arglist[i], &delay) < 0 ||
+        (every && delay == 0) || arglist[i + 1] == NULL) {
+        if (every) printf("Usage: every [-j jitter] [-q] interval command...\n");
+        else printf("Usage: after [-j jitter] delay command...\n");
+        return 2;
+    }
+    if (timer_fd < 0) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd < 0) {
+            perror("timerfd_create");
+            return 1;
+        }
+        srand48(getpid() ^ time(NULL));
+    }
+    struct strbuf cmd = {0};
+    for (int k = i + 1; arglist[k] != NULL; k++) {
+        if (k > i + 1) sb_append(&cmd, " ", 1);
+        sb_append(&cmd, arglist[k], strlen(arglist[k]));
+    }
+    if (timer_count == timer_cap) {
+        timer_cap = timer_cap ? 2 * timer_cap : 8;
+        timers = realloc(timers, timer_cap * sizeof(*timers));
+    }
+    struct timer *t = calloc(1, sizeof(*t));
+    t->id = timer_next_id++;
+    t->cmd = cmd.s;
+    t->interval = every ? delay : 0;
+    t->jitter = jitter;
+    t->queue = queue;
+    t->last_status = -1;
+    t->nominal = timer_now() + delay;
+    t->due = t->nominal + timer_jitter(t);
+    timers[timer_count++] = t;
+    timer_sift(timer_count - 1);
+    timer_arm();
+    printf("[@%d]\n", t->id);
+    return 0;
+}
+
+static int builtin_after(char **arglist) {
+    return timer_schedule(arglist, 0);
+}
+
+static int builtin_every(char **arglist) {
+    return timer_schedule(arglist, 1);
+}
+
+// Prints the scheduled timers, soonest first, in the jobs format
+static void timers_print(int verbose) {
+    struct timer *sorted[timer_count > 0 ? timer_count : 1];
+    memcpy(sorted, timers, timer_count * sizeof(*timers));
+    for (int i = 1; i < timer_count; i++) { // The heap is only partly ordered
+        for (int j = i; j > 0 && sorted[j]->due < sorted[j - 1]->due; j--) {
+            struct timer *t = sorted[j];
+            sorted[j] = sorted[j - 1];
+            sorted[j - 1] = t;
+        }
+    }
+    for (int i = 0; i < timer_count; i++) {
+        struct timer *t = sorted[i];
+        char when[128];
+        timer_schedule_text(t, when, sizeof(when));
+        printf("[@%d] Scheduled  %s  %s", t->id, when, t->cmd);
+        if (verbose) {
+            printf("\n      %s, %u runs, %u skipped", t->interval == 0 ? "one-shot" : t->queue ? "queue" : "skip",
+                   t->runs, t->skipped);
+            if (t->pending > 0) printf(", %d queued", t->pending);
+            if (timer_running(t)) printf(", running");
+            else if (t->last_status >= 0) printf(", last exit %d", t->last_status);
+        }
+        printf("\n");
+    }
+}
+
+// timers [-c @N...|all]: lists scheduled after and every commands with
+// their policy and run counts, or cancels them (runs already started
+// keep going as ordinary jobs)
+static int builtin_timers(char **arglist) {
+    if (arglist[1] == NULL) {
+        drain_child_events(0);
+        timers_print(1);
+        return 0;
+    }
+    if (strcmp(arglist[1], "-c") != 0 || arglist[2] == NULL) {
+        printf("Usage: timers [-c @N...|all]\n");
+        return 2;
+    }
+    int rc = 0;
+    for (int i = 2; arglist[i] != NULL; i++) {
+        if (strcmp(arglist[i], "all") == 0) {
+            while (timer_count > 0) timer_free(timer_remove(timer_count - 1));
+            continue;
+        }
+        const char *id = arglist[i] + (arglist[i][0] == '@');
+        int k = isdigit((unsigned char)id[0]) ? timer_find(atoi(id)) : -1;
+        if (k < 0) {
+            fprintf(stderr, "timers: %s: no such timer\n", arglist[i]);
+            rc = 1;
+            continue;
+        }
+        timer_free(timer_remove(k));
+    }
+    if (timer_fd >= 0) timer_arm();
+    return rc;
+}
+
+// jobs [-l]: lists background jobs; -l adds a table of CPU, memory, I/O,
+// state and runtime per job and per pipeline stage
+static int builtin_jobs(char **arglist) {
+    int table = arglist[1] != NULL && strcmp(arglist[1], "-l") == 0;
+    if (arglist[1] != NULL && !table) {
+        printf("Usage: jobs [-l]\n");
+        return 2;
+    }
+    drain_child_events(0); // Pick up jobs that finished since the prompt
+    for (int i = 0; i < job_count; i++) {
+        struct job *job = &background_jobs[i];
+        if (table && (job->done || job->live > 0)) continue; // Shown below
+        if (job->done) { // Finished, output not yet read
+            printf("[%d] %d  Done (exit %d)  %s  %llu bytes captured\n", i + 1,
+                   job->pgid > 0 ? job->pgid : job->pid,
+                   job->status, job->cmd, job->out->total);
+        } else if (job->pgid > 0 ? killpg(job->pgid, 0) == 0 : kill(job->pid, 0) == 0) {
+            long long mem, cpu_usec;
+            printf("[%d] %d  %s  %s", i + 1, job->pgid > 0 ? job->pgid : job->pid,
+                   job->stopped ? "Stopped" : "Running", job->cmd);
+            if (job_usage(job, &mem, &cpu_usec) == 0) {
+                printf("  mem %.1fM  cpu %.2fs", mem / 1048576.0, cpu_usec / 1e6);
+            }
+            if (job->out != NULL) {
+                printf("  %llu bytes captured", job->out->total);
+            }
+            printf("\n");
+        } else { // Remove terminated job from list
+            remove_job(i);
+            i--;
+        }
+    }
+    if (table) {
+        struct strbuf sb = {0};
+        jobs_table(&sb, 0);
+        fwrite(sb.s, 1, sb.len, stdout);
+        free(sb.s);
+    }
+    timers_print(0);
+    return 0;
+}
+
+// kill [-SIG | -s SIG | -l] [%]job...: signal whole jobs (SIGKILL by default)
+static int builtin_kill(char **arglist) {
+    int sig = SIGKILL, i = 1, rc = 0;
+    if (arglist[1] && strcmp(arglist[1], "-l") == 0) {
+        for (int k = 0; signal_names[k].name; k++) {
+            printf("%2d) SIG%s\n", signal_names[k].sig, signal_names[k].name);
+        }
+        return 0;
+    }
+    if (arglist[1] && strcmp(arglist[1], "-s") == 0 && arglist[2]) {
+        sig = signal_number(arglist[2]);
+        i = 3;
+    } else if (arglist[1] && arglist[1][0] == '-') {
+        sig = signal_number(arglist[1] + 1);
+        i = 2;
+    }
+    if (sig < 0) {
+        fprintf(stderr, "kill: %s: invalid signal\n", arglist[i - 1]);
+        return 2;
+    }
+    if (arglist[i] == NULL) {
+        printf("Usage: kill [-SIG | -s SIG | -l] [%%]job#...\n");
+        return 2;
+    }
+    for (; arglist[i] != NULL; i++) {
+        int index = job_spec(arglist[i], "kill");
+        if (index < 0) {
+            rc = 1;
+            continue;
+        }
+        struct job *job = &background_jobs[index];
+        if (job_signal(job, sig) < 0) {
+            perror("kill");
+            rc = 1;
+        } else if (sig == SIGKILL) {
+            printf("Killed job [%d] %d\n", index + 1, job->pgid > 0 ? job->pgid : job->pid);
+        }
+    }
+    return rc;
+}
+
+// fg [%N]: continue a job in the foreground and wait for it
+static int builtin_fg(char **arglist) {
+    sigset_t old;
+    sigchld_block(&old);
+    drain_child_events(0); // Bring the job table up to date first
+    int index = job_spec(arglist[1], "fg");
+    if (index < 0 || background_jobs[index].done) {
+        if (index >= 0) fprintf(stderr, "fg: job %d has finished\n", index + 1);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return 1;
+    }
+    struct job *job = &background_jobs[index];
+    printf("%s\n", job->cmd);
+    fflush(stdout);
+    if (job_control && job->pgid > 0) tcsetpgrp(STDIN_FILENO, job->pgid); // Before it runs on
+    if (job->stopped) job_signal(job, SIGCONT);
+    foreground_job(job, 1);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return last_status;
+}
+
+// bg [%N]: continue a stopped job in the background
+static int builtin_bg(char **arglist) {
+    int index = job_spec(arglist[1], "bg");
+    if (index < 0) return 1;
+    struct job *job = &background_jobs[index];
+    if (job->stopped) {
+        job_signal(job, SIGCONT);
+        job->stopped = 0;
+    }
+    printf("[%d] %s &\n", index + 1, job->cmd);
+    return 0;
+}
+
+// Lists or measures history
+static int builtin_history(char **arglist) {
+    if (arglist[1] && strcmp(arglist[1], "-m") == 0) {
+        history_stats();
+    } else {
+        for (int n = 1; n <= history_count; n++) {
+            int index = (current - history_count + n - 1 + HIST_SIZE) % HIST_SIZE;
+            printf("%5d  %s\n", n, history_text(index));
+        }
+    }
+    return 0;
+}
+
+// Sets default placement and limits for every later command
+static int builtin_sched(char **arglist) {
+    struct exec_attrs attrs;
+    if (sched_options(arglist, &attrs) < 0) return 2;
+    for (int i = 1; arglist[i] != NULL && arglist[i + 1] != NULL; i++) {
+        if (strcmp(arglist[i], "-b") == 0) background_nice = atoi(arglist[i + 1]);
+        if (strcmp(arglist[i], "-s") == 0) sched_spread = strcmp(arglist[i + 1], "on") == 0;
+    }
+    default_attrs = attrs;
+    printf("cpus: ");
+    if (default_attrs.set_cpus) print_cpu_list(&default_attrs.cpus);
+    else printf("inherit");
+    printf("\nnice: ");
+    if (default_attrs.set_nice) printf("%d", default_attrs.nice);
+    else printf("inherit");
+    printf("\nnuma: ");
+    if (default_attrs.numa_mode < 0) printf("inherit");
+    else printf("mode %d nodes 0x%lx", default_attrs.numa_mode, default_attrs.numa_nodes);
+    printf("\nbackground nice: %d\nspread: %s\n", background_nice,
+           sched_spread ? "on" : "off");
+    printf("memory.max: ");
+    if (default_attrs.mem_max < 0) printf("none");
+    else printf("%lld", default_attrs.mem_max);
+    printf("\ncpu.max: ");
+    if (default_attrs.cpu_pct == 0) printf("none\n");
+    else printf("%d%%\n", default_attrs.cpu_pct);
+    printf("job rlimits: %d\n", default_attrs.nrlimits);
+    return 0;
+}
+
+// profile on its own: a prefix, so it needs a command to run
+static int builtin_profile(char **arglist) {
+    (void)arglist;
+    fprintf(stderr, "Usage: profile command [| command ...]\n");
+    return 2;
+}
+
+// Leaves the shell once the current command line is done
+static int builtin_exit(char **arglist) {
+    exit_requested = 1;
+    return arglist[1] ? atoi(arglist[1]) : last_status;
+}
+
+// break [n] / continue [n]: leave or restart the n innermost loops
+static int builtin_break(char **arglist) {
+    int n = arglist[1] ? atoi(arglist[1]) : 1;
+    if (loop_depth == 0) {
+        fprintf(stderr, "%s: only meaningful in a loop\n", arglist[0]);
+        return 1;
+    }
+    if (n < 1) {
+        fprintf(stderr, "%s: %s: loop count out of range\n", arglist[0], arglist[1]);
+        return 1;
+    }
+    flow = arglist[0][0] == 'b' ? FLOW_BREAK : FLOW_CONTINUE;
+    flow_levels = n < loop_depth ? n : loop_depth;
+    return 0;
+}
+
+// return [status]: leave the running function
+static int builtin_return(char **arglist) {
+    if (func_depth == 0) {
+        fprintf(stderr, "return: can only be used in a function\n");
+        return 1;
+    }
+    flow = FLOW_RETURN;
+    return arglist[1] ? atoi(arglist[1]) & 255 : last_status;
+}
+
+// shift [n]: drop the first n function arguments
+static int builtin_shift(char **arglist) {
+    int n = arglist[1] ? atoi(arglist[1]) : 1;
+    if (n < 0 || n > pos_count) {
+        fprintf(stderr, "shift: %s: shift count out of range\n", arglist[1] ? arglist[1] : "1");
+        return 1;
+    }
+    pos_args += n;
+    pos_count -= n;
+    return 0;
+}
+
+static int builtin_true(char **arglist) { (void)arglist; return 0; }
+static int builtin_false(char **arglist) { (void)arglist; return 1; }
+
+// Prints the current directory
+static int builtin_pwd(char **arglist) {
+    char cwd[PATH_MAX];
+    (void)arglist;
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("pwd failed");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    return 0;
+}
+
+// Appends the character for a backslash escape at p; returns the number of
+// input characters used, or 0 for \c (stop output)
+static int put_escape(struct strbuf *out, const char *p) {
+    char c;
+    switch (p[1]) {
+    case 'n': c = '\n'; break;
+    case 't': c = '\t'; break;
+    case 'r': c = '\r'; break;
+    case 'a': c = '\a'; break;
+    case 'b': c = '\b'; break;
+    case 'f': c = '\f'; break;
+    case 'v': c = '\v'; break;
+    case 'e': c = '\033'; break;
+    case '\\': c = '\\'; break;
+    case 'c': return 0;
+    case '0': {
+        int v = 0, n = 2;
+        while (n < 5 && p[n] >= '0' && p[n] <= '7') v = v * 8 + (p[n++] - '0');
+        c = (char)v;
+        sb_append(out, &c, 1);
+        return n;
+    }
+    default:
+        sb_append(out, p, p[1] ? 2 : 1);
+        return p[1] ? 2 : 1;
+    }
+    sb_append(out, &c, 1);
+    return 2;
+}
+
+// echo [-neE] args: prints its arguments separated by spaces
+static int builtin_echo(char **arglist) {
+    int newline = 1, escapes = 0, i = 1;
+    for (; arglist[i] != NULL && arglist[i][0] == '-' && arglist[i][1] != '\0'; i++) {
+        if (strspn(arglist[i] + 1, "neE") != strlen(arglist[i] + 1)) break;
+        for (char *c = arglist[i] + 1; *c; c++) {
+            if (*c == 'n') newline = 0;
+            else if (*c == 'e') escapes = 1;
+            else escapes = 0;
+        }
+    }
+    struct strbuf out = {0};
+    sb_append(&out, "", 0);
+    for (int first = i; arglist[i] != NULL; i++) {
+        if (i > first) sb_append(&out, " ", 1);
+        if (!escapes) {
+            sb_append(&out, arglist[i], strlen(arglist[i]));
+            continue;
+        }
+        for (const char *p = arglist[i]; *p; ) {
+            if (*p != '\\') {
+                sb_append(&out, p++, 1);
+            } else {
+                int n = put_escape(&out, p);
+                if (n == 0) { // \c suppresses everything that follows
+                    newline = 0;
+                    goto done;
+                }
+                p += n;
+            }
+        }
+    }
+done:
+    if (newline) sb_append(&out, "\n", 1);
+    fwrite(out.s, 1, out.len, stdout);
+    free(out.s);
+    return 0;
+}
+
+// printf format [args]: formats like printf(1), reusing the format while
+// arguments remain
+static int builtin_printf(char **arglist) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "Usage: printf format [arguments]\n");
+        return 2;
+    }
+    const char *fmt = arglist[1];
+    char **arg = arglist + 2;
+    struct strbuf out = {0};
+    sb_append(&out, "", 0);
+    do {
+        char **start = arg;
+        for (const char *p = fmt; *p; ) {
+            if (*p == '\\') {
+                int n = put_escape(&out, p);
+                if (n == 0) goto done;
+                p += n;
+                continue;
+            }
+            if (*p != '%') {
+                sb_append(&out, p++, 1);
+                continue;
+            }
+            if (p[1] == '%') {
+                sb_append(&out, "%", 1);
+                p += 2;
+                continue;
+            }
+            // Copy the conversion spec (flags, width, precision) as is
+            char spec[32];
+            size_t n = 0;
+            spec[n++] = *p++;
+            while (*p && strchr("-+ #0123456789.", *p) && n < sizeof(spec) - 3) spec[n++] = *p++;
+            char conv = *p ? *p++ : 's';
+            const char *val = *arg ? *arg++ : "";
+            char tmp[512];
+            if (strchr("diouxXc", conv)) {
+                if (conv == 'c') {
+                    spec[n++] = 'c';
+                    spec[n] = '\0';
+                    snprintf(tmp, sizeof(tmp), spec, val[0]);
                 } else {
-                    free(cmdline);
-                    continue;
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = conv;
+                    spec[n] = '\0';
+                    snprintf(tmp, sizeof(tmp), spec, strtoll(val, NULL, 0));
+                }
+                sb_append(&out, tmp, strlen(tmp));
+            } else if (conv == 'b') {
+                for (const char *q = val; *q; ) {
+                    if (*q != '\\') sb_append(&out, q++, 1);
+                    else if ((n = put_escape(&out, q)) == 0) goto done;
+                    else q += n;
+                }
+            } else {
+                spec[n++] = 's';
+                spec[n] = '\0';
+                int len = snprintf(NULL, 0, spec, val);
+                char *big = malloc(len + 1);
+                snprintf(big, len + 1, spec, val);
+                sb_append(&out, big, len);
+                free(big);
+            }
+        }
+        if (arg == start) break; // The format used no arguments
+    } while (*arg != NULL);
+done:
+    fwrite(out.s, 1, out.len, stdout);
+    free(out.s);
+    return 0;
+}
+
+// Evaluates a test(1) primary or comparison of 1 to 3 words
+static int test_expr(char **w, int n) {
+    struct stat st;
+    if (n == 0) return 1;
+    if (n >= 1 && strcmp(w[0], "!") == 0) return !test_expr(w + 1, n - 1);
+    if (n == 1) return w[0][0] != '\0' ? 0 : 1;
+    if (n == 2) {
+        const char *op = w[0], *a = w[1];
+        if (strcmp(op, "-n") == 0) return a[0] == '\0';
+        if (strcmp(op, "-z") == 0) return a[0] != '\0';
+        if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') return 2;
+        if (op[1] == 'L' || op[1] == 'h') return lstat(a, &st) == 0 && S_ISLNK(st.st_mode) ? 0 : 1;
+        if (op[1] == 'r') return access(a, R_OK) != 0;
+        if (op[1] == 'w') return access(a, W_OK) != 0;
+        if (op[1] == 'x') return access(a, X_OK) != 0;
+        if (stat(a, &st) != 0) return strchr("efdsp", op[1]) ? 1 : 2;
+        switch (op[1]) {
+        case 'e': return 0;
+        case 'f': return !S_ISREG(st.st_mode);
+        case 'd': return !S_ISDIR(st.st_mode);
+        case 's': return st.st_size == 0;
+        case 'p': return !S_ISFIFO(st.st_mode);
+        }
+        return 2;
+    }
+    if (n == 3) {
+        const char *a = w[0], *op = w[1], *b = w[2];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) != 0;
+        if (strcmp(op, "!=") == 0) return strcmp(a, b) == 0;
+        long long x = atoll(a), y = atoll(b);
+        if (strcmp(op, "-eq") == 0) return !(x == y);
+        if (strcmp(op, "-ne") == 0) return !(x != y);
+        if (strcmp(op, "-lt") == 0) return !(x < y);
+        if (strcmp(op, "-le") == 0) return !(x <= y);
+        if (strcmp(op, "-gt") == 0) return !(x > y);
+        if (strcmp(op, "-ge") == 0) return !(x >= y);
+        if (strcmp(op, "-a") == 0) return !(a[0] && b[0]);
+        if (strcmp(op, "-o") == 0) return !(a[0] || b[0]);
+    }
+    // Longer expressions: split on -o, then -a
+    for (int i = 1; i < n - 1; i++) {
+        if (strcmp(w[i], "-o") == 0) return test_expr(w, i) == 0 || test_expr(w + i + 1, n - i - 1) == 0 ? 0 : 1;
+    }
+    for (int i = 1; i < n - 1; i++) {
+        if (strcmp(w[i], "-a") == 0) return test_expr(w, i) == 0 && test_expr(w + i + 1, n - i - 1) == 0 ? 0 : 1;
+    }
+    return 2;
+}
+
+// test expr / [ expr ]: exits 0 when the expression is true
+static int builtin_test(char **arglist) {
+    int n = 0;
+    while (arglist[n + 1] != NULL) n++;
+    if (strcmp(arglist[0], "[") == 0) {
+        if (n == 0 || strcmp(arglist[n], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        n--;
+    }
+    int r = test_expr(arglist + 1, n);
+    if (r == 2) fprintf(stderr, "%s: invalid expression\n", arglist[0]);
+    return r;
+}
+
+// read [-r] [-p prompt] name...: reads one line from stdin into variables,
+// the last one getting the rest of the line
+static int builtin_read(char **arglist) {
+    int raw = 0, i = 1;
+    for (; arglist[i] != NULL && arglist[i][0] == '-'; i++) {
+        if (strcmp(arglist[i], "-r") == 0) raw = 1;
+        else if (strcmp(arglist[i], "-p") == 0 && arglist[i + 1] != NULL) {
+            fputs(arglist[++i], stderr);
+        } else break;
+    }
+
+    // Read byte by byte so nothing past the newline is consumed
+    struct strbuf line = {0};
+    sb_append(&line, "", 0);
+    char c;
+    ssize_t n;
+    int got = 0;
+    while ((n = read(STDIN_FILENO, &c, 1)) == 1) {
+        got = 1;
+        if (c == '\n') break;
+        if (c == '\\' && !raw) {
+            if (read(STDIN_FILENO, &c, 1) != 1) break;
+            if (c == '\n') continue; // Line continuation
+        }
+        sb_append(&line, &c, 1);
+    }
+
+    char *p = line.s;
+    if (arglist[i] == NULL) {
+        var_set("REPLY", p);
+    }
+    for (; arglist[i] != NULL; i++) {
+        while (*p == ' ' || *p == '\t') p++;
+        char *end = p;
+        if (arglist[i + 1] == NULL) {
+            end = p + strlen(p);
+            while (end > p && (end[-1] == ' ' || end[-1] == '\t')) end--;
+        } else {
+            while (*end && *end != ' ' && *end != '\t') end++;
+        }
+        char saved = *end;
+        *end = '\0';
+        var_set(arglist[i], p);
+        *end = saved;
+        p = end;
+    }
+    free(line.s);
+    return got ? 0 : 1;
+}
+
+// Set by Ctrl-C while a builtin blocks (output --follow, wait), which the
+// interactive shell would otherwise ignore
+static volatile sig_atomic_t wait_interrupted = 0;
+static void wait_sigint(int sig) {
+    (void)sig;
+    wait_interrupted = 1;
+}
+
+// capture [on|off] [-m size] [-s dir|off]: configure output capture of & jobs
+static int builtin_capture(char **arglist) {
+    for (int i = 1; arglist[i] != NULL; i++) {
+        if (strcmp(arglist[i], "on") == 0 || strcmp(arglist[i], "off") == 0) {
+            capture_jobs = arglist[i][1] == 'n';
+        } else if (strcmp(arglist[i], "-m") == 0 && arglist[i + 1]) {
+            long long size = parse_size(arglist[++i]);
+            if (size <= 0) {
+                fprintf(stderr, "capture: invalid size: %s\n", arglist[i]);
+                return 2;
+            }
+            capture_max = size;
+        } else if (strcmp(arglist[i], "-s") == 0 && arglist[i + 1]) {
+            free(capture_spill);
+            i++;
+            capture_spill = strcmp(arglist[i], "off") == 0 ? NULL : strdup(arglist[i]);
+        } else {
+            printf("Usage: capture [on|off] [-m size] [-s spill-dir|off]\n");
+            return 2;
+        }
+    }
+    if (arglist[1] == NULL) {
+        printf("capture %s, %zu bytes per job, spill %s\n", capture_jobs ? "on" : "off",
+               capture_max, capture_spill ? capture_spill : "off");
+    }
+    return 0;
+}
+
+// output %N [--tail K] [--follow]: show what a captured job has written
+static int builtin_output(char **arglist) {
+    const char *spec = NULL;
+    long tail = -1;
+    int follow = 0;
+    for (int i = 1; arglist[i] != NULL; i++) {
+        if (strcmp(arglist[i], "--tail") == 0 && arglist[i + 1]) tail = atol(arglist[++i]);
+        else if (strcmp(arglist[i], "--follow") == 0 || strcmp(arglist[i], "-f") == 0) follow = 1;
+        else if (spec == NULL) spec = arglist[i];
+        else spec = "";
+    }
+    if (spec == NULL || *spec == '\0') {
+        printf("Usage: output %%N [--tail K] [--follow]\n");
+        return 2;
+    }
+    int index = job_spec(spec, "output");
+    if (index < 0) return 1;
+    struct job_output *out = background_jobs[index].out;
+    if (out == NULL) {
+        fprintf(stderr, "output: %s: output was not captured\n", spec);
+        return 1;
+    }
+
+    job_output_read(out, -1);
+    if (tail < 0 && out->spill_fd >= 0) {
+        // Older output went to the spill file; replay it first
+        int fd = open(out->spill_path, O_RDONLY | O_CLOEXEC);
+        char buf[4096];
+        ssize_t n;
+        fflush(stdout);
+        while (fd >= 0 && (n = read(fd, buf, sizeof(buf))) > 0) {
+            ssize_t w = write(STDOUT_FILENO, buf, n);
+            (void)w;
+        }
+        if (fd >= 0) close(fd);
+    } else if (tail < 0 && out->total > out->cap) {
+        printf("[%llu earlier bytes dropped]\n", out->total - out->cap);
+    }
+    job_output_write(out, tail < 0 ? 0 : job_output_tail(out, tail));
+
+    if (follow) {
+        struct sigaction sa, old_sa;
+        sa.sa_handler = wait_sigint;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0; // Let poll() return on Ctrl-C
+        sigaction(SIGINT, &sa, &old_sa);
+        wait_interrupted = 0;
+        while (out->fd >= 0 && !wait_interrupted) {
+            struct pollfd fds[MAXJOBS];
+            int n = job_output_fds(fds, MAXJOBS);
+            if (poll(fds, n, -1) < 0 && errno != EINTR) break;
+            for (int i = 0; i < job_count; i++) {
+                if (background_jobs[i].out != NULL) {
+                    job_output_read(background_jobs[i].out, i == index ? STDOUT_FILENO : -1);
+                }
+            }
+        }
+        sigaction(SIGINT, &old_sa, NULL);
+    }
+    // A finished job whose output has been read in full is done with
+    if (background_jobs[index].done && out->fd < 0 && tail < 0 && !wait_interrupted) {
+        remove_job(index);
+    }
+    return 0;
+}
+
+// jtop [-d secs] [-n count]: the jobs -l table redrawn in place every secs
+// (1 by default) until q or Ctrl-C, or for count refreshes. Each frame is
+// built in memory and written over the last in one write(), line by line
+// with erase-to-end, so the screen never blanks between refreshes.
+static int builtin_jtop(char **arglist) {
+    double interval = 1;
+    long count = -1;
+    for (int i = 1; arglist[i] != NULL; i++) {
+        char *end;
+        if (strcmp(arglist[i], "-d") == 0 && arglist[i + 1]) {
+            interval = strtod(arglist[++i], &end);
+            if (*end != '\0' || interval < 0.1) {
+                fprintf(stderr, "jtop: invalid interval: %s\n", arglist[i]);
+                return 2;
+            }
+        } else if (strcmp(arglist[i], "-n") == 0 && arglist[i + 1]) {
+            count = strtol(arglist[++i], &end, 10);
+            if (*end != '\0' || count <= 0) {
+                fprintf(stderr, "jtop: invalid count: %s\n", arglist[i]);
+                return 2;
+            }
+        } else {
+            printf("Usage: jtop [-d secs] [-n count]\n");
+            return 2;
+        }
+    }
+
+    // On a terminal, draw on the alternate screen and read q unbuffered
+    int tty = isatty(STDOUT_FILENO), keys = 0;
+    struct termios saved, raw;
+    if (tty && isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0) {
+        raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        keys = tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0;
+    }
+    struct sigaction sa, old_sa;
+    sa.sa_handler = wait_sigint;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0; // Let poll() return on Ctrl-C
+    sigaction(SIGINT, &sa, &old_sa);
+    wait_interrupted = 0;
+    fflush(stdout);
+
+    struct strbuf table = {0}, frame = {0};
+    if (tty) sb_append(&frame, "\033[?1049h\033[?25l", 14);
+    for (long n = 0; !wait_interrupted; n++) {
+        struct timespec t0, t1;
+        struct winsize ws = {0};
+        if (tty) ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+
+        // Finished processes read as done; their notices wait until jtop ends
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        table.len = 0;
+        jobs_table(&table, ws.ws_col);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+        char title[160];
+        int len = snprintf(title, sizeof(title), "jtop - %d job%s, every %gs, sampled in %.2f ms%s",
+                           job_count, job_count == 1 ? "" : "s", interval, ms,
+                           keys ? ", q to quit" : "");
+        if (tty) {
+            sb_append(&frame, "\033[H", 3);
+            if (ws.ws_col > 0 && len > ws.ws_col) len = ws.ws_col;
+            sb_append(&frame, title, len);
+            sb_append(&frame, "\033[K\n", 4);
+            // Rows that fit below the title, each clearing what it replaces
+            int rows = 1;
+            for (char *p = table.s, *nl; (nl = strchr(p, '\n')) != NULL; p = nl + 1) {
+                if (ws.ws_row > 0 && ++rows >= ws.ws_row) break;
+                sb_append(&frame, p, nl - p);
+                sb_append(&frame, "\033[K\n", 4);
+            }
+            sb_append(&frame, "\033[J", 3);
+        } else {
+            if (n > 0) sb_append(&frame, "\n", 1);
+            sb_append(&frame, title, len);
+            sb_append(&frame, "\n", 1);
+            sb_append(&frame, table.s, table.len);
+        }
+        for (size_t off = 0; off < frame.len; ) {
+            ssize_t w = write(STDOUT_FILENO, frame.s + off, frame.len - off);
+            if (w < 0 && errno != EINTR) break;
+            if (w > 0) off += w;
+        }
+        frame.len = 0;
+        if (count > 0 && n + 1 >= count) break;
+
+        // Sleep out the rest of the interval, waking for a key press
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        int timeout = (int)(interval * 1e3 - ((t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6));
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        if (poll(&pfd, keys, timeout > 0 ? timeout : 0) > 0) {
+            char c;
+            if (read(STDIN_FILENO, &c, 1) == 1 && (c == 'q' || c == 'Q')) break;
+        }
+    }
+    if (tty) {
+        ssize_t w = write(STDOUT_FILENO, "\033[?25h\033[?1049l", 14);
+        (void)w;
+    }
+    free(table.s);
+    free(frame.s);
+    if (keys) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    sigaction(SIGINT, &old_sa, NULL);
+    drain_child_events(0);
+    return wait_interrupted ? 130 : 0;
+}
+
+// Status of the job whose last process is pid: -1 while it runs, else its
+// exit status (from the table or the record of removed jobs)
+static int job_exit_status(pid_t pid) {
+    for (int i = 0; i < job_count; i++) {
+        if (background_jobs[i].pid == pid) {
+            return background_jobs[i].done || background_jobs[i].live == 0 ? background_jobs[i].status : -1;
+        }
+    }
+    for (unsigned i = job_exit_count; i > 0 && job_exit_count - i < JOB_EXITS; i--) {
+        if (job_exits[(i - 1) % JOB_EXITS].pid == pid) return job_exits[(i - 1) % JOB_EXITS].status;
+    }
+    return 127; // Unknown, e.g. reaped long ago
+}
+
+// Last process of job number N, still in the table or among the recently
+// removed jobs (the newest with that number), or 0 if there is none
+static pid_t job_number_pid(int number) {
+    if (number >= 1 && number <= job_count) return background_jobs[number - 1].pid;
+    for (unsigned i = job_exit_count; i > 0 && job_exit_count - i < JOB_EXITS; i--) {
+        if (job_exits[(i - 1) % JOB_EXITS].number == number) return job_exits[(i - 1) % JOB_EXITS].pid;
+    }
+    return 0;
+}
+
+// True if pid is a process of some job that has not been reaped yet
+static int job_pid_live(pid_t pid) {
+    for (int i = 0; i < job_count; i++) {
+        for (int k = 0; k < background_jobs[i].nprocs; k++) {
+            if (background_jobs[i].pids[k] == pid) return 1;
+        }
+    }
+    return 0;
+}
+
+// wait [-n] [--timeout secs] [[%]N|pid...]: wait for jobs (all running ones
+// by default, the first to finish with -n) and return the exit status of the
+// last one. As in kill, fg and bg, N and %N are job numbers, which also
+// name jobs that have finished and left the table; any other number is
+// taken as a pid. All their processes are watched through pidfds with a
+// single poll(); SIGCHLD stays blocked so the pidfds see them before the
+// handler.
+static int builtin_wait(char **arglist) {
+    pid_t targets[MAXJOBS];
+    int ntargets = 0, any = 0, rc = 0;
+    double timeout = -1;
+
+    for (int i = 1; arglist[i] != NULL; i++) {
+        if (strcmp(arglist[i], "-n") == 0) {
+            any = 1;
+        } else if ((strcmp(arglist[i], "--timeout") == 0 || strcmp(arglist[i], "-t") == 0) && arglist[i + 1]) {
+            char *end;
+            timeout = strtod(arglist[++i], &end);
+            if (*end != '\0' || timeout < 0) {
+                fprintf(stderr, "wait: invalid timeout: %s\n", arglist[i]);
+                return 2;
+            }
+        } else {
+            int job = arglist[i][0] == '%';
+            pid_t pid = isdigit((unsigned char)arglist[i][job]) ? job_number_pid(atoi(arglist[i] + job)) : 0;
+            if (pid == 0 && !job && isdigit((unsigned char)arglist[i][0])) {
+                pid = atoi(arglist[i]); // Not a job number, so a pid, e.g. $!
+            }
+            if (pid == 0) {
+                fprintf(stderr, "wait: %s: no such job\n", arglist[i]);
+                return 127;
+            }
+            if (ntargets < MAXJOBS) targets[ntargets++] = pid;
+        }
+    }
+
+    sigset_t old;
+    sigchld_block(&old);
+    reap_children();
+    drain_child_events(0);
+    if (ntargets == 0) { // Every job still running
+        for (int i = 0; i < job_count && ntargets < MAXJOBS; i++) {
+            if (!background_jobs[i].done) targets[ntargets++] = background_jobs[i].pid;
+        }
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int nfds = 0, maxfds = 0, use_pipe = 0;
+    for (int i = 0; i < job_count; i++) maxfds += background_jobs[i].nprocs; // Jobs cannot grow
+    struct pollfd *fds = malloc((maxfds + 1) * sizeof(struct pollfd));
+    pid_t *fd_pids = malloc((maxfds + 1) * sizeof(pid_t));
+
+    struct sigaction sa, old_sa;
+    sa.sa_handler = wait_sigint;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0; // Let poll() return on Ctrl-C
+    sigaction(SIGINT, &sa, &old_sa);
+    wait_interrupted = 0;
+
+    while (1) {
+        // Collect the status of every target that has finished
+        int pending = 0, finished = 0;
+        for (int t = 0; t < ntargets; t++) {
+            int status = job_exit_status(targets[t]);
+            if (status < 0) {
+                pending++;
+            } else {
+                rc = status;
+                finished++;
+            }
+        }
+        if (pending == 0 || (any && finished > 0)) break;
+
+        // Drop pidfds of processes reaped meanwhile, then add new ones
+        for (int f = 0; f < nfds; f++) {
+            if (!job_pid_live(fd_pids[f])) {
+                close(fds[f].fd);
+                fds[f] = fds[--nfds];
+                fd_pids[f--] = fd_pids[nfds];
+            }
+        }
+        for (int t = 0; t < ntargets && !use_pipe; t++) {
+            for (int i = 0; i < job_count; i++) {
+                struct job *job = &background_jobs[i];
+                if (job->pid != targets[t]) continue;
+                for (int k = 0; k < job->nprocs && nfds < maxfds; k++) {
+                    int f;
+                    if (job->pids[k] == 0) continue;
+                    for (f = 0; f < nfds && fd_pids[f] != job->pids[k]; f++) ;
+                    if (f < nfds) continue;
+                    int fd = syscall(SYS_pidfd_open, job->pids[k], 0);
+                    if (fd < 0) {
+                        if (errno == ENOSYS) use_pipe = 1; // Pre-5.3 kernel
+                        continue;
+                    }
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    fds[nfds] = (struct pollfd){ fd, POLLIN, 0 };
+                    fd_pids[nfds++] = job->pids[k];
+                }
+            }
+        }
+
+        int ms = -1;
+        if (timeout >= 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double left = timeout - ((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9);
+            ms = left > 0 ? (int)(left * 1000 + 0.999) : 0;
+        }
+        int n;
+        if (use_pipe) {
+            // Without pidfds, let the handler run and wake us via the self-pipe
+            struct pollfd pipe_fd = { sigchld_pipe[0], POLLIN, 0 };
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            n = poll(&pipe_fd, 1, ms);
+            sigchld_block(NULL);
+        } else {
+            n = poll(fds, nfds, ms);
+        }
+        if (n == 0) {
+            rc = 124; // Timed out
+            break;
+        }
+        if (n < 0 && wait_interrupted) {
+            rc = 128 + SIGINT;
+            printf("\n");
+            break;
+        }
+        reap_children();
+        drain_child_events(0);
+    }
+
+    for (int f = 0; f < nfds; f++) close(fds[f].fd);
+    free(fds);
+    free(fd_pids);
+    sigaction(SIGINT, &old_sa, NULL);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return rc;
+}
+
+// set [-o|+o option]: shell options (pipefail, autosuggest)
+static int builtin_set(char **arglist) {
+    if (arglist[1] == NULL || (strcmp(arglist[1], "-o") == 0 && arglist[2] == NULL)) {
+        printf("autosuggest\t%s\n", autosuggest ? "on" : "off");
+        printf("pipefail\t%s\n", pipefail ? "on" : "off");
+        return 0;
+    }
+    if ((strcmp(arglist[1], "-o") == 0 || strcmp(arglist[1], "+o") == 0) && arglist[2]) {
+        int on = arglist[1][0] == '-';
+        if (strcmp(arglist[2], "pipefail") == 0) {
+            pipefail = on;
+            return 0;
+        }
+        if (strcmp(arglist[2], "autosuggest") == 0) {
+            autosuggest = on;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Usage: set [-o|+o pipefail|autosuggest]\n");
+    return 2;
+}
+
+static int builtin_help(char **arglist);
+static int builtin_type(char **arglist);
+
+static int builtin_enable(char **arglist);
+
+// Table of commands run inside the shell process; plugins are appended
+struct builtin builtins[MAX_BUILTINS] = {
+    { "cd", builtin_cd, 0, "cd [directory | -] - Change directory (- for the previous one)" },
+    { "pushd", builtin_pushd, 0, "pushd [directory] - Push the current directory and change to directory" },
+    { "popd", builtin_popd, 0, "popd - Return to the directory on top of the stack" },
+    { "dirs", builtin_dirs, 0, "dirs [-c] [-v] - Show (or clear) the directory stack" },
+    { "z", builtin_z, 0, "z fragment... - Jump to the most frecent directory matching; z -l lists" },
+    { "jobs", builtin_jobs, 1, "jobs [-l]       - List background jobs, -l with CPU, memory and I/O" },
+    { "jtop", builtin_jtop, 0, "jtop [-d s] [-n N] - Show jobs -l refreshed every s seconds" },
+    { "after", builtin_after, 0, "after [-j jitter] delay cmd - Run cmd once as a job after delay (5s, 500ms, 2m)" },
+    { "every", builtin_every, 0, "every [-j jitter] [-q] interval cmd - Run cmd as a job each interval,\n"
+      "                    skipping (-q: queueing) ticks while the last run is going" },
+    { "timers", builtin_timers, 0, "timers [-c @N...|all] - List or cancel after/every timers" },
+    { "kill", builtin_kill, 0, "kill [-SIG] [%]job# - Signal every process of a job (default KILL)" },
+    { "set", builtin_set, 0, "set [-o|+o pipefail|autosuggest] - Set shell options" },
+    { "wait", builtin_wait, 0, "wait [-n] [--timeout secs] [[%]job#|pid...] - Wait for jobs, return exit status" },
+    { "fg", builtin_fg, 0, "fg [%N]         - Continue a job in the foreground" },
+    { "bg", builtin_bg, 0, "bg [%N]         - Continue a stopped job in the background" },
+    { "history", builtin_history, 1, "history [-m]    - List history or show its memory use" },
+    { "sched", builtin_sched, 0, "sched [opts] [cmd] - CPU/nice/NUMA placement (-c cpus -n nice\n"
+      "                    -m bind|interleave|preferred:nodes -b bgnice -s on|off)" },
+    { "limit", builtin_sched, 0, "limit [opts] [cmd] - Job limits (-m mem.max -p cpu% -v|-n|-t|-u rlimit)" },
+    { "profile", builtin_profile, 0, "profile cmd [| cmd ...] - Count cycles, instructions, misses,\n"
+      "                      context switches and page faults per command or stage" },
+    { "capture", builtin_capture, 0, "capture [on|off] [-m size] [-s dir|off] - Capture & job output" },
+    { "output", builtin_output, 0, "output %N [--tail K] [--follow] - Show a captured job's output" },
+    { "ulimit", builtin_ulimit, 0, "ulimit [-SHa] [-cdfnstuv] [value] - Shell resource limits" },
+    { "echo", builtin_echo, 1, "echo [-neE] [arg...] - Print arguments" },
+    { "printf", builtin_printf, 1, "printf format [arg...] - Formatted output" },
+    { "test", builtin_test, 1, "test expr / [ expr ] - Evaluate a condition" },
+    { "[", builtin_test, 1, NULL },
+    { "true", builtin_true, 1, "true / false    - Return success / failure" },
+    { "false", builtin_false, 1, NULL },
+    { "pwd", builtin_pwd, 1, "pwd             - Print the current directory" },
+    { "read", builtin_read, 0, "read [-r] [-p prompt] [name...] - Read a line into variables" },
+    { "type", builtin_type, 1, "type name...    - Show how a name would be run" },
+    { "enable", builtin_enable, 0, "enable [-n|-d] [-f lib.so] [name...] - Load or toggle builtins" },
+    { "help", builtin_help, 1, NULL },
+    { "break", builtin_break, 0, "break [n] / continue [n] - Leave or restart the n innermost loops" },
+    { "continue", builtin_break, 0, NULL },
+    { "return", builtin_return, 0, "return [status] - Leave the running function" },
+    { "shift", builtin_shift, 0, "shift [n]       - Drop the first n function arguments" },
+    { "exit", builtin_exit, 0, "exit [status]   - Exit the shell" },
+    { NULL },
+};
+int builtin_count = -1;         // Entries in builtins, counted on first use
+
+// Looks a command name up in the builtin table
+struct builtin* find_builtin(const char *name) {
+    if (builtin_count < 0) {
+        for (builtin_count = 0; builtins[builtin_count].name; builtin_count++) ;
+    }
+    for (int i = 0; i < builtin_count; i++) {
+        if (strcmp(builtins[i].name, name) == 0) return builtins[i].disabled ? NULL : &builtins[i];
+    }
+    return NULL;
+}
+
+// Loads name_builtin from a shared object and appends it to the table
+static int load_plugin(const char *lib, const char *name) {
+    void *handle = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        fprintf(stderr, "enable: %s\n", dlerror());
+        return 1;
+    }
+    char sym[256];
+    snprintf(sym, sizeof(sym), "%s_builtin", name);
+    struct pucitsh_builtin *pb = dlsym(handle, sym);
+    if (pb == NULL || pb->abi != PUCITSH_BUILTIN_ABI || pb->fn == NULL) {
+        fprintf(stderr, "enable: %s: %s\n", lib, pb ? "incompatible builtin ABI" : "symbol not found");
+        dlclose(handle);
+        return 1;
+    }
+
+    struct builtin *b = NULL;
+    for (int i = 0; i < builtin_count; i++) { // Replace an existing entry
+        if (strcmp(builtins[i].name, name) == 0) b = &builtins[i];
+    }
+    if (b == NULL) {
+        if (builtin_count == MAX_BUILTINS - 1) {
+            fprintf(stderr, "enable: builtin table full\n");
+            dlclose(handle);
+            return 1;
+        }
+        b = &builtins[builtin_count++];
+    } else if (b->handle) {
+        dlclose(b->handle);
+    }
+    b->name = pb->name ? pb->name : name;
+    b->fn = NULL;
+    b->pure = 0; // Unknown side effects: $(...) forks for plugins
+    b->help = pb->help;
+    b->ext = pb->fn;
+    b->handle = handle;
+    b->disabled = 0;
+    return 0;
+}
+
+// enable [-n|-d] [-f lib.so] [name...]: loads plugin builtins, disables
+// (-n) or deletes (-d) builtins, or lists them
+static int builtin_enable(char **arglist) {
+    int disable = 0, del = 0, i = 1, status = 0;
+    const char *lib = NULL;
+    find_builtin(""); // Make sure builtin_count is known
+    for (; arglist[i] != NULL && arglist[i][0] == '-'; i++) {
+        if (strcmp(arglist[i], "-n") == 0) disable = 1;
+        else if (strcmp(arglist[i], "-d") == 0) del = 1;
+        else if (strcmp(arglist[i], "-f") == 0 && arglist[i + 1] != NULL) lib = arglist[++i];
+        else {
+            fprintf(stderr, "Usage: enable [-n|-d] [-f lib.so] [name...]\n");
+            return 2;
+        }
+    }
+    if (arglist[i] == NULL) {
+        for (int k = 0; k < builtin_count; k++) {
+            printf("enable %s%s%s\n", builtins[k].disabled ? "-n " : "", builtins[k].name,
+                   builtins[k].ext ? " (plugin)" : "");
+        }
+        return 0;
+    }
+    for (; arglist[i] != NULL; i++) {
+        if (lib) {
+            status |= load_plugin(lib, arglist[i]);
+            continue;
+        }
+        int k;
+        for (k = 0; k < builtin_count && strcmp(builtins[k].name, arglist[i]) != 0; k++) ;
+        if (k == builtin_count) {
+            fprintf(stderr, "enable: %s: not a shell builtin\n", arglist[i]);
+            status = 1;
+        } else if (del) {
+            if (builtins[k].handle == NULL) {
+                fprintf(stderr, "enable: %s: not dynamically loaded\n", arglist[i]);
+                status = 1;
+                continue;
+            }
+            dlclose(builtins[k].handle);
+            builtins[k] = builtins[--builtin_count];
+            memset(&builtins[builtin_count], 0, sizeof(struct builtin));
+        } else {
+            builtins[k].disabled = disable;
+        }
+    }
+    return status;
+}
+
+// Displays the available builtins
+static int builtin_help(char **arglist) {
+    (void)arglist;
+    printf("Available commands:\n");
+    find_builtin(""); // Make sure builtin_count is known
+    for (int i = 0; i < builtin_count; i++) {
+        if (builtins[i].help && !builtins[i].disabled) printf("  %s\n", builtins[i].help);
+    }
+    printf("  ![number]       - Execute a command from history\n");
+    return 0;
+}
+
+// Reports whether each name is a builtin or where it is found on PATH
+static int builtin_type(char **arglist) {
+    int status = 0;
+    for (int i = 1; arglist[i] != NULL; i++) {
+        const char *name = arglist[i];
+        struct func *f = find_function(name);
+        if (f != NULL) {
+            char *text = node_text(f->def);
+            printf("%s is a function\n%s\n", name, text);
+            free(text);
+            continue;
+        }
+        if (find_builtin(name)) {
+            printf("%s is a shell builtin\n", name);
+            continue;
+        }
+        if (strchr(name, '/')) {
+            if (access(name, X_OK) == 0) printf("%s is %s\n", name, name);
+            else { fprintf(stderr, "type: %s: not found\n", name); status = 1; }
+            continue;
+        }
+        const char *path = getenv("PATH");
+        char *dirs = strdup(path ? path : "/usr/bin:/bin"), *save, *found = NULL;
+        char full[PATH_MAX];
+        for (char *d = strtok_r(dirs, ":", &save); d; d = strtok_r(NULL, ":", &save)) {
+            snprintf(full, sizeof(full), "%s/%s", *d ? d : ".", name);
+            if (access(full, X_OK) == 0) {
+                found = full;
+                break;
+            }
+        }
+        if (found) printf("%s is %s\n", name, found);
+        else { fprintf(stderr, "type: %s: not found\n", name); status = 1; }
+        free(dirs);
+    }
+    return status;
+}
+
+// Runs a builtin command and returns its exit status
+int handle_builtins(char **arglist) {
+    struct builtin *b = find_builtin(arglist[0]);
+    if (b == NULL) return 127;
+    if (b->ext) { // Plugins write straight to the fds
+        int argc = 0;
+        while (arglist[argc] != NULL) argc++;
+        fflush(stdout);
+        fflush(stderr);
+        return b->ext(argc, arglist, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+    }
+    return b->fn(arglist);
+}
+
+// Returns whether a command runs inside the shell process
+int is_builtin(char **arglist) {
+    if (strcmp(arglist[0], "sched") == 0 || strcmp(arglist[0], "limit") == 0) {
+        // Without a command these change the defaults, otherwise they are prefixes
+        struct exec_attrs attrs;
+        int first = sched_options(arglist, &attrs);
+        return first > 0 && arglist[first] == NULL;
+    }
+    return find_builtin(arglist[0]) != NULL;
+}
+
+// Runs fn (a builtin or shell function) in the shell process with the
+// command's < and > redirections applied to its stdin/stdout around it
+static int run_redirected(char **arglist, int (*fn)(char **)) {
+    int infile = STDIN_FILENO, outfile = STDOUT_FILENO;
+    if (parse_redirects(arglist, &infile, &outfile) < 0) return 1;
+    // The saved copies are close-on-exec so commands the builtin or
+    // function starts do not inherit them
+    int saved_in = -1, saved_out = -1;
+    if (infile != STDIN_FILENO) {
+        saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(infile, STDIN_FILENO);
+        close(infile);
+    }
+    if (outfile != STDOUT_FILENO) {
+        fflush(stdout);
+        saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(outfile, STDOUT_FILENO);
+        close(outfile);
+    }
+    int status = fn(arglist);
+    if (saved_out >= 0) {
+        fflush(stdout);
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+    if (saved_in >= 0) {
+        dup2(saved_in, STDIN_FILENO);
+        close(saved_in);
+    }
+    return status;
+}
+
+// Runs a builtin in the shell process with its < and > redirections applied
+// to the shell's own stdin/stdout for the duration of the call
+int run_builtin(char **arglist) {
+    return run_redirected(arglist, handle_builtins);
+}
+
+// Returns whether every word is a NAME=value assignment
+static int only_assignments(char **args) {
+    for (int i = 0; args[i] != NULL; i++) {
+        if (!is_assignment(args[i])) return 0;
+    }
+    return 1;
+}
+
+// Runs the stages of one pipeline (or a single command): expands the
+// words and dispatches to a builtin, execute() or execute_pipeline(). A
+// stage with an entry in nodes is a group or subshell run by a forked copy
+// of the shell. The raw words are left untouched since they may live in
+// the rc snapshot or in a parsed tree that runs again.
+int run_pipeline(char ***stages, int num_cmds, int background, struct node **nodes) {
+    char **arglist;
+    struct exec_attrs attrs;
+
+    // Handle pipeline execution or a single command
+    if (num_cmds > 1) {
+        char ***cmds = malloc(num_cmds * sizeof(char **));
+        int ok = 1;
+        for (int i = 0; i < num_cmds; i++) {
+            if (nodes != NULL && nodes[i] != NULL) { // Shown by jobs as its text
+                cmds[i] = malloc(2 * sizeof(char *));
+                cmds[i][0] = node_text(nodes[i]);
+                cmds[i][1] = NULL;
+                continue;
+            }
+            cmds[i] = expand_args(stages[i]);
+            if (cmds[i] == NULL) {
+                num_cmds = i;
+                ok = 0;
+                break;
+            }
+        }
+        // "profile a | b" counts every stage of the pipeline
+        char **first = ok ? cmds[0] : NULL;
+        if (ok && (nodes == NULL || nodes[0] == NULL) && first[0] != NULL &&
+            strcmp(first[0], "profile") == 0) {
+            profile_next = !background;
+            cmds[0]++;
+        }
+        if (ok && background && cmds[0] != first) {
+            fprintf(stderr, "profile: only foreground jobs can be profiled\n");
+            last_status = 2;
+        } else if (ok) {
+            execute_pipeline(cmds, num_cmds, background, nodes);
+        }
+        if (ok) cmds[0] = first;
+        profile_next = 0;
+        procsub_finish(background);
+        for (int i = 0; i < num_cmds; i++) free_args(cmds[i]);
+        free(cmds);
+        return last_status;
+    }
+    if (num_cmds == 0) return last_status;
+
+    arglist = stages[0][0] == NULL ? NULL : expand_args(stages[0]);
+    if (arglist == NULL) {
+        procsub_finish(0);
+        return last_status;
+    }
+    if (arglist[0] == NULL) {
+        // Nothing left after expansion
+    } else if (only_assignments(arglist)) { // NAME=value sets a variable
+        for (int i = 0; arglist[i] != NULL; i++) {
+            char *eq = strchr(arglist[i], '=');
+            *eq = '\0';
+            var_set(arglist[i], eq + 1);
+        }
+        last_status = 0;
+    } else if ((strcmp(arglist[0], "sched") == 0 || strcmp(arglist[0], "limit") == 0) &&
+               sched_options(arglist, &attrs) < 0) {
+        last_status = 2; // Invalid sched/limit options were already reported
+    } else if (strcmp(arglist[0], "profile") == 0 && arglist[1] != NULL) {
+        if (background) {
+            fprintf(stderr, "profile: only foreground jobs can be profiled\n");
+            last_status = 2;
+        } else {
+            profile_next = 1;
+            execute(arglist + 1, 0);
+            profile_next = 0; // Not consumed if the command never started
+        }
+    } else if (find_function(arglist[0]) != NULL) {
+        last_status = run_redirected(arglist, call_function);
+    } else if (is_builtin(arglist)) {
+        last_status = run_builtin(arglist);
+    } else {
+        execute(arglist, background);
+    }
+    procsub_finish(background);
+    free_args(arglist);
+    return last_status;
+}
+
+// Runs the split and tokenized stages of one rc snapshot line, where a
+// trailing "&" word still marks a background job
+int run_stages(char ***stages, int num_cmds) {
+    if (num_cmds == 0) return last_status;
+    char **last = stages[num_cmds - 1], *amp = NULL;
+    int n = 0;
+    // The & is hidden from expansion for a moment rather than copying the stage
+    while (last[n] != NULL) n++;
+    if (n > 0 && strcmp(last[n - 1], "&") == 0) {
+        amp = last[n - 1];
+        last[n - 1] = NULL;
+    }
+    run_pipeline(stages, num_cmds, amp != NULL, NULL);
+    if (amp != NULL) last[n - 1] = amp;
+    return last_status;
+}
+
+// Token types produced by lex_line()
+enum { T_WORD, T_SEMI, T_AMP, T_AND, T_OR, T_PIPE, T_LPAREN, T_RPAREN, T_NEWLINE, T_DSEMI, T_END };
+
+// A token; words are NUL-terminated in place inside the command line
+struct token {
+    int type;
+    char *word;                 // T_WORD only
+};
+
+// Parser state for one command line
+struct parser {
+    struct token *toks;
+    int pos;
+    int incomplete;             // Input ended where more was expected
+    int error;                  // A syntax error was found (and reported)
+    int quiet;                  // Only checking: report nothing
+};
+
+// Returns a pointer just past the end of the word starting at p. Unlike
+// scan_word() it also stops at the control operators ; & | ( ) and at a
+// newline, except inside quotes and $( ), <( ) or >( ) substitutions, and
+// keeps the & of >&2-style redirections.
+static char* scan_token(char *p) {
+    char *start = p;
+    int depth = 0;
+    while (*p != '\0') {
+        if (depth == 0 && strchr(" \t\n;|()", *p) != NULL &&
+            !(*p == '(' && p > start && strchr("$<>", p[-1]) != NULL)) break;
+        if (depth == 0 && *p == '&' && !(p > start && (p[-1] == '>' || p[-1] == '<'))) break;
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            p = skip_quoted(p);
+        } else {
+            if (*p == '(') depth++;
+            else if (*p == ')' && depth > 0) depth--;
+            p++;
+        }
+    }
+    return p;
+}
+
+// Splits a command line into words and control operators in place; a #
+// at the start of a word comments out the rest of its line. Returns a
+// malloc'd array ending in T_END.
+static struct token* lex_line(char *line) {
+    int n = 0, cap = 16;
+    struct token *toks = malloc(cap * sizeof(struct token));
+    char *p = line;
+    for (;;) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#') {
+            while (*p != '\0' && *p != '\n') p++;
+        }
+        if (n + 1 >= cap) toks = realloc(toks, (cap *= 2) * sizeof(struct token));
+        struct token *t = &toks[n++];
+        t->word = NULL;
+        if (*p == '\0') {
+            t->type = T_END;
+            return toks;
+        }
+        char c = *p, c2 = p[1];
+        if (c == '&' && c2 == '&') t->type = T_AND;
+        else if (c == '|' && c2 == '|') t->type = T_OR;
+        else if (c == ';' && c2 == ';') t->type = T_DSEMI;
+        else if (c == ';') t->type = T_SEMI;
+        else if (c == '&') t->type = T_AMP;
+        else if (c == '|') t->type = T_PIPE;
+        else if (c == '(') t->type = T_LPAREN;
+        else if (c == ')') t->type = T_RPAREN;
+        else if (c == '\n') t->type = T_NEWLINE;
+        else t->type = T_WORD;
+        if (t->type != T_WORD) {
+            *p = '\0'; // May end the previous word
+            p += t->type == T_AND || t->type == T_OR || t->type == T_DSEMI ? 2 : 1;
+            continue;
+        }
+        t->word = p;
+        p = scan_token(p);
+        if (*p == ' ' || *p == '\t') *p++ = '\0';
+        // Otherwise an operator (or the end) follows and its case above ends the word
+    }
+}
+
+// Allocates a tree node
+static struct node* node_new(int type, int nkids) {
+    struct node *n = calloc(1, sizeof(*n));
+    n->type = type;
+    n->nkids = nkids;
+    if (nkids > 0) n->kids = calloc(nkids, sizeof(struct node *));
+    return n;
+}
+
+// Frees a parsed tree; the words belong to the command line
+void node_free(struct node *n) {
+    if (n == NULL) return;
+    for (int i = 0; i < n->nkids; i++) node_free(n->kids[i]);
+    free(n->kids);
+    free(n->words);
+    free(n->redirs);
+    if (n->code != NULL) {
+        free(n->code->insns);
+        free(n->code);
+    }
+    free(n);
+}
+
+// Appends a child to a node
+static void node_add(struct node *n, struct node *kid) {
+    n->kids = realloc(n->kids, (n->nkids + 1) * sizeof(struct node *));
+    n->kids[n->nkids++] = kid;
+}
+
+// Reports a syntax error at the current token, or notes that the input
+// simply stopped early
+static void parse_fail(struct parser *ps) {
+    struct token *t = &ps->toks[ps->pos];
+    static const char *names[] = { "", ";", "&", "&&", "||", "|", "(", ")", "newline", ";;", "" };
+    if (t->type == T_END) {
+        ps->incomplete = 1;
+    } else if (!ps->error) {
+        if (!ps->quiet) {
+            fprintf(stderr, "syntax error near unexpected token `%s'\n",
+                    t->type == T_WORD ? t->word : names[t->type]);
+        }
+        ps->error = 1;
+    }
+}
+
+// Whether the current token is the reserved word w
+static int parse_at_word(struct parser *ps, const char *w) {
+    struct token *t = &ps->toks[ps->pos];
+    return t->type == T_WORD && strcmp(t->word, w) == 0;
+}
+
+static void parse_newlines(struct parser *ps) {
+    while (ps->toks[ps->pos].type == T_NEWLINE) ps->pos++;
+}
+
+// Skips the reserved word w, or reports what is there instead
+static int parse_expect(struct parser *ps, const char *w) {
+    if (!parse_at_word(ps, w)) {
+        parse_fail(ps);
+        return 0;
+    }
+    ps->pos++;
+    return 1;
+}
+
+// Whether the current token ends a list: the end of input, ), ;; or a
+// reserved word that closes a compound command
+static int parse_list_end(struct parser *ps) {
+    static const char *closers[] = { "}", "then", "elif", "else", "fi", "do", "done", "esac", NULL };
+    struct token *t = &ps->toks[ps->pos];
+    if (t->type == T_END || t->type == T_RPAREN || t->type == T_DSEMI) return 1;
+    if (t->type != T_WORD) return 0;
+    for (int i = 0; closers[i] != NULL; i++) {
+        if (strcmp(t->word, closers[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+// Whether w can name a variable or function
+static int valid_name(const char *w) {
+    if (!isalpha((unsigned char)*w) && *w != '_') return 0;
+    while (isalnum((unsigned char)*w) || *w == '_') w++;
+    return *w == '\0';
+}
+
+static struct node* parse_list(struct parser *ps);
+
+// Collects the redirection words that may follow ) or }
+static char** parse_redirs(struct parser *ps) {
+    char **redirs = NULL;
+    int n = 0;
+    while (ps->toks[ps->pos].type == T_WORD) {
+        char *w = ps->toks[ps->pos].word;
+        if (strcmp(w, "<") != 0 && strcmp(w, ">") != 0 && strcmp(w, ">>") != 0) {
+            parse_fail(ps);
+            break;
+        }
+        if (ps->toks[ps->pos + 1].type != T_WORD) {
+            ps->pos++;
+            parse_fail(ps);
+            break;
+        }
+        redirs = realloc(redirs, (n + 3) * sizeof(char *));
+        redirs[n++] = w;
+        redirs[n++] = ps->toks[ps->pos + 1].word;
+        redirs[n] = NULL;
+        ps->pos += 2;
+    }
+    return redirs;
+}
+
+// Parses the rest of an if command: condition/body pairs for if and each
+// elif, then an optional else body
+static struct node* parse_if(struct parser *ps) {
+    struct node *n = node_new(N_IF, 0);
+    for (;;) {
+        node_add(n, parse_list(ps));
+        if (ps->error || ps->incomplete || !parse_expect(ps, "then")) return n;
+        node_add(n, parse_list(ps));
+        if (ps->error || ps->incomplete) return n;
+        if (parse_at_word(ps, "elif")) {
+            ps->pos++;
+            continue;
+        }
+        if (parse_at_word(ps, "else")) {
+            ps->pos++;
+            node_add(n, parse_list(ps));
+            if (ps->error || ps->incomplete) return n;
+        }
+        parse_expect(ps, "fi");
+        return n;
+    }
+}
+
+// Parses "do list done", the body of every loop, into n
+static void parse_do(struct parser *ps, struct node *n) {
+    parse_newlines(ps);
+    if (ps->error || ps->incomplete || !parse_expect(ps, "do")) return;
+    node_add(n, parse_list(ps));
+    if (!ps->error && !ps->incomplete) parse_expect(ps, "done");
+}
+
+// Parses the rest of for NAME [in word...]; do list done
+static struct node* parse_for(struct parser *ps) {
+    struct node *n = node_new(N_FOR, 0);
+    struct token *t = &ps->toks[ps->pos];
+    if (t->type != T_WORD || !valid_name(t->word)) {
+        parse_fail(ps);
+        return n;
+    }
+    int count = 0;
+    ps->pos++;
+    if (parse_at_word(ps, "in")) {
+        n->has_in = 1;
+        ps->pos++;
+        while (ps->toks[ps->pos + count].type == T_WORD) count++;
+    }
+    n->words = malloc((count + 2) * sizeof(char *));
+    n->words[0] = t->word;
+    for (int i = 0; i < count; i++) n->words[i + 1] = ps->toks[ps->pos + i].word;
+    n->words[count + 1] = NULL;
+    ps->pos += count;
+    if (ps->toks[ps->pos].type == T_SEMI) ps->pos++;
+    parse_do(ps, n);
+    return n;
+}
+
+// Parses the rest of case WORD in [(]pattern[|pattern]) list ;; ... esac
+static struct node* parse_case(struct parser *ps) {
+    struct node *n = node_new(N_CASE, 0);
+    if (ps->toks[ps->pos].type != T_WORD) {
+        parse_fail(ps);
+        return n;
+    }
+    n->words = malloc(2 * sizeof(char *));
+    n->words[0] = ps->toks[ps->pos++].word;
+    n->words[1] = NULL;
+    parse_newlines(ps);
+    if (!parse_expect(ps, "in")) return n;
+    parse_newlines(ps);
+    while (!parse_at_word(ps, "esac")) {
+        struct node *item = node_new(N_ITEM, 0);
+        int count = 0;
+        node_add(n, item);
+        if (ps->toks[ps->pos].type == T_LPAREN) ps->pos++;
+        for (;;) {
+            if (ps->toks[ps->pos].type != T_WORD) {
+                parse_fail(ps);
+                return n;
+            }
+            item->words = realloc(item->words, (count + 2) * sizeof(char *));
+            item->words[count++] = ps->toks[ps->pos++].word;
+            item->words[count] = NULL;
+            if (ps->toks[ps->pos].type != T_PIPE) break;
+            ps->pos++;
+        }
+        if (ps->toks[ps->pos].type != T_RPAREN) {
+            parse_fail(ps);
+            return n;
+        }
+        ps->pos++;
+        parse_newlines(ps);
+        if (ps->toks[ps->pos].type == T_DSEMI || parse_at_word(ps, "esac")) {
+            node_add(item, node_new(N_SEQ, 0)); // Empty body
+        } else {
+            node_add(item, parse_list(ps));
+        }
+        if (ps->error || ps->incomplete) return n;
+        if (ps->toks[ps->pos].type == T_DSEMI) {
+            ps->pos++;
+            parse_newlines(ps);
+        } else if (!parse_at_word(ps, "esac")) {
+            parse_fail(ps);
+            return n;
+        }
+    }
+    ps->pos++;
+    return n;
+}
+
+// command: ( list ) | { list } | if | while | until | for | case |
+// function definition | words; compound commands may be followed by
+// redirections
+static struct node* parse_command(struct parser *ps) {
+    struct token *t = &ps->toks[ps->pos];
+    struct node *n;
+    if (t->type == T_LPAREN || parse_at_word(ps, "{")) {
+        int sub = t->type == T_LPAREN;
+        ps->pos++;
+        n = node_new(sub ? N_SUBSHELL : N_GROUP, 0);
+        node_add(n, parse_list(ps));
+        if (ps->error || ps->incomplete) return n;
+        if (sub ? ps->toks[ps->pos].type != T_RPAREN : !parse_at_word(ps, "}")) {
+            parse_fail(ps);
+            return n;
+        }
+        ps->pos++;
+        n->redirs = parse_redirs(ps);
+        return n;
+    }
+    if (t->type != T_WORD || parse_list_end(ps)) {
+        parse_fail(ps);
+        return NULL;
+    }
+    // Reserved words only count at the start of a command
+    n = NULL;
+    if (strcmp(t->word, "if") == 0) {
+        ps->pos++;
+        n = parse_if(ps);
+    } else if (strcmp(t->word, "while") == 0 || strcmp(t->word, "until") == 0) {
+        ps->pos++;
+        n = node_new(t->word[0] == 'w' ? N_WHILE : N_UNTIL, 0);
+        node_add(n, parse_list(ps));
+        parse_do(ps, n);
+    } else if (strcmp(t->word, "for") == 0) {
+        ps->pos++;
+        n = parse_for(ps);
+    } else if (strcmp(t->word, "case") == 0) {
+        ps->pos++;
+        n = parse_case(ps);
+    } else if (strcmp(t->word, "function") == 0 ||
+               (ps->toks[ps->pos + 1].type == T_LPAREN && ps->toks[ps->pos + 2].type == T_RPAREN)) {
+        // name() body or function name [()] body
+        if (strcmp(t->word, "function") == 0) t = &ps->toks[++ps->pos];
+        if (t->type != T_WORD || !valid_name(t->word)) {
+            parse_fail(ps);
+            return NULL;
+        }
+        n = node_new(N_FUNC, 0);
+        n->words = malloc(2 * sizeof(char *));
+        n->words[0] = t->word;
+        n->words[1] = NULL;
+        ps->pos++;
+        if (ps->toks[ps->pos].type == T_LPAREN) {
+            if (ps->toks[++ps->pos].type != T_RPAREN) {
+                parse_fail(ps);
+                return n;
+            }
+            ps->pos++;
+        }
+        parse_newlines(ps);
+        struct token *b = &ps->toks[ps->pos];
+        if (b->type == T_WORD && !parse_at_word(ps, "{") && !parse_at_word(ps, "if") &&
+            !parse_at_word(ps, "while") && !parse_at_word(ps, "until") &&
+            !parse_at_word(ps, "for") && !parse_at_word(ps, "case")) {
+            parse_fail(ps); // The body must be a compound command
+            return n;
+        }
+        node_add(n, parse_command(ps));
+        return n;
+    }
+    if (n != NULL) {
+        if (!ps->error && !ps->incomplete) n->redirs = parse_redirs(ps);
+        return n;
+    }
+    int count = 0;
+    while (ps->toks[ps->pos + count].type == T_WORD) count++;
+    n = node_new(N_CMD, 0);
+    n->words = malloc((count + 1) * sizeof(char *));
+    for (int i = 0; i < count; i++) n->words[i] = ps->toks[ps->pos + i].word;
+    n->words[count] = NULL;
+    ps->pos += count;
+    return n;
+}
+
+// pipeline: command { | command }
+static struct node* parse_pipeline(struct parser *ps) {
+    struct node *first = parse_command(ps);
+    if (ps->toks[ps->pos].type != T_PIPE || ps->error) return first;
+    struct node *n = node_new(N_PIPE, 0);
+    node_add(n, first);
+    while (ps->toks[ps->pos].type == T_PIPE && !ps->error && !ps->incomplete) {
+        ps->pos++;
+        parse_newlines(ps);
+        node_add(n, parse_command(ps));
+    }
+    return n;
+}
+
+// and_or: pipeline { && pipeline | || pipeline }
+static struct node* parse_and_or(struct parser *ps) {
+    struct node *n = parse_pipeline(ps);
+    while ((ps->toks[ps->pos].type == T_AND || ps->toks[ps->pos].type == T_OR) &&
+           !ps->error && !ps->incomplete) {
+        struct node *op = node_new(ps->toks[ps->pos].type == T_AND ? N_AND : N_OR, 0);
+        ps->pos++;
+        parse_newlines(ps);
+        node_add(op, n);
+        node_add(op, parse_pipeline(ps));
+        n = op;
+    }
+    return n;
+}
+
+// list: and_or { (; | & | newline) and_or }, ending before ), ;;, a
+// closing reserved word or the end of the input
+static struct node* parse_list(struct parser *ps) {
+    struct node *seq = node_new(N_SEQ, 0);
+    parse_newlines(ps);
+    while (!ps->error && !ps->incomplete) {
+        if (parse_list_end(ps)) break;
+        struct node *item = parse_and_or(ps);
+        if (ps->error || ps->incomplete) {
+            node_free(item);
+            break;
+        }
+        int type = ps->toks[ps->pos].type;
+        if (type == T_AMP) {
+            struct node *bg = node_new(N_BG, 0);
+            node_add(bg, item);
+            item = bg;
+        }
+        node_add(seq, item);
+        if (type == T_SEMI || type == T_AMP || type == T_NEWLINE) {
+            ps->pos++;
+            parse_newlines(ps);
+        } else if (!parse_list_end(ps)) {
+            parse_fail(ps);
+        }
+    }
+    if (seq->nkids == 0 && !ps->error && !ps->incomplete && ps->toks[ps->pos].type != T_END) {
+        parse_fail(ps); // Empty ( ), { } or other compound part
+    }
+    return seq;
+}
+
+// Parses a command line, which it modifies in place, into a tree; returns
+// NULL on a syntax error. *incomplete (when given) is set if the line stops
+// inside a group or after && / || / |, and nothing is reported then.
+struct node* parse_line(char *line, int *incomplete) {
+    struct parser ps = { lex_line(line), 0, 0, 0, incomplete != NULL };
+    struct node *tree = parse_list(&ps);
+    if (!ps.error && !ps.incomplete && ps.toks[ps.pos].type != T_END) parse_fail(&ps);
+    if (ps.incomplete && incomplete == NULL && !ps.error) {
+        fprintf(stderr, "syntax error: unexpected end of input\n");
+    }
+    if (incomplete != NULL) *incomplete = ps.incomplete && !ps.error;
+    free(ps.toks);
+    if (ps.error || ps.incomplete) {
+        node_free(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+// Whether a line needs more input to form a complete command: a trailing
+// backslash, open quote or | (see line_incomplete(), which scan is passed
+// to), or 4 for an open group or a trailing && / ||
+int input_incomplete(const char *line, struct line_scan *scan) {
+    int kind = line_incomplete(line, scan);
+    if (kind != 0) return kind;
+    char *copy = strdup(line);
+    int incomplete = 0;
+    node_free(parse_line(copy, &incomplete));
+    free(copy);
+    return incomplete ? 4 : 0;
+}
+
+// Appends text to sb
+static void sb_puts(struct strbuf *sb, const char *text) {
+    sb_append(sb, text, strlen(text));
+}
+
+// Appends the separator before the next list item or closing word: "; ",
+// or just a space after a background job's &
+static void sb_sep(struct strbuf *sb) {
+    sb_puts(sb, sb->len > 0 && sb->s[sb->len - 1] == '&' ? " " : "; ");
+}
+
+// Appends words separated by sep
+static void sb_words(struct strbuf *sb, char **words, const char *sep) {
+    for (int i = 0; words != NULL && words[i] != NULL; i++) {
+        if (i > 0) sb_puts(sb, sep);
+        sb_puts(sb, words[i]);
+    }
+}
+
+// Appends the source form of a tree, used for job listings and to keep
+// function definitions; it parses back to the same tree
+static void node_format(struct node *n, struct strbuf *sb) {
+    switch (n->type) {
+    case N_CMD:
+        sb_words(sb, n->words, " ");
+        return;
+    case N_PIPE:
+    case N_SEQ:
+        for (int i = 0; i < n->nkids; i++) {
+            if (i > 0 && n->type == N_PIPE) sb_puts(sb, " | ");
+            else if (i > 0) sb_sep(sb);
+            node_format(n->kids[i], sb);
+        }
+        return;
+    case N_AND:
+    case N_OR:
+        node_format(n->kids[0], sb);
+        sb_puts(sb, n->type == N_AND ? " && " : " || ");
+        node_format(n->kids[1], sb);
+        return;
+    case N_BG:
+        node_format(n->kids[0], sb);
+        sb_puts(sb, " &");
+        return;
+    case N_SUBSHELL:
+        sb_puts(sb, "( ");
+        node_format(n->kids[0], sb);
+        sb_puts(sb, " )");
+        break;
+    case N_GROUP:
+        sb_puts(sb, "{ ");
+        node_format(n->kids[0], sb);
+        sb_sep(sb);
+        sb_puts(sb, "}");
+        break;
+    case N_IF:
+        for (int i = 0; i < n->nkids; i++) {
+            if (i > 0) sb_sep(sb);
+            sb_puts(sb, i == 0 ? "if " : i % 2 ? "then " : i == n->nkids - 1 ? "else " : "elif ");
+            node_format(n->kids[i], sb);
+        }
+        sb_sep(sb);
+        sb_puts(sb, "fi");
+        break;
+    case N_WHILE:
+    case N_UNTIL:
+    case N_FOR:
+        if (n->type == N_FOR) {
+            sb_puts(sb, "for ");
+            sb_puts(sb, n->words[0]);
+            if (n->has_in) sb_puts(sb, " in");
+            for (int i = 1; n->words[i] != NULL; i++) {
+                sb_puts(sb, " ");
+                sb_puts(sb, n->words[i]);
+            }
+        } else {
+            sb_puts(sb, n->type == N_WHILE ? "while " : "until ");
+            node_format(n->kids[0], sb);
+        }
+        sb_sep(sb);
+        sb_puts(sb, "do ");
+        node_format(n->kids[n->nkids - 1], sb);
+        sb_sep(sb);
+        sb_puts(sb, "done");
+        break;
+    case N_CASE:
+        sb_puts(sb, "case ");
+        sb_puts(sb, n->words[0]);
+        sb_puts(sb, " in ");
+        for (int i = 0; i < n->nkids; i++) {
+            sb_words(sb, n->kids[i]->words, "|");
+            sb_puts(sb, ") ");
+            node_format(n->kids[i]->kids[0], sb);
+            sb_puts(sb, " ;; ");
+        }
+        sb_puts(sb, "esac");
+        break;
+    case N_FUNC:
+        sb_puts(sb, n->words[0]);
+        sb_puts(sb, "() ");
+        node_format(n->kids[0], sb);
+        return;
+    }
+    for (int i = 0; n->redirs != NULL && n->redirs[i] != NULL; i++) {
+        sb_puts(sb, " ");
+        sb_puts(sb, n->redirs[i]);
+    }
+}
+
+// Returns the malloc'd source form of a tree
+char* node_text(struct node *n) {
+    struct strbuf sb = {0};
+    node_format(n, &sb);
+    if (sb.s == NULL) sb_append(&sb, "", 0);
+    return sb.s;
+}
+
+// Points the shell's stdin/stdout at a group's redirections, keeping the
+// originals in saved[] for redirect_restore(); returns -1 on failure
+static int redirect_apply(char **redirs, int saved[2]) {
+    saved[0] = saved[1] = -1;
+    if (redirs == NULL) return 0;
+    char **args = expand_args(redirs);
+    if (args == NULL) return -1;
+    int infile = STDIN_FILENO, outfile = STDOUT_FILENO;
+    int rc = parse_redirects(args, &infile, &outfile);
+    free_args(args);
+    if (rc < 0) return -1;
+    if (infile != STDIN_FILENO) {
+        saved[0] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(infile, STDIN_FILENO);
+        close(infile);
+    }
+    if (outfile != STDOUT_FILENO) {
+        fflush(stdout);
+        saved[1] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(outfile, STDOUT_FILENO);
+        close(outfile);
+    }
+    return 0;
+}
+
+// Undoes redirect_apply()
+static void redirect_restore(int saved[2]) {
+    if (saved[1] >= 0) {
+        fflush(stdout);
+        dup2(saved[1], STDOUT_FILENO);
+        close(saved[1]);
+    }
+    if (saved[0] >= 0) {
+        dup2(saved[0], STDIN_FILENO);
+        close(saved[0]);
+    }
+}
+
+// Runs a tree in a forked copy of the shell, like a subshell: the child
+// never execs itself, it just keeps running the parsed tree. In the
+// foreground the job is waited for; otherwise it joins the job table.
+static int fork_node(struct node *n, int background) {
+    int group = background ? PG_BACKGROUND : job_control ? PG_FOREGROUND : PG_NONE;
+    sigset_t old;
+    fflush(stdout);
+    sigchld_block(&old);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        job_child_setup(0, group);
+        run_subshell(n);
+    }
+    if (pid < 0) {
+        perror("fork failed");
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return last_status = 1;
+    }
+    if (group != PG_NONE) setpgid(pid, pid);
+    struct job job = {0};
+    job.pid = pid;
+    job.pgid = group != PG_NONE ? pid : 0;
+    job.pids = malloc(sizeof(pid_t));
+    job.pids[0] = pid;
+    job.statuses = calloc(1, sizeof(int));
+    job.cgroups = calloc(1, sizeof(char *));
+    job.nprocs = job.live = 1;
+    job.cmd = node_text(n);
+    if (background) {
+        last_background = pid;
+        job_add(&job);
+        printf("[Background PID %d]\n", pid);
+        last_status = 0;
+    } else {
+        foreground_job(&job, 0);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return last_status;
+}
+
+// Bytecode opcodes
+enum {
+    OP_EXEC,        // Run node (a command, pipeline or anything not compiled)
+    OP_JUMP,        // Go to a
+    OP_JUMP_OK,     // Go to a if the last status is 0
+    OP_JUMP_FAIL,   // Go to a if the last status is not 0
+    OP_STATUS,      // Set the status to a
+    OP_LOOP,        // Enter a loop: break goes to a, continue to b
+    OP_SAVE,        // Keep the status of a loop body as the loop's status
+    OP_END_LOOP,    // Leave the innermost loop
+    OP_FOR_LIST,    // Expand the words of for node into the loop's list
+    OP_FOR_NEXT,    // Assign the next list item, or go to a when done
+    OP_CASE,        // Skip to the jump after it for the item that matches
+    OP_DEFUN,       // Define the function node
+};
+
+// Appends an instruction and returns its index
+static int emit(struct code *c, int op, int a, struct node *node) {
+    if (c->n == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->insns = realloc(c->insns, c->cap * sizeof(struct insn));
+    }
+    c->insns[c->n] = (struct insn){ op, a, 0, node };
+    return c->n++;
+}
+
+// Compiles a tree into c. Lists, && / ||, groups and control commands
+// become jumps; everything else is left to exec_node() via OP_EXEC. A
+// nested command with redirections also goes through OP_EXEC, which
+// applies them around it; top compiles n itself ignoring its own.
+static void compile(struct code *c, struct node *n, int depth, int top) {
+    int j, loop, start, end;
+    if (n->redirs != NULL && !top) {
+        emit(c, OP_EXEC, 0, n);
+        return;
+    }
+    switch (n->type) {
+    case N_SEQ:
+        for (int i = 0; i < n->nkids; i++) compile(c, n->kids[i], depth, 0);
+        if (n->nkids == 0) emit(c, OP_STATUS, 0, NULL);
+        break;
+    case N_AND:
+    case N_OR:
+        compile(c, n->kids[0], depth, 0);
+        j = emit(c, n->type == N_AND ? OP_JUMP_FAIL : OP_JUMP_OK, 0, NULL);
+        compile(c, n->kids[1], depth, 0);
+        c->insns[j].a = c->n;
+        break;
+    case N_GROUP:
+        compile(c, n->kids[0], depth, 0);
+        break;
+    case N_IF: {
+        int *ends = malloc(n->nkids * sizeof(int)), nends = 0;
+        for (int i = 0; i + 1 < n->nkids; i += 2) {
+            compile(c, n->kids[i], depth, 0);
+            j = emit(c, OP_JUMP_FAIL, 0, NULL);
+            compile(c, n->kids[i + 1], depth, 0);
+            ends[nends++] = emit(c, OP_JUMP, 0, NULL);
+            c->insns[j].a = c->n;
+        }
+        if (n->nkids % 2) compile(c, n->kids[n->nkids - 1], depth, 0);
+        else emit(c, OP_STATUS, 0, NULL); // No branch taken
+        for (int i = 0; i < nends; i++) c->insns[ends[i]].a = c->n;
+        free(ends);
+        break;
+    }
+    case N_WHILE:
+    case N_UNTIL:
+    case N_FOR:
+        if (depth + 1 > c->loops) c->loops = depth + 1;
+        loop = emit(c, OP_LOOP, 0, NULL);
+        if (n->type == N_FOR) {
+            emit(c, OP_FOR_LIST, 0, n);
+            start = j = emit(c, OP_FOR_NEXT, 0, n);
+        } else {
+            start = c->n;
+            compile(c, n->kids[0], depth + 1, 0);
+            j = emit(c, n->type == N_WHILE ? OP_JUMP_FAIL : OP_JUMP_OK, 0, NULL);
+        }
+        compile(c, n->kids[n->nkids - 1], depth + 1, 0);
+        emit(c, OP_SAVE, 0, NULL);
+        emit(c, OP_JUMP, start, NULL);
+        end = emit(c, OP_END_LOOP, 0, NULL);
+        c->insns[loop].a = end;
+        c->insns[loop].b = start;
+        c->insns[j].a = end;
+        break;
+    case N_CASE: {
+        // OP_CASE is followed by a jump per item and one for no match
+        int *ends = malloc((n->nkids + 1) * sizeof(int));
+        start = emit(c, OP_CASE, 0, n);
+        for (int i = 0; i <= n->nkids; i++) emit(c, OP_JUMP, 0, NULL);
+        for (int i = 0; i < n->nkids; i++) {
+            c->insns[start + 1 + i].a = c->n;
+            compile(c, n->kids[i]->kids[0], depth, 0);
+            ends[i] = emit(c, OP_JUMP, 0, NULL);
+        }
+        c->insns[start + 1 + n->nkids].a = c->n;
+        emit(c, OP_STATUS, 0, NULL);
+        for (int i = 0; i < n->nkids; i++) c->insns[ends[i]].a = c->n;
+        free(ends);
+        break;
+    }
+    case N_FUNC:
+        emit(c, OP_DEFUN, 0, n);
+        break;
+    default:
+        emit(c, OP_EXEC, 0, n);
+        break;
+    }
+}
+
+// Expands one word into a single string, joining any fields with spaces
+char* expand_one(char *word) {
+    char *w[2] = { word, NULL };
+    char **fields = expand_args(w);
+    struct strbuf sb = {0};
+    for (int i = 0; fields != NULL && fields[i] != NULL; i++) {
+        if (i > 0) sb_puts(&sb, " ");
+        sb_puts(&sb, fields[i]);
+    }
+    if (fields != NULL) free_args(fields);
+    if (sb.s == NULL) sb_append(&sb, "", 0);
+    return sb.s;
+}
+
+// Returns the index of the first case item with a pattern matching the
+// case word, or the number of items if none does
+static int case_match(struct node *n) {
+    char *word = expand_one(n->words[0]);
+    int i;
+    for (i = 0; i < n->nkids; i++) {
+        int match = 0;
+        for (char **pat = n->kids[i]->words; *pat != NULL && !match; pat++) {
+            char *p = expand_one(*pat);
+            match = fnmatch(p, word, 0) == 0;
+            free(p);
+        }
+        if (match) break;
+    }
+    free(word);
+    return i;
+}
+
+// A loop running in vm_run()
+struct vm_loop {
+    int brk, cont;              // Where break and continue go
+    char **list;                // Items of a for loop
+    int next;                   // Next item to assign
+    int status;                 // Status of the last body run
+};
+
+static int vm_depth = 0;        // Nested vm_run() calls; the outermost catches Ctrl-C
+
+// Leaves the innermost loop of a VM
+static void vm_pop_loop(struct vm_loop *loops, int *depth) {
+    struct vm_loop *l = &loops[--*depth];
+    if (l->list != NULL) free_args(l->list);
+    loop_depth--;
+}
+
+// Runs compiled code and returns the last status. Only OP_EXEC can run a
+// command, so it is the only place a pending break/continue/return, exit
+// or Ctrl-C has to be looked at. A break or continue reaching past the
+// loops of this code is left pending for the code that called it.
+int vm_run(struct code *code) {
+    struct vm_loop *loops = code->loops ? malloc(code->loops * sizeof(struct vm_loop)) : NULL;
+    struct sigaction sa, old_sa;
+    int depth = 0, pc = 0;
+    int outer = vm_depth++ == 0 && job_control;
+    if (outer) { // Ctrl-C stops a loop of builtins, which has no child to signal
+        sa.sa_handler = wait_sigint;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        sigaction(SIGINT, &sa, &old_sa);
+        wait_interrupted = 0;
+    }
+
+    while (pc < code->n) {
+        struct insn *in = &code->insns[pc++];
+        struct vm_loop *l = depth > 0 ? &loops[depth - 1] : NULL;
+        switch (in->op) {
+        case OP_EXEC:
+            exec_node(in->node, 0);
+            if (job_control && last_status == 128 + SIGINT) wait_interrupted = 1;
+            break;
+        case OP_JUMP:
+            pc = in->a;
+            break;
+        case OP_JUMP_OK:
+            if (last_status == 0) pc = in->a;
+            break;
+        case OP_JUMP_FAIL:
+            if (last_status != 0) pc = in->a;
+            break;
+        case OP_STATUS:
+            last_status = in->a;
+            break;
+        case OP_LOOP:
+            loops[depth++] = (struct vm_loop){ in->a, in->b, NULL, 0, 0 };
+            loop_depth++;
+            break;
+        case OP_SAVE:
+            l->status = last_status;
+            break;
+        case OP_END_LOOP:
+            last_status = l->status;
+            vm_pop_loop(loops, &depth);
+            break;
+        case OP_FOR_LIST:
+            if (in->node->has_in) {
+                l->list = expand_args(in->node->words + 1);
+                if (l->list == NULL) l->list = calloc(1, sizeof(char *));
+            } else { // for NAME alone walks the function's arguments
+                l->list = malloc((pos_count + 1) * sizeof(char *));
+                for (int i = 0; i < pos_count; i++) l->list[i] = strdup(pos_args[i]);
+                l->list[pos_count] = NULL;
+            }
+            break;
+        case OP_FOR_NEXT:
+            if (l->list[l->next] == NULL) pc = in->a;
+            else var_set(in->node->words[0], l->list[l->next++]);
+            break;
+        case OP_CASE:
+            pc += case_match(in->node);
+            break;
+        case OP_DEFUN:
+            exec_node(in->node, 0);
+            break;
+        }
+        if (in->op != OP_EXEC || !(flow || exit_requested || wait_interrupted)) continue;
+
+        if ((flow == FLOW_BREAK || flow == FLOW_CONTINUE) && depth > 0) {
+            while (flow_levels > 1 && depth > 0) {
+                vm_pop_loop(loops, &depth);
+                flow_levels--;
+            }
+            if (depth > 0) { // The loop to break or continue is one of ours
+                pc = flow == FLOW_BREAK ? loops[depth - 1].brk : loops[depth - 1].cont;
+                if (flow == FLOW_BREAK) loops[depth - 1].status = 0;
+                flow = 0;
+                continue;
+            }
+        }
+        while (depth > 0) vm_pop_loop(loops, &depth);
+        break;
+    }
+    free(loops);
+    if (--vm_depth == 0 && outer) {
+        sigaction(SIGINT, &old_sa, NULL);
+        if (wait_interrupted && last_status != 128 + SIGINT) { // Not already reported by a child
+            printf("\n");
+            last_status = 128 + SIGINT;
+        }
+        wait_interrupted = 0;
+    }
+    return last_status;
+}
+
+// Looks up a shell function by name
+struct func* find_function(const char *name) {
+    for (int i = 0; i < func_count; i++) {
+        if (strcmp(funcs[i]->name, name) == 0) return funcs[i];
+    }
+    return NULL;
+}
+
+// Frees a function that is no longer defined or running
+static void func_free(struct func *f) {
+    free(f->code.insns);
+    node_free(f->tree);
+    free(f->src);
+    free(f->name);
+    free(f);
+}
+
+// Adds a function to the table, replacing one of the same name
+static void func_install(struct func *f) {
+    for (int i = 0; i < func_count; i++) {
+        if (strcmp(funcs[i]->name, f->name) == 0) {
+            if (funcs[i]->busy) funcs[i]->dead = 1; // Freed when its last call returns
+            else func_free(funcs[i]);
+            funcs[i] = f;
+            last_status = 0;
+            return;
+        }
+    }
+    funcs = realloc(funcs, (func_count + 1) * sizeof(struct func *));
+    funcs[func_count++] = f;
+    last_status = 0;
+}
+
+// Defines (or redefines) a function from its N_FUNC node. The node points
+// into a command line that goes away, so the definition is turned back
+// into text, parsed again into storage the function owns and compiled.
+static void define_function(struct node *n) {
+    struct func *f = calloc(1, sizeof(*f));
+    f->name = strdup(n->words[0]);
+    f->src = node_text(n);
+    f->tree = parse_line(f->src, NULL);
+    if (f->tree == NULL || f->tree->nkids != 1 || f->tree->kids[0]->type != N_FUNC) {
+        fprintf(stderr, "%s: cannot define function\n", n->words[0]);
+        func_free(f);
+        last_status = 1;
+        return;
+    }
+    f->def = f->tree->kids[0];
+    compile(&f->code, f->def->kids[0], 0, 1);
+    func_install(f);
+}
+
+// Defines a function from a tree and compiled body loaded from the rc
+// snapshot, taking over both and src, the buffer the tree's words are in
+static void define_function_loaded(struct node *tree, char *src, struct code *code) {
+    struct func *f = calloc(1, sizeof(*f));
+    f->name = strdup(tree->kids[0]->words[0]);
+    f->src = src;
+    f->tree = tree;
+    f->def = tree->kids[0];
+    f->code = *code;
+    func_install(f);
+}
+
+// Runs a shell function with arglist[1...] as $1...; its loops are its
+// own, so break and continue cannot reach the caller's
+int call_function(char **arglist) {
+    struct func *f = find_function(arglist[0]);
+    int saved[2];
+    if (f == NULL) return 127;
+    if (func_depth >= FUNC_MAXDEPTH) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded\n", arglist[0]);
+        return 1;
+    }
+    char **saved_args = pos_args;
+    int saved_count = pos_count, saved_loops = loop_depth;
+    pos_args = arglist + 1;
+    for (pos_count = 0; pos_args[pos_count] != NULL; pos_count++) ;
+    loop_depth = 0;
+    func_depth++;
+    f->busy++;
+    if (redirect_apply(f->def->kids[0]->redirs, saved) == 0) {
+        vm_run(&f->code);
+        redirect_restore(saved);
+    } else {
+        last_status = 1;
+    }
+    if (flow != 0) flow = 0; // return, or a break with no loop left
+    f->busy--;
+    func_depth--;
+    loop_depth = saved_loops;
+    pos_args = saved_args;
+    pos_count = saved_count;
+    if (f->dead && f->busy == 0) func_free(f);
+    return last_status;
+}
+
+// Body of a forked subshell or compound pipeline stage: runs the tree and
+// exits with its status. Its last simple command execs in place of this
+// process when it is external, saving a fork.
+void run_subshell(struct node *n) {
+    int saved[2];
+    if (n->type == N_SUBSHELL) {
+        if (redirect_apply(n->redirs, saved) < 0) _exit(1);
+        n = n->kids[0];
+    }
+    exec_node(n, 1);
+    fflush(stdout);
+    _exit(last_status);
+}
+
+// Runs a parsed tree and returns its exit status. With tail set, the
+// process ends after this tree, so an external command may replace it.
+int exec_node(struct node *n, int tail) {
+    int saved[2];
+    switch (n->type) {
+    case N_CMD:
+        exec_tail = tail;
+        run_pipeline(&n->words, 1, 0, NULL);
+        exec_tail = 0;
+        break;
+    case N_BG:
+    case N_PIPE: {
+        struct node *p = n->type == N_BG ? n->kids[0] : n;
+        int background = n->type == N_BG;
+        if (p->type == N_CMD && background && find_function(p->words[0]) != NULL) {
+            fork_node(p, 1); // A function runs in a copy of the shell
+        } else if (p->type == N_CMD) {
+            run_pipeline(&p->words, 1, background, NULL);
+        } else if (p->type == N_PIPE) {
+            char ***stages = malloc(p->nkids * sizeof(char **));
+            struct node **nodes = NULL;
+            for (int i = 0; i < p->nkids; i++) {
+                stages[i] = p->kids[i]->words;
+                if (p->kids[i]->type != N_CMD) {
+                    if (nodes == NULL) nodes = calloc(p->nkids, sizeof(struct node *));
+                    nodes[i] = p->kids[i];
                 }
-            } else {
-                add_history(cmdline); // Add to readline history
             }
-            add_to_history(cmdline); // Add to custom history
+            run_pipeline(stages, p->nkids, background, nodes);
+            free(nodes);
+            free(stages);
+        } else {
+            fork_node(p, background); // A group, loop or list sent to the background
+        }
+        break;
+    }
+    case N_AND:
+    case N_OR:
+        exec_node(n->kids[0], 0);
+        if (!exit_requested && !flow && (last_status == 0) == (n->type == N_AND)) exec_node(n->kids[1], tail);
+        break;
+    case N_SEQ:
+        for (int i = 0; i < n->nkids && !exit_requested && !flow; i++) exec_node(n->kids[i], tail && i == n->nkids - 1);
+        break;
+    case N_GROUP:
+        if (redirect_apply(n->redirs, saved) < 0) return last_status = 1;
+        exec_node(n->kids[0], tail && n->redirs == NULL);
+        redirect_restore(saved);
+        break;
+    case N_SUBSHELL:
+        fork_node(n, 0);
+        break;
+    case N_IF:
+    case N_WHILE:
+    case N_UNTIL:
+    case N_FOR:
+    case N_CASE:
+        // Compiled on first use; a function's or loop body's nodes keep it
+        if (redirect_apply(n->redirs, saved) < 0) return last_status = 1;
+        if (n->code == NULL) {
+            n->code = calloc(1, sizeof(struct code));
+            compile(n->code, n, 0, 1);
+        }
+        vm_run(n->code);
+        redirect_restore(saved);
+        break;
+    case N_FUNC:
+        define_function(n);
+        break;
+    }
+    return last_status;
+}
+
+// Runs one command line: parses it into lists, and-or chains, pipelines,
+// groups and subshells and runs the tree. The line is modified in place;
+// returns the exit status.
+int run_command_line(char *cmdline) {
+    struct node *tree = parse_line(cmdline, NULL);
+    if (tree == NULL) return last_status = 2;
+    exec_node(tree, 0);
+    node_free(tree);
+    return last_status;
+}
+
+// dl_iterate_phdr() callback: hex-encodes the GNU build ID note of the
+// main program (always the first object reported)
+static int find_build_id(struct dl_phdr_info *info, size_t size, void *data) {
+    char *out = data;
+    (void)size;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        if (info->dlpi_phdr[i].p_type != PT_NOTE) continue;
+        const char *p = (const char *)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+        const char *end = p + info->dlpi_phdr[i].p_memsz;
+        while (p + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *nh = (const ElfW(Nhdr) *)p;
+            const unsigned char *desc = (const unsigned char *)p + sizeof(*nh) + ((nh->n_namesz + 3) & ~3);
+            if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 &&
+                memcmp(p + sizeof(*nh), "GNU", 4) == 0) {
+                for (unsigned k = 0; k < nh->n_descsz && k < 32; k++) {
+                    sprintf(out + 2 * k, "%02x", desc[k]);
+                }
+                return 1;
+            }
+            p = (const char *)desc + ((nh->n_descsz + 3) & ~3);
+        }
+    }
+    return 1; // Only the main program is of interest
+}
+
+// Returns an identifier that changes whenever the shell binary does
+static const char* shell_build_id() {
+    static char id[72];
+    if (id[0] == '\0') {
+        dl_iterate_phdr(find_build_id, id);
+        if (id[0] == '\0') snprintf(id, sizeof(id), "built %s %s", __DATE__, __TIME__);
+    }
+    return id;
+}
+
+// Appends a u32 to a snapshot buffer
+static void snap_u32(struct strbuf *sb, unsigned v) {
+    sb_append(sb, (const char *)&v, sizeof(v));
+}
+
+// Appends a word to a snapshot buffer: its length, its bytes and a NUL,
+// padded to 4 bytes
+static void snap_word(struct strbuf *sb, const char *w) {
+    unsigned len = strlen(w);
+    snap_u32(sb, len);
+    sb_append(sb, w, len + 1);
+    while (sb->len % 4) sb_append(sb, "", 1);
+}
+
+// Appends a NULL-terminated word list, or RC_NULL for none
+static void snap_words(struct strbuf *sb, char **words) {
+    unsigned n = 0;
+    if (words == NULL) {
+        snap_u32(sb, RC_NULL);
+        return;
+    }
+    while (words[n] != NULL) n++;
+    snap_u32(sb, n);
+    for (unsigned i = 0; i < n; i++) snap_word(sb, words[i]);
+}
+
+// Appends a tree in preorder, each node as its type, has_in, words, redirs,
+// whether it has code and its kids, and lists the nodes in that order
+static void snap_node(struct strbuf *sb, struct node *n, struct node ***list, int *count) {
+    *list = realloc(*list, (*count + 1) * sizeof(struct node *));
+    (*list)[(*count)++] = n;
+    snap_u32(sb, n->type);
+    snap_u32(sb, n->has_in);
+    snap_words(sb, n->words);
+    snap_words(sb, n->redirs);
+    snap_u32(sb, n->code != NULL);
+    snap_u32(sb, n->nkids);
+    for (int i = 0; i < n->nkids; i++) snap_node(sb, n->kids[i], list, count);
+}
+
+// Appends bytecode: its length and loop depth, then each instruction with
+// its node as an index into the preorder list
+static void snap_code(struct strbuf *sb, struct code *c, struct node **list, int count) {
+    snap_u32(sb, c->n);
+    snap_u32(sb, c->loops);
+    for (int i = 0; i < c->n; i++) {
+        unsigned index = RC_NULL;
+        for (int k = 0; k < count && c->insns[i].node != NULL; k++) {
+            if (list[k] == c->insns[i].node) index = k;
+        }
+        snap_u32(sb, c->insns[i].op);
+        snap_u32(sb, c->insns[i].a);
+        snap_u32(sb, c->insns[i].b);
+        snap_u32(sb, index);
+    }
+}
+
+// Appends a parsed tree with the bytecode of its nodes: the record's size,
+// whether it is a function, the nodes, the code of each node that has it
+// in preorder, and for a function (fcode set) the function's own code
+static void snap_tree(struct strbuf *sb, struct node *tree, struct code *fcode) {
+    struct node **list = NULL;
+    int count = 0;
+    size_t at = sb->len;
+    snap_u32(sb, 0); // Size, filled in below
+    snap_u32(sb, fcode != NULL);
+    snap_node(sb, tree, &list, &count);
+    for (int i = 0; i < count; i++) {
+        if (list[i]->code != NULL) snap_code(sb, list[i]->code, list, count);
+    }
+    if (fcode != NULL) snap_code(sb, fcode, list, count);
+    unsigned size = sb->len - at - 4;
+    memcpy(sb->s + at, &size, 4);
+    free(list);
+}
+
+// Reads a u32 of a stored tree, or sets *bad when none is left
+static unsigned load_u32(char **p, char *end, int *bad) {
+    unsigned v = 0;
+    if (*bad || end - *p < 4) {
+        *bad = 1;
+        return 0;
+    }
+    memcpy(&v, *p, 4);
+    *p += 4;
+    return v;
+}
+
+// Reads a word list written by snap_words(); the words stay in the buffer
+static char** load_words(char **p, char *end, int *bad) {
+    unsigned n = load_u32(p, end, bad);
+    if (*bad || n == RC_NULL) return NULL;
+    if (n > (size_t)(end - *p) / 8) { // Every word takes 8+ bytes
+        *bad = 1;
+        return NULL;
+    }
+    char **words = malloc((n + 1) * sizeof(char *));
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        unsigned len = load_u32(p, end, bad);
+        if (*bad || len >= (size_t)(end - *p) || (*p)[len] != '\0') {
+            *bad = 1;
+            break;
         }
+        words[i] = *p;
+        *p += (len + 1 + 3) & ~3;
+    }
+    words[i] = NULL;
+    return words;
+}
+
+// Reads a node and its kids written by snap_node(), listing them in
+// preorder; a node with code gets an empty one, filled in by load_code()
+static struct node* load_node(char **p, char *end, int *bad, struct node ***list, int *count) {
+    struct node *n = calloc(1, sizeof(*n));
+    *list = realloc(*list, (*count + 1) * sizeof(struct node *));
+    (*list)[(*count)++] = n;
+    n->type = load_u32(p, end, bad);
+    n->has_in = load_u32(p, end, bad);
+    n->words = load_words(p, end, bad);
+    n->redirs = load_words(p, end, bad);
+    if (load_u32(p, end, bad)) n->code = calloc(1, sizeof(struct code));
+    unsigned nkids = load_u32(p, end, bad);
+    if (n->type > N_FUNC || nkids > (size_t)(end - *p) / 24) *bad = 1; // A node takes 24+ bytes
+    if (*bad) return n;
+    if (nkids > 0) n->kids = calloc(nkids, sizeof(struct node *));
+    for (unsigned i = 0; i < nkids && !*bad; i++) {
+        n->kids[i] = load_node(p, end, bad, list, count);
+        n->nkids = i + 1;
+    }
+    return n;
+}
+
+// Reads bytecode written by snap_code(), checking its jumps and nodes
+static void load_code(char **p, char *end, int *bad, struct code *c, struct node **list, int count) {
+    unsigned n = load_u32(p, end, bad), loops = load_u32(p, end, bad);
+    if (*bad || n > (size_t)(end - *p) / 16 || loops > (unsigned)count) {
+        *bad = 1;
+        return;
+    }
+    c->insns = malloc((n ? n : 1) * sizeof(struct insn));
+    c->n = c->cap = n;
+    c->loops = loops;
+    for (unsigned i = 0; i < n; i++) {
+        unsigned op = load_u32(p, end, bad), a = load_u32(p, end, bad);
+        unsigned b = load_u32(p, end, bad), index = load_u32(p, end, bad);
+        if (a > n || b > n || (index != RC_NULL && index >= (unsigned)count)) *bad = 1;
+        if (*bad) return;
+        c->insns[i] = (struct insn){ op, a, b, index == RC_NULL ? NULL : list[index] };
+    }
+}
 
-        // Parse the command for pipelines and execute
-        char *pipe_cmds[MAXARGS];
-        int num_cmds = 0;
-        char *token = strtok(cmdline, "|");
-        while (token && num_cmds < MAXARGS) {
-            while (*token == ' ') token++;
-            char *end = token + strlen(token) - 1;
-            while (end > token && *end == ' ') end--;
-            *(end + 1) = '\0';
+// Rebuilds a tree written by snap_tree() from buf, whose words it then
+// points into. For a function, *fcode gets its code and *func is set.
+// Returns NULL if the record is corrupt.
+static struct node* load_tree(char *buf, size_t size, int *func, struct code *fcode) {
+    char *p = buf, *end = buf + size;
+    struct node **list = NULL;
+    int bad = 0, count = 0;
+    *func = load_u32(&p, end, &bad);
+    struct node *tree = load_node(&p, end, &bad, &list, &count);
+    for (int i = 0; i < count && !bad; i++) {
+        if (list[i]->code != NULL) load_code(&p, end, &bad, list[i]->code, list, count);
+    }
+    if (*func && !bad) {
+        load_code(&p, end, &bad, fcode, list, count);
+        if (tree->nkids != 1 || tree->kids[0]->type != N_FUNC ||
+            tree->kids[0]->words == NULL || tree->kids[0]->words[0] == NULL) bad = 1;
+    }
+    free(list);
+    if (bad) {
+        node_free(tree);
+        free(fcode->insns);
+        return NULL;
+    }
+    return tree;
+}
 
-            pipe_cmds[num_cmds++] = token;
-            token = strtok(NULL, "|");
+// Parses the rc file text, running each command line as it goes and
+// recording the parsed form in snap (after its header)
+static int rc_parse_and_run(char *text, struct strbuf *snap) {
+    int lines = 0;
+    for (char *line = text, *next; line != NULL; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        while (*line == ' ' || *line == '\t') line++;
+        if (*line == '\0' || *line == '#') continue; // Blank lines and comments
+        struct line_scan scan = {0};
+        int kind;
+        while (next != NULL && (kind = input_incomplete(line, &scan)) != 0) {
+            char *more = next; // Join the continuation line in place
+            next = strchr(more, '\n');
+            if (next) *next++ = '\0';
+            size_t len = scan.pos; // The end, or the trailing backslash
+            if (kind == 1) memmove(line + len, more, strlen(more) + 1);
+            else line[len] = kind == 3 ? ' ' : '\n';
         }
 
-        // Handle pipeline execution or a single command
-        if (num_cmds > 1) {
-            char **cmds[MAXARGS];
+        // A single command or pipeline, maybe with &, is stored as its
+        // stages. Anything else is stored as its tree once it has run, with
+        // the bytecode compiled while running it; a function definition is
+        // stored as the function's own tree and code. Only a line that does
+        // not parse keeps its text, so that its error is reported again.
+        char *text = strdup(line);
+        struct node *tree = parse_line(line, NULL), *p = NULL;
+        if (tree != NULL && tree->nkids == 1) p = tree->kids[0];
+        if (p != NULL && p->type == N_BG) p = p->kids[0];
+        int simple = p != NULL && (p->type == N_CMD || p->type == N_PIPE);
+        for (int i = 0; simple && p->type == N_PIPE && i < p->nkids; i++) {
+            if (p->kids[i]->type != N_CMD) simple = 0;
+        }
+        if (tree == NULL) {
+            snap_u32(snap, RC_COMPOUND);
+            snap_u32(snap, 1);
+            snap_word(snap, text);
+            last_status = 2;
+        } else if (!simple) {
+            exec_node(tree, 0);
+            struct func *f = p != NULL && p->type == N_FUNC && last_status == 0 ? find_function(p->words[0]) : NULL;
+            snap_u32(snap, RC_TREE);
+            if (f != NULL) snap_tree(snap, f->tree, &f->code);
+            else snap_tree(snap, tree, NULL);
+        } else {
+            int num_cmds = p->type == N_PIPE ? p->nkids : 1;
+            snap_u32(snap, num_cmds);
             for (int i = 0; i < num_cmds; i++) {
-                cmds[i] = tokenize(pipe_cmds[i]);
+                char **words = p->type == N_PIPE ? p->kids[i]->words : p->words;
+                int n = 0, bg = i == num_cmds - 1 && tree->kids[0]->type == N_BG;
+                while (words[n] != NULL) n++;
+                snap_u32(snap, n + bg);
+                for (int j = 0; j < n + bg; j++) snap_word(snap, j < n ? words[j] : "&");
             }
-            execute_pipeline(cmds, num_cmds);
-            for (int i = 0; i < num_cmds; i++) {
-                for (int j = 0; cmds[i][j] != NULL; j++) free(cmds[i][j]);
-                free(cmds[i]);
+            exec_node(tree, 0);
+        }
+        lines++;
+        node_free(tree);
+        free(text);
+        if (exit_requested) break;
+    }
+    return lines;
+}
+
+// Runs the command lines stored in a snapshot straight from the mapping,
+// without reading or tokenizing the rc file; returns -1 if it is corrupt
+static int rc_run_snapshot(const char *map, size_t size) {
+    const struct rc_snapshot *hdr = (const struct rc_snapshot *)map;
+    const char *p = map + sizeof(*hdr), *end = map + size;
+
+    for (unsigned l = 0; l < hdr->nlines; l++) {
+        unsigned num_cmds, built = 0;
+        int bad = 0;
+        if (p + 4 > end) return -1;
+        memcpy(&num_cmds, p, 4);
+        p += 4;
+        if (num_cmds == RC_COMPOUND) { // Text that did not parse; reports the error again
+            unsigned n, len;
+            if (p + 8 > end) return -1;
+            memcpy(&n, p, 4);
+            memcpy(&len, p + 4, 4);
+            if (n != 1 || len > (size_t)(end - p) - 9) return -1;
+            char *text = strndup(p + 8, len);
+            p += (8 + len + 1 + 3) & ~3;
+            run_command_line(text);
+            free(text);
+            if (exit_requested) break;
+            continue;
+        }
+        if (num_cmds == RC_TREE) { // A tree and its bytecode, run without parsing
+            struct code fcode = {0};
+            unsigned size;
+            int func;
+            if (p + 4 > end) return -1;
+            memcpy(&size, p, 4);
+            p += 4;
+            if (size > (size_t)(end - p)) return -1;
+            char *buf = malloc(size ? size : 1); // The mapping goes away, a function stays
+            memcpy(buf, p, size);
+            p += size;
+            struct node *tree = load_tree(buf, size, &func, &fcode);
+            if (tree == NULL) {
+                free(buf);
+                return -1;
             }
-        } else {
-            arglist = tokenize(cmdline);
-            int background = 0;
-            for (int i = 0; arglist[i] != NULL; i++) {
-                if (strcmp(arglist[i], "&") == 0) {
-                    background = 1;
-                    free(arglist[i]);
-                    arglist[i] = NULL;
-                    break;
-                }
+            if (func) {
+                define_function_loaded(tree, buf, &fcode);
+            } else {
+                exec_node(tree, 0);
+                node_free(tree);
+                free(buf);
             }
-            if (strcmp(arglist[0], "exit") == 0) {
-                break;
+            if (exit_requested) break;
+            continue;
+        }
+        if (num_cmds > (size_t)(end - p) / 4) return -1; // Every stage takes 4+ bytes
+        char ***stages = malloc(num_cmds * sizeof(char **));
+        for (; built < num_cmds && !bad; built++) {
+            unsigned n;
+            if (p + 4 > end) { bad = 1; break; }
+            memcpy(&n, p, 4);
+            p += 4;
+            if (n > (size_t)(end - p) / 4) { bad = 1; break; }
+            stages[built] = malloc((n + 1) * sizeof(char *));
+            for (unsigned j = 0; j < n; j++) {
+                unsigned len;
+                if (p + 4 > end) { bad = 1; n = j; break; }
+                memcpy(&len, p, 4);
+                if (p + 4 + len + 1 > end) { bad = 1; n = j; break; }
+                stages[built][j] = (char *)p + 4; // Points into the mapping
+                p += (4 + len + 1 + 3) & ~3;
             }
-            if (strcmp(arglist[0], "cd") == 0 || strcmp(arglist[0], "jobs") == 0 ||
-                strcmp(arglist[0], "kill") == 0 || strcmp(arglist[0], "help") == 0) {
-                handle_builtins(arglist);
-            } else {
-                execute(arglist, background);
+            stages[built][n] = NULL;
+        }
+        if (!bad) run_stages(stages, num_cmds);
+        for (unsigned i = 0; i < built; i++) free(stages[i]);
+        free(stages);
+        if (bad) return -1;
+        if (exit_requested) break;
+    }
+    return hdr->nlines;
+}
+
+// Runs ~/.pucitshrc, using the parsed snapshot when it matches the rc
+// file's mtime and size and this shell build; otherwise parses the file
+// and rewrites the snapshot. Returns the number of command lines run.
+int load_rc(int *from_snapshot) {
+    const char *home = getenv("HOME");
+    char rc[PATH_MAX], snap_path[PATH_MAX], tmp[PATH_MAX + 16];
+    struct stat st, sst;
+    *from_snapshot = 0;
+    if (home == NULL) return 0;
+    snprintf(rc, sizeof(rc), "%s/" RC_FILE, home);
+    snprintf(snap_path, sizeof(snap_path), "%s/" RC_SNAPSHOT, home);
+    if (stat(rc, &st) < 0) return 0;
+
+    // Try the snapshot first
+    int fd = open(snap_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &sst) == 0 && sst.st_size >= (off_t)sizeof(struct rc_snapshot)) {
+        char *map = mmap(NULL, sst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        fd = -1;
+        if (map != MAP_FAILED) {
+            const struct rc_snapshot *hdr = (const struct rc_snapshot *)map;
+            int lines = -1;
+            if (memcmp(hdr->magic, RC_MAGIC, 8) == 0 &&
+                strncmp(hdr->build_id, shell_build_id(), sizeof(hdr->build_id)) == 0 &&
+                hdr->rc_mtime_sec == (long long)st.st_mtim.tv_sec &&
+                hdr->rc_mtime_nsec == (long long)st.st_mtim.tv_nsec &&
+                hdr->rc_size == (long long)st.st_size && hdr->size == (unsigned)sst.st_size) {
+                lines = rc_run_snapshot(map, sst.st_size);
+            }
+            munmap(map, sst.st_size);
+            if (lines >= 0) {
+                *from_snapshot = 1;
+                return lines;
+            }
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    // Parse the rc file itself
+    FILE *fp = fopen(rc, "r");
+    if (fp == NULL) return 0;
+    struct strbuf text = {0}, snap = {0};
+    char buf[4096];
+    size_t n;
+    sb_append(&text, "", 0);
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) sb_append(&text, buf, n);
+    fclose(fp);
+
+    struct rc_snapshot hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    sb_append(&snap, (const char *)&hdr, sizeof(hdr));
+    int lines = rc_parse_and_run(text.s, &snap);
+
+    // Write the snapshot atomically so concurrent shells never see half of it
+    if (!exit_requested) {
+        memcpy(hdr.magic, RC_MAGIC, 8);
+        snprintf(hdr.build_id, sizeof(hdr.build_id), "%s", shell_build_id());
+        hdr.rc_mtime_sec = st.st_mtim.tv_sec;
+        hdr.rc_mtime_nsec = st.st_mtim.tv_nsec;
+        hdr.rc_size = st.st_size;
+        hdr.nlines = lines;
+        hdr.size = snap.len;
+        memcpy(snap.s, &hdr, sizeof(hdr));
+        snprintf(tmp, sizeof(tmp), "%s.%d", snap_path, getpid());
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            int ok = write(fd, snap.s, snap.len) == (ssize_t)snap.len;
+            close(fd);
+            if (!ok || rename(tmp, snap_path) < 0) unlink(tmp);
+        }
+    }
+    free(text.s);
+    free(snap.s);
+    return lines;
+}
+
+// Returns milliseconds elapsed since a CLOCK_MONOTONIC timestamp
+static double ms_since(const struct timespec *t0) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - t0->tv_sec) * 1e3 + (t.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+// Receives one session request, storing any passed fds in fds[0..2];
+// returns its length, 0 at end of session or -1 on error
+static ssize_t session_recv(int conn, char *buf, size_t cap, int *fds, int *nfds) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { buf, cap - 1 };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) return n;
+    *nfds = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                if (*nfds < 3) fds[(*nfds)++] = fd;
+                else close(fd);
+            }
+        }
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        for (int i = 0; i < *nfds; i++) close(fds[i]);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+// Runs one client session in a child forked from the server. The first
+// request ("S" + cwd) carries the client's stdin, stdout and stderr; each
+// following "C" + command line is run through run_command_line() and
+// answered with its exit status. The session keeps its own cwd, variables,
+// history and job table because it is a process of its own.
+static void serve_session(int conn) {
+    char *buf = malloc(SESSION_MSG);
+    int fds[3], nfds;
+
+    job_control_off(); // The client's terminal is not ours to hand out
+
+    // The forked session needs its own SIGCHLD wakeup pipe and ring
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    child_head = child_tail = 0;
+    setup_signals();
+
+    ssize_t n = session_recv(conn, buf, SESSION_MSG, fds, &nfds);
+    if (n <= 0 || buf[0] != 'S' || nfds != 3) {
+        fprintf(stderr, "pucitsh: session %d: bad handshake\n", getpid());
+        _exit(1);
+    }
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        if (fds[i] > 2) close(fds[i]);
+    }
+    if (buf[1] && chdir(buf + 1) < 0) perror(buf + 1);
+
+    while (!exit_requested) {
+        struct pollfd pfd[2 + MAXJOBS] = {
+            { conn, POLLIN, 0 },
+            { sigchld_pipe[0], POLLIN, 0 },
+        };
+        int nfds = 2 + job_output_fds(pfd + 2, MAXJOBS);
+        if (poll(pfd, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (nfds > 2) job_output_drain();
+        if (pfd[1].revents & POLLIN) drain_child_events(0);
+        if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        n = session_recv(conn, buf, SESSION_MSG, fds, &nfds);
+        if (n == 0) break; // Client closed the session
+        if (n < 0) {
+            perror("session recvmsg");
+            last_status = 2;
+        } else if (buf[0] == 'C') {
+            for (int i = 0; i < nfds; i++) close(fds[i]);
+            if (buf[1]) add_to_history(buf + 1);
+            run_command_line(buf + 1);
+        }
+        fflush(stdout);
+        if (send(conn, &last_status, sizeof(last_status), MSG_NOSIGNAL) < 0) break;
+    }
+    _exit(last_status);
+}
+
+// Listens on a Unix socket and serves each client session from a forked
+// copy of this already initialized shell; never returns unless setup fails
+int run_server(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "pucitsh: socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(path); // Replace a socket left behind by an earlier server
+    mode_t old_mask = umask(077); // Sessions run as us, so only we may connect
+    int rc = bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (rc < 0 || listen(lfd, 64) < 0) {
+        perror(path);
+        close(lfd);
+        return 1;
+    }
+    fprintf(stderr, "pucitsh: serving sessions on %s\n", path);
+
+    while (1) {
+        struct pollfd pfd[2] = {
+            { lfd, POLLIN, 0 },
+            { sigchld_pipe[0], POLLIN, 0 },
+        };
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
+        }
+        if (pfd[1].revents & POLLIN) drain_child_events(0); // Reap finished sessions
+        if (!(pfd[0].revents & POLLIN)) continue;
+
+        int conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) perror("accept");
+            continue;
+        }
+        fflush(stdout); // Do not hand buffered rc output to every session
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(lfd);
+            serve_session(conn);
+        }
+        if (pid < 0) perror("fork failed");
+        close(conn);
+    }
+    close(lfd);
+    unlink(path);
+    return 1;
+}
+
+// Default server socket: $PUCITSH_SOCKET, else one per user under /tmp
+static const char* default_socket() {
+    static char path[108];
+    const char *env = getenv("PUCITSH_SOCKET");
+    if (env != NULL && *env) return env;
+    snprintf(path, sizeof(path), "/tmp/pucitsh-%d.sock", (int)getuid());
+    return path;
+}
+
+// A session log (--record) holds one tab-separated record per command line:
+//   C <start ms> <wall clock> <latency ms> <status> <cwd> <line>
+// followed by the environment changes the line made, E NAME=VALUE for set
+// and U NAME for unset. Fields escape tab, newline and backslash.
+#define SESSION_LOG_MAGIC "# pucitsh session 1"
+
+struct session_log {
+    FILE *fp;                   // Log being written, or NULL
+    struct timespec start;      // When recording began
+    char **env;                 // Sorted copy of environ after the last line
+    int env_count;
+};
+static struct session_log session_log = { NULL, {0, 0}, NULL, 0 };
+
+// One command of a session being replayed
+struct replay_cmd {
+    char *line;                 // Command line as it was typed
+    char *cwd;                  // Directory it started in
+    char *env;                  // Its E and U lines, sorted, or ""
+    double start_ms;            // When it started, from the start of the session
+    double latency_ms;          // How long it took when recorded
+    int status;                 // Exit status when recorded
+    double replay_ms;           // How long it took this time, -1 if not run
+    int replay_status;
+    int diverged;               // Bits: 1 status, 2 cwd, 4 environment
+};
+
+struct replay {
+    struct replay_cmd *cmds;
+    int count, next;
+    int paced;                  // Keep the recorded gaps between commands
+    struct timespec start;      // When replaying began
+};
+static struct replay *replay = NULL; // Session being replayed by --replay, or NULL
+static char **env_snapshot = NULL;   // Sorted environ after the last replayed line
+static int env_snapshot_count = 0;
+
+// Writes a log field with tab, newline and backslash escaped
+static void log_field(struct strbuf *sb, const char *s) {
+    for (; *s; s++) {
+        if (*s == '\t') sb_append(sb, "\\t", 2);
+        else if (*s == '\n') sb_append(sb, "\\n", 2);
+        else if (*s == '\\') sb_append(sb, "\\\\", 2);
+        else sb_append(sb, s, 1);
+    }
+}
+
+// Undoes log_field() in place
+static char* log_unescape(char *s) {
+    char *out = s;
+    for (char *p = s; *p; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+            *out++ = *p == 't' ? '\t' : *p == 'n' ? '\n' : *p;
+        } else {
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+    return s;
+}
+
+static int env_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Appends the E and U lines that turn the sorted snapshot *env into the
+// current environment, then makes the snapshot current. Unchanged
+// environments cost one sort and a compare per variable. LINES and
+// COLUMNS follow the terminal readline runs on, not the session, so they
+// are left out.
+static void env_delta(char ***env, int *count, struct strbuf *out) {
+    int n = 0;
+    for (char **e = environ; *e != NULL; e++) n++;
+    char **now = malloc((n + 1) * sizeof(char *));
+    n = 0;
+    for (char **e = environ; *e != NULL; e++) {
+        if (strncmp(*e, "LINES=", 6) != 0 && strncmp(*e, "COLUMNS=", 8) != 0) now[n++] = *e;
+    }
+    qsort(now, n, sizeof(char *), env_cmp);
+
+    int i = 0, j = 0, changed = 0;
+    while (i < *count || j < n) {
+        const char *old = i < *count ? (*env)[i] : NULL, *cur = j < n ? now[j] : NULL;
+        size_t olen = old ? strcspn(old, "=") : 0, clen = cur ? strcspn(cur, "=") : 0;
+        int c = old == NULL ? 1 : cur == NULL ? -1 : strncmp(old, cur, olen < clen ? olen : clen);
+        if (c == 0 && olen != clen) c = olen < clen ? -1 : 1;
+        if (c == 0) { // Same name
+            if (strcmp(old, cur) != 0) {
+                sb_append(out, "E\t", 2);
+                log_field(out, cur);
+                sb_append(out, "\n", 1);
+                changed = 1;
+            }
+            i++;
+            j++;
+        } else if (c < 0) { // Unset
+            sb_append(out, "U\t", 2);
+            sb_append(out, old, olen);
+            sb_append(out, "\n", 1);
+            changed = 1;
+            i++;
+        } else { // New
+            sb_append(out, "E\t", 2);
+            log_field(out, cur);
+            sb_append(out, "\n", 1);
+            changed = 1;
+            j++;
+        }
+    }
+    if (changed || *env == NULL) {
+        for (i = 0; i < *count; i++) free((*env)[i]);
+        free(*env);
+        for (j = 0; j < n; j++) now[j] = strdup(now[j]);
+        *env = now;
+        *count = n;
+    } else {
+        free(now);
+    }
+}
+
+// Starts --record: the log gets a header with the starting directory and
+// environment is snapshotted so only changes are logged
+static int record_open(const char *path) {
+    session_log.fp = fopen(path, "w");
+    if (session_log.fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(session_log.fp, "%s\n", SESSION_LOG_MAGIC);
+    struct strbuf sb = {0};
+    env_delta(&session_log.env, &session_log.env_count, &sb); // Just takes the snapshot
+    free(sb.s);
+    clock_gettime(CLOCK_MONOTONIC, &session_log.start);
+    return 0;
+}
+
+// Logs one command line once it has run
+static void record_command(const char *line, const char *cwd, const struct timespec *t0,
+                           double latency_ms, int status) {
+    struct strbuf sb = {0};
+    char num[128];
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    double start_ms = (t0->tv_sec - session_log.start.tv_sec) * 1e3 +
+                      (t0->tv_nsec - session_log.start.tv_nsec) / 1e6;
+    int n = snprintf(num, sizeof(num), "C\t%.3f\t%lld.%03ld\t%.3f\t%d\t", start_ms,
+                     (long long)wall.tv_sec, wall.tv_nsec / 1000000, latency_ms, status);
+    sb_append(&sb, num, n);
+    log_field(&sb, cwd);
+    sb_append(&sb, "\t", 1);
+    log_field(&sb, line);
+    sb_append(&sb, "\n", 1);
+    env_delta(&session_log.env, &session_log.env_count, &sb);
+    fwrite(sb.s, 1, sb.len, session_log.fp);
+    fflush(session_log.fp); // Keep what ran even if the shell is killed
+    free(sb.s);
+}
+
+// Loads a session log for --replay
+static struct replay* replay_open(const char *path, int paced) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return NULL;
+    }
+    struct replay *r = calloc(1, sizeof(struct replay));
+    r->paced = paced;
+    char *buf = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    struct strbuf env = {0};
+    int lineno = 0, bad = 0;
+    while ((len = getline(&buf, &cap, fp)) > 0) {
+        lineno++;
+        if (buf[len - 1] == '\n') buf[--len] = '\0';
+        if (lineno == 1 && strcmp(buf, SESSION_LOG_MAGIC) == 0) continue;
+        if ((buf[0] == 'E' || buf[0] == 'U') && buf[1] == '\t' && r->count > 0) {
+            sb_append(&env, buf, len);
+            sb_append(&env, "\n", 1);
+            continue;
+        }
+        char *f[7];
+        int nf = 0;
+        for (char *p = buf; nf < 7; p++) {
+            f[nf++] = p;
+            if ((p = strchr(p, '\t')) == NULL) break;
+            *p = '\0';
+        }
+        if (nf != 7 || strcmp(f[0], "C") != 0) {
+            fprintf(stderr, "%s:%d: not a session record\n", path, lineno);
+            bad = 1;
+            break;
+        }
+        if (r->count > 0) r->cmds[r->count - 1].env = env.s ? strdup(env.s) : strdup("");
+        env.len = 0;
+        if (env.s) env.s[0] = '\0';
+        r->cmds = realloc(r->cmds, (r->count + 1) * sizeof(struct replay_cmd));
+        struct replay_cmd *c = &r->cmds[r->count++];
+        c->start_ms = atof(f[1]);
+        c->latency_ms = atof(f[3]);
+        c->status = atoi(f[4]);
+        c->cwd = strdup(log_unescape(f[5]));
+        c->line = strdup(log_unescape(f[6]));
+        c->env = NULL;
+        c->replay_ms = -1;
+        c->diverged = 0;
+    }
+    if (r->count > 0) r->cmds[r->count - 1].env = env.s ? strdup(env.s) : strdup("");
+    free(env.s);
+    free(buf);
+    fclose(fp);
+    if (bad || r->count == 0) {
+        if (!bad) fprintf(stderr, "%s: no commands recorded\n", path);
+        return NULL; // Exits right away, so nothing is freed
+    }
+
+    // Start where the recording started, with the environment snapshotted
+    if (chdir(r->cmds[0].cwd) < 0) perror(r->cmds[0].cwd);
+    struct strbuf sb = {0};
+    env_delta(&env_snapshot, &env_snapshot_count, &sb);
+    free(sb.s);
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    return r;
+}
+
+// Hands the main loop the next recorded line, or NULL at the end. Paced
+// replay first sleeps until the line is as far into the session as it was
+// when recorded.
+static char* replay_next(struct replay *r) {
+    if (r->next == r->count) return NULL;
+    struct replay_cmd *c = &r->cmds[r->next];
+    if (r->paced) {
+        double wait = c->start_ms - ms_since(&r->start);
+        if (wait > 0) {
+            long long us = (long long)(wait * 1e3);
+            struct timespec ts = { us / 1000000, us % 1000000 * 1000 };
+            while (nanosleep(&ts, &ts) < 0 && errno == EINTR) ;
+        }
+    }
+    return strdup(c->line);
+}
+
+// Compares the line that just ran with its recording
+static void replay_check(struct replay *r, const char *cwd, double latency_ms, int status) {
+    struct replay_cmd *c = &r->cmds[r->next++];
+    struct strbuf env = {0};
+    c->replay_ms = latency_ms;
+    c->replay_status = status;
+    if (status != c->status) c->diverged |= 1;
+    if (strcmp(cwd, c->cwd) != 0) c->diverged |= 2;
+    env_delta(&env_snapshot, &env_snapshot_count, &env);
+    if (strcmp(env.s ? env.s : "", c->env) != 0) c->diverged |= 4;
+    free(env.s);
+}
+
+// Prints the per-command latency comparison on stderr; returns 1 if any
+// command diverged from the recording
+static int replay_report(struct replay *r) {
+    double rec_total = 0, rep_total = 0;
+    int diverged = 0, ran = 0;
+    fprintf(stderr, "%5s %11s %11s %8s  %-7s %s\n", "#", "recorded", "replayed", "delta", "status", "command");
+    for (int i = 0; i < r->count; i++) {
+        struct replay_cmd *c = &r->cmds[i];
+        if (c->replay_ms < 0) continue; // Not reached, e.g. after exit
+        char status[48], delta[16] = "-", line[64];
+        if (c->diverged & 1) snprintf(status, sizeof(status), "%d!=%d", c->replay_status, c->status);
+        else snprintf(status, sizeof(status), "%d", c->status);
+        if (c->diverged & 2) strcat(status, " cwd");
+        if (c->diverged & 4) strcat(status, " env");
+        if (c->latency_ms > 0) snprintf(delta, sizeof(delta), "%+.1f%%", (c->replay_ms / c->latency_ms - 1) * 100);
+        // First line of the command, shortened
+        snprintf(line, sizeof(line), "%.*s", (int)strcspn(c->line, "\n"), c->line);
+        fprintf(stderr, "%5d %8.3f ms %8.3f ms %8s  %-7s %s\n", i + 1, c->latency_ms, c->replay_ms,
+                delta, status, line);
+        rec_total += c->latency_ms;
+        rep_total += c->replay_ms;
+        diverged += c->diverged != 0;
+        ran++;
+    }
+    fprintf(stderr, "replay: %d of %d commands, %.3f ms recorded, %.3f ms replayed (%+.1f%%), %d diverged\n",
+            ran, r->count, rec_total, rep_total, rec_total > 0 ? (rep_total / rec_total - 1) * 100 : 0.0,
+            diverged);
+    return diverged > 0;
+}
+
+// What --leak-check measures before and after a run of commands
+struct leak_usage {
+    long long heap;             // Bytes malloc'd and not yet freed
+    int fds;                    // Open descriptors
+    int children;               // Child processes, reaped or not; -1 if unknown
+};
+
+static void leak_measure(struct leak_usage *u) {
+    u->heap = mallinfo2().uordblks; // First, before opendir() allocates
+    u->fds = -1; // Not counting the one reading the directory
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *e;
+    while (dir != NULL && (e = readdir(dir)) != NULL) u->fds += e->d_name[0] != '.';
+    if (dir != NULL) closedir(dir);
+
+    char path[64], buf[4096];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/children", (int)getpid());
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+    if (fd >= 0) close(fd);
+    u->children = n < 0 ? -1 : 0;
+    for (ssize_t i = 0; i < n; i++) u->children += buf[i] == ' '; // "pid pid "
+}
+
+// Runs a line the way the main loop does, with !N expanded from history
+static void leak_run(const char *text, int history) {
+    char *line = strdup(text);
+    if (history) {
+        char *expanded = fetch_from_history(line);
+        free(line);
+        if ((line = expanded) == NULL) return;
+        add_to_history(line);
+    }
+    run_command_line(line);
+    free(line);
+}
+
+// --leak-check [N]: runs N command lines of each kind (after a warm-up
+// that lets caches and the history ring reach their steady size) with
+// stdout sent to /dev/null, and reports how heap bytes in use, open fds
+// and child processes grew. Returns 1 if any of them did not come back to
+// where it started. Under the ASan build LeakSanitizer checks the heap at
+// exit as well.
+static int leak_check(int runs) {
+    char tmp[] = "/tmp/pucitsh-leak-XXXXXX";
+    int tmp_fd = mkstemp(tmp);
+    if (tmp_fd < 0) {
+        perror("mkstemp");
+        return 2;
+    }
+    close(tmp_fd);
+    char redirected[128];
+    snprintf(redirected, sizeof(redirected), "echo x > %s; cat < %s > /dev/null", tmp, tmp);
+    struct { const char *kind, *line; int history, warmup; } tests[] = {
+        { "simple", "/bin/true", 0, 50 },
+        { "redirected", redirected, 0, 50 },
+        { "pipeline", "echo x | cat | cat", 0, 50 },
+        { "background", "/bin/true & wait", 0, 50 },
+        { "history", "!-1", 1, HIST_SIZE + 10 }, // Until the ring has wrapped
+    };
+
+    int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int failed = 0;
+    fprintf(stderr, "%-11s %8s %11s %11s %5s %9s\n", "kind", "commands", "heap bytes", "per command", "fds", "children");
+    for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+        if (tests[t].history) add_to_history("echo replayed > /dev/null");
+        fflush(stdout);
+        dup2(null_fd, STDOUT_FILENO);
+        for (int i = 0; i < tests[t].warmup; i++) leak_run(tests[t].line, tests[t].history);
+
+        // Background jobs must have been reaped and dropped on both sides
+        struct leak_usage before, after;
+        int jobs = job_count;
+        drain_child_events(0);
+        fflush(stdout);
+        leak_measure(&before);
+        for (int i = 0; i < runs; i++) leak_run(tests[t].line, tests[t].history);
+        for (int wait = 0; wait < 200; wait++) {
+            drain_child_events(0);
+            leak_measure(&after);
+            if (job_count <= jobs && after.children <= before.children) break;
+            poll(NULL, 0, 10);
+        }
+        fflush(stdout);
+        leak_measure(&after);
+        dup2(saved_out, STDOUT_FILENO);
+
+        long long heap = after.heap - before.heap;
+        int fds = after.fds - before.fds;
+        int children = after.children - before.children;
+        int ok = heap <= 0 && fds <= 0 && children <= 0;
+        failed |= !ok;
+        fprintf(stderr, "%-11s %8d %+11lld %11.3f %+5d %+9d  %s\n", tests[t].kind, runs, heap,
+                (double)heap / runs, fds, children, ok ? "ok" : "LEAK");
+    }
+    close(null_fd);
+    close(saved_out);
+    unlink(tmp);
+    return failed;
+}
+
+// Main function to initialize shell and handle command input
+int main(int argc, char *argv[]) {
+    struct timespec t_start;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    int startup_stats = 0, use_rc = 1, paced = 0, leak_runs = 0;
+    const char *server_path = NULL, *record_path = NULL, *replay_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--startup-stats") == 0) startup_stats = 1;
+        else if (strcmp(argv[i], "--norc") == 0) use_rc = 0;
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) record_path = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replay_path = argv[++i];
+        else if (strcmp(argv[i], "--paced") == 0) paced = 1;
+        else if (strcmp(argv[i], "--leak-check") == 0) {
+            // The number of commands of each kind is optional
+            leak_runs = (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) ? atoi(argv[++i]) : 1000;
+        }
+        else if (strcmp(argv[i], "--server") == 0) {
+            // The socket path is optional
+            server_path = (i + 1 < argc && argv[i + 1][0] != '-') ? argv[++i] : default_socket();
+        } else {
+            fprintf(stderr, "Usage: %s [--norc] [--startup-stats] [--server [SOCKET]]\n"
+                    "       [--record FILE] [--replay FILE [--paced]] [--leak-check [N]]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    setup_signals(); // Set up signal handling for background processes
+    setup_job_control();
+    memset(history, -1, sizeof(history)); // Initialize history buffer
+
+    // Arrow-key recall reads the interned history, so readline keeps no copy
+    rl_bind_keyseq("\\e[A", history_recall_prev);
+    rl_bind_keyseq("\\e[B", history_recall_next);
+    rl_bind_keyseq("\\eOA", history_recall_prev);
+    rl_bind_keyseq("\\eOB", history_recall_next);
+    rl_bind_key(CTRL('P'), history_recall_prev);
+    rl_bind_key(CTRL('N'), history_recall_next);
+
+    // Inline suggestions from the history, accepted with the right arrow
+    autosuggest = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    rl_redisplay_function = suggest_redisplay;
+    rl_bind_keyseq("\\e[C", suggest_accept);
+    rl_bind_keyseq("\\eOC", suggest_accept);
+    rl_bind_key('\r', suggest_accept_line);
+    rl_bind_key('\n', suggest_accept_line);
+
+    char *cmdline;
+    char *prompt = NULL;
+    char hostname[HOST_NAME_MAX];
+    char cwd[PATH_MAX];
+    char *username = getenv("USER");
+    if (username == NULL) username = "unknown";
+
+    gethostname(hostname, HOST_NAME_MAX); // Get hostname for prompt
+
+    // Run the startup file, preferably from its parsed snapshot
+    double init_ms = ms_since(&t_start);
+    int from_snapshot = 0, rc_lines = use_rc ? load_rc(&from_snapshot) : 0;
+    if (startup_stats) {
+        double total_ms = ms_since(&t_start);
+        fprintf(stderr, "startup: %.3f ms (init %.3f ms, rc %.3f ms: %d commands %s)\n",
+                total_ms, init_ms, total_ms - init_ms, rc_lines,
+                !use_rc ? "skipped" : from_snapshot ? "from snapshot" : "parsed");
+    }
+    if (exit_requested) return last_status; // The rc file ran exit
+    if (server_path != NULL) return run_server(server_path);
+    if (leak_runs > 0) return leak_check(leak_runs);
+    if (replay_path != NULL && (replay = replay_open(replay_path, paced)) == NULL) return 2;
+    if (record_path != NULL && record_open(record_path) < 0) return 2;
+
+    // Main command loop
+    while (1) {
+        if (getcwd(cwd, sizeof(cwd)) != NULL) { // Get current directory
+            free(prompt);
+            if (asprintf(&prompt,
+                     COLOR_RED "PucitShell " COLOR_RESET
+                     "(" COLOR_GREEN "%s" COLOR_RESET
+                     "@" COLOR_GREEN "%s" COLOR_RESET
+                     ")-[" COLOR_CYAN "%s" COLOR_RESET "] : ",
+                     username, hostname, cwd) < 0) // Set prompt
+                prompt = NULL;
+        } else {
+            perror("getcwd() error");
+            return 1;
+        }
+
+        recall_pos = 0; // Every new line starts recall from the newest entry
+        // Read command input, or take it from the session being replayed
+        cmdline = replay != NULL ? replay_next(replay) : read_full_command(prompt);
+        if (cmdline == NULL) break; // Exit if EOF
+        char *typed = session_log.fp != NULL ? strdup(cmdline) : NULL;
+        struct timespec t_cmd;
+        clock_gettime(CLOCK_MONOTONIC, &t_cmd);
+
+        if (strlen(cmdline) > 0) {
+            // Handle history commands like !N and !-N
+            if (cmdline[0] == '!') {
+                char *newcmd = fetch_from_history(cmdline);
+                if (newcmd) {
+                    printf("Repeating command: %s\n", newcmd);
+                    free(cmdline);
+                    cmdline = newcmd; // Replace with actual command
+                } else {
+                    free(cmdline);
+                    cmdline = NULL; // Not found; still logged and replayed
+                }
             }
-            for (int j = 0; arglist[j] != NULL; j++) free(arglist[j]);
-            free(arglist);
+            if (cmdline != NULL) add_to_history(cmdline); // Add to the interned history
         }
+
+        if (cmdline != NULL) run_command_line(cmdline);
         free(cmdline);
+        double latency = ms_since(&t_cmd);
+        if (typed != NULL) record_command(typed, cwd, &t_cmd, latency, last_status);
+        if (replay != NULL) replay_check(replay, cwd, latency, last_status);
+        free(typed);
+        if (exit_requested) break;
+    }
+    if (replay != NULL) {
+        fflush(stdout);
+        return replay_report(replay) ? 1 : last_status;
     }
     printf("\n");
-    return 0;
+    return last_status;
 }